@@ -0,0 +1,19 @@
+#include <signal.h>
+
+#include "CancelToken.h"
+
+static CancelToken *interruptToken = NULL;
+
+static void interrupted( int )
+{
+	// cancel() is a lock-free store, safe in a handler
+	if( interruptToken )
+		interruptToken->cancel();
+	signal( SIGINT, SIG_DFL );
+}
+
+void CancelToken::cancelOnInterrupt()
+{
+	interruptToken = this;
+	signal( SIGINT, interrupted );
+}
@@ -0,0 +1,70 @@
+#ifndef __CANCELTOKEN_H__
+#define __CANCELTOKEN_H__
+
+// Tells a render to stop: cancel() from any thread, or a deadline.  The
+// render loops look at it between tiles, rows and samples.  stopped() is
+// a relaxed atomic load and is what the inner loops use; only expired()
+// reads the clock, and it is called between tiles and rows, so a deadline
+// takes effect within one of those.  A render that stops leaves out what
+// it hadn't started.
+//
+// One token can be shared by several ray tracers, to stop all of a
+// client's jobs at once say.
+
+#include <atomic>
+#include <chrono>
+
+class CancelToken
+{
+public:
+	CancelToken() : flag( false ), hasDeadline( false ) {}
+
+	void cancel() { flag.store( true, std::memory_order_relaxed ); }
+
+	// Stop once seconds from now have passed, 0 for never.  Set before
+	// the render starts, not during it.
+	void setDeadline( double seconds )
+	{
+		hasDeadline = seconds > 0.0;
+		if( hasDeadline )
+			deadline = std::chrono::steady_clock::now()
+				+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+					std::chrono::duration<double>( seconds ) );
+	}
+
+	// Not cancelled, no deadline.
+	void reset()
+	{
+		flag.store( false, std::memory_order_relaxed );
+		hasDeadline = false;
+	}
+
+	bool stopped() const { return flag.load( std::memory_order_relaxed ); }
+
+	// The first Ctrl-C (SIGINT) from now on cancels this token, and the
+	// one after that kills the process as usual.  One token at a time.
+	void cancelOnInterrupt();
+
+	// stopped(), or the deadline has passed, which then counts as a
+	// cancel().
+	bool expired() const
+	{
+		if( stopped() )
+			return true;
+		if( hasDeadline && std::chrono::steady_clock::now() >= deadline ) {
+			flag.store( true, std::memory_order_relaxed );
+			return true;
+		}
+		return false;
+	}
+
+private:
+	mutable std::atomic<bool> flag;
+	bool hasDeadline;
+	std::chrono::steady_clock::time_point deadline;
+
+	CancelToken( const CancelToken& );
+	CancelToken& operator =( const CancelToken& );
+};
+
+#endif // __CANCELTOKEN_H__
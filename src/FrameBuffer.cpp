@@ -0,0 +1,121 @@
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+#include "FrameBuffer.h"
+
+FrameBuffer::FrameBuffer()
+	: data( NULL ), counts( NULL ), width( 0 ), height( 0 )
+{
+}
+
+FrameBuffer::~FrameBuffer()
+{
+	delete [] data;
+	delete [] counts;
+}
+
+void FrameBuffer::resize( int w, int h )
+{
+	if( w != width || h != height ) {
+		delete [] data;
+		delete [] counts;
+		width = w;
+		height = h;
+		data = new float[ width * height * 3 ];
+		counts = new int[ width * height ];
+	}
+	clear();
+}
+
+void FrameBuffer::clear()
+{
+	clearRows( 0, height );
+}
+
+void FrameBuffer::clearRows( int start, int stop )
+{
+	if( stop > height )
+		stop = height;
+	if( data && start < stop ) {
+		size_t first = (size_t)start * width;
+		size_t n = (size_t)(stop - start) * width;
+		memset( data + first * 3, 0, sizeof(float) * n * 3 );
+		memset( counts + first, 0, sizeof(int) * n );
+	}
+}
+
+vec3f FrameBuffer::getAverage( int i, int j ) const
+{
+	int n = counts[i + j * width];
+	if( n == 0 )
+		return vec3f( 0.0, 0.0, 0.0 );
+
+	const float *p = data + (i + j * width) * 3;
+	return vec3f( p[0], p[1], p[2] ) / n;
+}
+
+static unsigned char toneMapChannel( const ToneMap& tm, double scale, double v )
+{
+	v *= scale;
+	if( tm.reinhard )
+		v = v / (1.0 + v);
+	if( v <= 0.0 )
+		return 0;
+	if( tm.gamma != 1.0 )
+		v = pow( v, 1.0 / tm.gamma );
+	if( v >= 1.0 )
+		return 255;
+	return (unsigned char)(255.0 * v);
+}
+
+void FrameBuffer::quantizePixel( const ToneMap& tm, unsigned char *out, int i, int j,
+	int rowBytes ) const
+{
+	if( rowBytes == 0 )
+		rowBytes = width * 3;
+	double scale = pow( 2.0, tm.exposure );
+	vec3f col = getAverage( i, j );
+	unsigned char *pixel = out + (ptrdiff_t)j * rowBytes + i * 3;
+
+	pixel[0] = toneMapChannel( tm, scale, col[0] );
+	pixel[1] = toneMapChannel( tm, scale, col[1] );
+	pixel[2] = toneMapChannel( tm, scale, col[2] );
+}
+
+void FrameBuffer::quantize( const ToneMap& tm, unsigned char *out, int start, int stop,
+	int rowBytes ) const
+{
+	if( stop > height )
+		stop = height;
+	if( rowBytes == 0 )
+		rowBytes = width * 3;
+
+	double scale = pow( 2.0, tm.exposure );
+	for( int j = start; j < stop; ++j ) {
+		unsigned char *row = out + (ptrdiff_t)j * rowBytes;
+		for( int i = 0; i < width; ++i ) {
+			vec3f col = getAverage( i, j );
+			unsigned char *pixel = row + i * 3;
+
+			pixel[0] = toneMapChannel( tm, scale, col[0] );
+			pixel[1] = toneMapChannel( tm, scale, col[1] );
+			pixel[2] = toneMapChannel( tm, scale, col[2] );
+		}
+	}
+}
+
+float *FrameBuffer::resolve() const
+{
+	float *out = new float[ width * height * 3 ];
+	for( int j = 0; j < height; ++j ) {
+		for( int i = 0; i < width; ++i ) {
+			vec3f col = getAverage( i, j );
+			float *p = out + (i + j * width) * 3;
+			p[0] = (float)col[0];
+			p[1] = (float)col[1];
+			p[2] = (float)col[2];
+		}
+	}
+	return out;
+}
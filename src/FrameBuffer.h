@@ -0,0 +1,74 @@
+#ifndef __FRAMEBUFFER_H__
+#define __FRAMEBUFFER_H__
+
+// Linear, unclamped radiance accumulated per pixel, plus the number of
+// samples that went into it.  The 8-bit image shown and saved is derived
+// from this by quantize(), which can be re-run with different tone mapping
+// settings without tracing a single ray.
+//
+// Rows are stored bottom to top, like the 8-bit buffer.
+
+#include "vecmath/vecmath.h"
+
+// How linear radiance becomes an 8-bit value.  The defaults reproduce the
+// plain clamp-and-truncate of the original renderer.
+struct ToneMap
+{
+	ToneMap() : exposure( 0.0 ), gamma( 1.0 ), reinhard( false ) {}
+
+	double exposure;	// in stops, the radiance is scaled by 2^exposure
+	double gamma;		// display gamma, 1.0 for none
+	bool reinhard;		// compress highlights with x/(1+x) instead of clipping
+};
+
+class FrameBuffer
+{
+public:
+	FrameBuffer();
+	~FrameBuffer();
+
+	void resize( int w, int h );
+	void clear();
+	void clearRows( int start, int stop );
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+
+	// Add n samples whose radiance sums to col.
+	void addSample( int i, int j, const vec3f& col, int n = 1 )
+	{
+		float *p = data + (i + j * width) * 3;
+		p[0] += (float)col[0];
+		p[1] += (float)col[1];
+		p[2] += (float)col[2];
+		counts[i + j * width] += n;
+	}
+
+	int getSamples( int i, int j ) const { return counts[i + j * width]; }
+	vec3f getSum( int i, int j ) const
+	{
+		const float *p = data + (i + j * width) * 3;
+		return vec3f( p[0], p[1], p[2] );
+	}
+	vec3f getAverage( int i, int j ) const;
+
+	// Write the tone mapped average of rows [start,stop) into an 8-bit
+	// RGB buffer of the same size, its rows rowBytes apart (0 for packed
+	// rows; negative for a buffer stored top row first, out then being
+	// the bottom row).
+	void quantize( const ToneMap& tm, unsigned char *out,
+		int start = 0, int stop = 10000000, int rowBytes = 0 ) const;
+	void quantizePixel( const ToneMap& tm, unsigned char *out, int i, int j,
+		int rowBytes = 0 ) const;
+
+	// Averaged radiance as packed RGB floats, bottom row first.  The
+	// caller owns the returned array.
+	float *resolve() const;
+
+private:
+	float *data;		// summed radiance, 3 floats per pixel
+	int *counts;		// samples per pixel
+	int width, height;
+};
+
+#endif // __FRAMEBUFFER_H__
@@ -0,0 +1,42 @@
+#include "GBuffer.h"
+#include "scene/scene.h"
+
+GBuffer::GBuffer()
+	: samples( NULL ), width( 0 ), height( 0 ), perPixel( 0 ), geometryVersion( 0 )
+{
+}
+
+GBuffer::~GBuffer()
+{
+	delete [] samples;
+}
+
+void GBuffer::release()
+{
+	delete [] samples;
+	samples = NULL;
+	width = height = perPixel = 0;
+}
+
+bool GBuffer::prepare( Scene *scene, int w, int h, int n )
+{
+	if( fits( w, h, n ) && geometryVersion == scene->geometryVersion()
+		&& camera.sameRays( *scene->getCamera() ) )
+		return true;
+
+	if( !fits( w, h, n ) ) {
+		release();
+		width = w;
+		height = h;
+		perPixel = n * n;
+		samples = new Sample[ (size_t)width * height * perPixel ];
+	} else {
+		size_t count = (size_t)width * height * perPixel;
+		for( size_t k = 0; k < count; ++k )
+			samples[k].state = Sample::EMPTY;
+	}
+
+	camera = *scene->getCamera();
+	geometryVersion = scene->geometryVersion();
+	return false;
+}
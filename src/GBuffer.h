@@ -0,0 +1,62 @@
+#ifndef __GBUFFER_H__
+#define __GBUFFER_H__
+
+// The primary hit of every sample of the last render: which object, where,
+// its normal, texture coordinates and pixel footprint.  While the camera,
+// the image size, the sampling and the scene geometry stay the same, a
+// render can start from these instead of intersecting the camera rays
+// again, and only shading and the secondary rays are redone.  That is
+// what changing lights or materials needs.
+//
+// Samples are filled in as they are first traced, so a render that was
+// stopped part way leaves the rest to be intersected next time.  Like the
+// frame buffer, rows are stored bottom to top.
+
+#include "scene/ray.h"
+#include "scene/camera.h"
+
+class Scene;
+
+class GBuffer
+{
+public:
+	struct Sample
+	{
+		enum State { EMPTY, MISS, HIT };
+
+		Sample() : state( EMPTY ) {}
+
+		State state;
+		isect hit;		// valid if state == HIT
+	};
+
+	GBuffer();
+	~GBuffer();
+
+	// Get ready for a render of the scene at w x h with n x n samples per
+	// pixel.  Returns true if the samples of the previous render still
+	// apply; otherwise they are all emptied.
+	bool prepare( Scene *scene, int w, int h, int n );
+
+	// Free the samples; the next prepare() starts from scratch.
+	void release();
+
+	bool fits( int w, int h, int n ) const
+	{ return samples && w == width && h == height && n * n == perPixel; }
+
+	// the n x n samples of pixel (i,j), x major
+	Sample *pixel( int i, int j ) { return samples + ((size_t)i + (size_t)j * width) * perPixel; }
+
+private:
+	Sample *samples;
+	int width, height, perPixel;
+
+	// what primary visibility depended on
+	Camera camera;
+	unsigned long geometryVersion;
+
+	GBuffer( const GBuffer& );
+	GBuffer& operator =( const GBuffer& );
+};
+
+#endif // __GBUFFER_H__
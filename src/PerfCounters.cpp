@@ -0,0 +1,435 @@
+#include <string.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "PerfCounters.h"
+#include "RenderThread.h"
+
+typedef unsigned long long Count;
+
+// What one thread, or every thread with the same render thread number,
+// counted.
+struct PhaseCounts
+{
+	Count c[PerfCounters::PHASES][PerfCounters::COUNTERS];
+
+	void clear() { memset( c, 0, sizeof(c) ); }
+	void add( const PhaseCounts& other )
+	{
+		for( int p = 0; p < PerfCounters::PHASES; ++p )
+			for( int k = 0; k < PerfCounters::COUNTERS; ++k )
+				c[p][k] += other.c[p][k];
+	}
+};
+
+static const char *PHASE_NAMES[PerfCounters::PHASES] = {
+	"other", "parse", "init", "primary", "shading", "shadow", "secondary", "output"
+};
+
+static const char *COUNTER_NAMES[PerfCounters::COUNTERS] = {
+	"task_clock_ns", "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+};
+
+bool PerfCounters::on = false;
+
+// Row 0 is the threads without a render thread number, row t + 1 render
+// thread t.
+static const int ROWS = MAX_RENDER_THREADS + 1;
+
+class ThreadCounters;
+
+// Taken before a thread's own lock, never after.
+static std::mutex s_lock;
+static PhaseCounts s_done[ROWS];					// threads that are done, by row
+static std::vector<ThreadCounters*> s_live;		// threads still counting
+static bool s_available[PerfCounters::COUNTERS];	// opened when enable() tried
+
+#ifdef __linux__
+
+static const struct { unsigned int type; unsigned long long config; } EVENTS[PerfCounters::COUNTERS] = {
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+		| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+		| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+// The hardware counters go first, so that one of them leads the group; a
+// software leader can't take them in.
+static const int OPEN_ORDER[PerfCounters::COUNTERS] = {
+	PerfCounters::CYCLES, PerfCounters::INSTRUCTIONS, PerfCounters::L1D_MISSES,
+	PerfCounters::LLC_MISSES, PerfCounters::BRANCH_MISSES, PerfCounters::TASK_CLOCK
+};
+
+// Counter c of the calling thread, user space only, in group (-1 to lead
+// a new one).
+static int openCounter( int c, int group )
+{
+	perf_event_attr a;
+	memset( &a, 0, sizeof(a) );
+	a.size = sizeof(a);
+	a.type = EVENTS[c].type;
+	a.config = EVENTS[c].config;
+	a.read_format = PERF_FORMAT_GROUP;
+	a.exclude_kernel = 1;
+	a.exclude_hv = 1;
+	return (int)syscall( SYS_perf_event_open, &a, 0, -1, group, 0 );
+}
+
+// The calling thread's counters, one group read all at once, and what
+// they counted in each phase.  Other threads read them through collect()
+// while the thread runs, and they are handed to the totals when it ends.
+class ThreadCounters
+{
+public:
+	ThreadCounters() : opened( false ), row( 0 ), leader( -1 ), members( 0 ),
+		phase( PerfCounters::OTHER )
+	{
+		for( int k = 0; k < PerfCounters::COUNTERS; ++k ) {
+			fds[k] = -1;
+			position[k] = -1;
+			last[k] = 0;
+		}
+		counts.clear();
+	}
+
+	~ThreadCounters()
+	{
+		if( !opened )
+			return;
+		{
+			std::lock_guard<std::mutex> guard( s_lock );
+			std::lock_guard<std::mutex> own( lock );
+			take();
+			s_done[row].add( counts );
+			s_live.erase( std::find( s_live.begin(), s_live.end(), this ) );
+		}
+		for( int k = 0; k < PerfCounters::COUNTERS; ++k )
+			if( fds[k] >= 0 )
+				close( fds[k] );
+	}
+
+	PerfCounters::Phase enter( PerfCounters::Phase p )
+	{
+		if( !opened )
+			open();
+		PerfCounters::Phase previous = phase;
+		if( p != phase ) {
+			std::lock_guard<std::mutex> own( lock );
+			take();
+			phase = p;
+		}
+		return previous;
+	}
+
+	// Add what the thread counted so far to into, from any thread.
+	void collect( PhaseCounts& into )
+	{
+		std::lock_guard<std::mutex> own( lock );
+		take();
+		into.add( counts );
+	}
+
+	void clear()
+	{
+		std::lock_guard<std::mutex> own( lock );
+		take();
+		counts.clear();
+	}
+
+	bool opened;
+	int row;
+
+private:
+	// charge what was counted since the last read to the current phase;
+	// called with lock held
+	void take()
+	{
+		Count values[1 + PerfCounters::COUNTERS];
+		if( leader < 0 || read( leader, values, sizeof(values) ) < (ssize_t)sizeof(Count) )
+			return;
+		for( int k = 0; k < PerfCounters::COUNTERS; ++k ) {
+			if( position[k] < 0 || position[k] >= (int)values[0] )
+				continue;
+			Count v = values[1 + position[k]];
+			counts.c[phase][k] += v - last[k];
+			last[k] = v;
+		}
+	}
+
+	void open()
+	{
+		opened = true;
+		row = isRenderThread() ? 1 + renderThreadIndex() : 0;
+		for( int n = 0; n < PerfCounters::COUNTERS; ++n ) {
+			int k = OPEN_ORDER[n];
+			if( !s_available[k] )
+				continue;
+			fds[k] = openCounter( k, leader );
+			if( fds[k] < 0 )
+				continue;
+			if( leader < 0 )
+				leader = fds[k];
+			position[k] = members++;
+		}
+		std::lock_guard<std::mutex> guard( s_lock );
+		s_live.push_back( this );
+	}
+
+	std::mutex lock;		// for counts, last and phase while others read
+	PhaseCounts counts;
+	int leader;
+	int members;
+	int fds[PerfCounters::COUNTERS];
+	int position[PerfCounters::COUNTERS];	// in what the group read gives
+	Count last[PerfCounters::COUNTERS];
+	PerfCounters::Phase phase;
+};
+
+static thread_local ThreadCounters t_counters;
+
+bool PerfCounters::enable( std::string& error )
+{
+	// see which counters there are by opening them once here
+	int fds[COUNTERS];
+	int leader = -1, failure = 0;
+	for( int n = 0; n < COUNTERS; ++n ) {
+		int k = OPEN_ORDER[n];
+		fds[k] = openCounter( k, leader );
+		s_available[k] = fds[k] >= 0;
+		if( fds[k] < 0 && !failure )
+			failure = errno;
+		if( fds[k] >= 0 && leader < 0 )
+			leader = fds[k];
+	}
+	for( int k = 0; k < COUNTERS; ++k )
+		if( fds[k] >= 0 )
+			close( fds[k] );
+
+	if( leader < 0 ) {
+		error = std::string( "no performance counters: " ) + strerror( failure )
+			+ " (see /proc/sys/kernel/perf_event_paranoid)";
+		return false;
+	}
+	on = true;
+	return true;
+}
+
+PerfCounters::Phase PerfCounters::enter( Phase p )
+{
+	return on ? t_counters.enter( p ) : OTHER;
+}
+
+void PerfCounters::reset()
+{
+	std::lock_guard<std::mutex> guard( s_lock );
+	for( int k = 0; k < ROWS; ++k )
+		s_done[k].clear();
+	for( size_t k = 0; k < s_live.size(); ++k )
+		s_live[k]->clear();
+}
+
+// The totals by row, with what the running threads counted so far.
+static void snapshot( PhaseCounts *threads )
+{
+	std::lock_guard<std::mutex> guard( s_lock );
+	for( int k = 0; k < ROWS; ++k )
+		threads[k] = s_done[k];
+	for( size_t k = 0; k < s_live.size(); ++k )
+		s_live[k]->collect( threads[s_live[k]->row] );
+}
+
+#else
+
+bool PerfCounters::enable( std::string& error )
+{
+	error = "performance counters need Linux perf_event_open";
+	return false;
+}
+
+PerfCounters::Phase PerfCounters::enter( Phase p )
+{
+	return OTHER;
+}
+
+void PerfCounters::reset()
+{
+}
+
+static void snapshot( PhaseCounts *threads )
+{
+	for( int k = 0; k < ROWS; ++k )
+		threads[k].clear();
+}
+
+#endif // __linux__
+
+static bool counted( const Count *c )
+{
+	for( int k = 0; k < PerfCounters::COUNTERS; ++k )
+		if( c[k] )
+			return true;
+	return false;
+}
+
+// Whether the rays were split into phases, which only the wavefront
+// integrator does; a path at a time, primary has them all.
+static bool raysSplit( const PhaseCounts& phases )
+{
+	return counted( phases.c[PerfCounters::SHADING] ) || counted( phases.c[PerfCounters::SHADOW] )
+		|| counted( phases.c[PerfCounters::SECONDARY] ) || !counted( phases.c[PerfCounters::PRIMARY] );
+}
+
+static void printHeader( FILE *fp, const char *name )
+{
+	fprintf( fp, "  %-10s %10s %10s %10s %5s %9s %9s %9s\n", name,
+		"ms", "Mcycles", "Minstr", "IPC", "L1D/Kins", "LLC/Kins", "br/Kins" );
+}
+
+// Milliseconds, millions of cycles and instructions, instructions per
+// cycle, and misses per thousand instructions; "-" for what the machine
+// doesn't count.
+static void printRow( FILE *fp, const char *name, const Count *c )
+{
+	bool instructions = s_available[PerfCounters::INSTRUCTIONS] && c[PerfCounters::INSTRUCTIONS];
+	fprintf( fp, "  %-10s", name );
+	if( s_available[PerfCounters::TASK_CLOCK] )
+		fprintf( fp, " %10.1f", c[PerfCounters::TASK_CLOCK] / 1e6 );
+	else
+		fprintf( fp, " %10s", "-" );
+	for( int k = PerfCounters::CYCLES; k <= PerfCounters::INSTRUCTIONS; ++k ) {
+		if( s_available[k] )
+			fprintf( fp, " %10.1f", c[k] / 1e6 );
+		else
+			fprintf( fp, " %10s", "-" );
+	}
+	if( instructions && s_available[PerfCounters::CYCLES] && c[PerfCounters::CYCLES] )
+		fprintf( fp, " %5.2f", (double)c[PerfCounters::INSTRUCTIONS] / c[PerfCounters::CYCLES] );
+	else
+		fprintf( fp, " %5s", "-" );
+	for( int k = PerfCounters::L1D_MISSES; k <= PerfCounters::BRANCH_MISSES; ++k ) {
+		if( instructions && s_available[k] )
+			fprintf( fp, " %9.2f", 1000.0 * c[k] / c[PerfCounters::INSTRUCTIONS] );
+		else
+			fprintf( fp, " %9s", "-" );
+	}
+	fprintf( fp, "\n" );
+}
+
+// A row's name: main, or the render thread number.
+static void rowName( char *name, int row )
+{
+	if( row == 0 )
+		strcpy( name, "main" );
+	else
+		sprintf( name, "%d", row - 1 );
+}
+
+void PerfCounters::print( FILE *fp )
+{
+	std::vector<PhaseCounts> threads( ROWS );
+	snapshot( &threads[0] );
+
+	PhaseCounts phases;
+	phases.clear();
+	for( int t = 0; t < ROWS; ++t )
+		phases.add( threads[t] );
+
+	Count total[COUNTERS] = { 0 };
+	for( int p = 0; p < PHASES; ++p )
+		for( int k = 0; k < COUNTERS; ++k )
+			total[k] += phases.c[p][k];
+
+	fprintf( fp, "performance counters by phase\n" );
+	printHeader( fp, "phase" );
+	for( int p = 0; p < PHASES; ++p )
+		if( counted( phases.c[p] ) )
+			printRow( fp, PHASE_NAMES[p], phases.c[p] );
+	printRow( fp, "total", total );
+	if( !raysSplit( phases ) )
+		fprintf( fp, "  (traced a path at a time: primary includes shading, shadow and\n"
+			"  secondary rays; --wavefront counts them apart)\n" );
+
+	fprintf( fp, "by thread\n" );
+	printHeader( fp, "thread" );
+	for( int t = 0; t < ROWS; ++t ) {
+		Count sum[COUNTERS] = { 0 };
+		for( int p = 0; p < PHASES; ++p )
+			for( int k = 0; k < COUNTERS; ++k )
+				sum[k] += threads[t].c[p][k];
+		if( !counted( sum ) )
+			continue;
+		char name[16];
+		rowName( name, t );
+		printRow( fp, name, sum );
+	}
+}
+
+static void writeCounts( FILE *fp, const Count *c )
+{
+	fprintf( fp, "{" );
+	const char *separator = " ";
+	for( int k = 0; k < PerfCounters::COUNTERS; ++k ) {
+		if( !s_available[k] )
+			continue;
+		fprintf( fp, "%s\"%s\": %llu", separator, COUNTER_NAMES[k], c[k] );
+		separator = ", ";
+	}
+	fprintf( fp, " }" );
+}
+
+void PerfCounters::writeJson( FILE *fp )
+{
+	std::vector<PhaseCounts> threads( ROWS );
+	snapshot( &threads[0] );
+
+	PhaseCounts phases;
+	phases.clear();
+	for( int t = 0; t < ROWS; ++t )
+		phases.add( threads[t] );
+
+	fprintf( fp, "{\n  \"counters\": [" );
+	const char *separator = " ";
+	for( int k = 0; k < COUNTERS; ++k ) {
+		if( !s_available[k] )
+			continue;
+		fprintf( fp, "%s\"%s\"", separator, COUNTER_NAMES[k] );
+		separator = ", ";
+	}
+	fprintf( fp, " ],\n  \"rays_split\": %s,\n  \"phases\": {", raysSplit( phases ) ? "true" : "false" );
+	for( int p = 0; p < PHASES; ++p ) {
+		fprintf( fp, "%s\n    \"%s\": ", p ? "," : "", PHASE_NAMES[p] );
+		writeCounts( fp, phases.c[p] );
+	}
+	fprintf( fp, "\n  },\n  \"threads\": [" );
+	separator = "";
+	for( int t = 0; t < ROWS; ++t ) {
+		bool any = false;
+		for( int p = 0; p < PHASES; ++p )
+			any = any || counted( threads[t].c[p] );
+		if( !any )
+			continue;
+		char name[16];
+		rowName( name, t );
+		fprintf( fp, "%s\n    { \"thread\": \"%s\", \"phases\": {", separator, name );
+		for( int p = 0; p < PHASES; ++p ) {
+			fprintf( fp, "%s\n      \"%s\": ", p ? "," : "", PHASE_NAMES[p] );
+			writeCounts( fp, threads[t].c[p] );
+		}
+		fprintf( fp, "\n    } }" );
+		separator = ",";
+	}
+	fprintf( fp, "\n  ]\n}\n" );
+}
@@ -0,0 +1,101 @@
+#ifndef __PERFCOUNTERS_H__
+#define __PERFCOUNTERS_H__
+
+// Hardware counters per render phase and per thread, to tell whether a
+// scene is bound by computation or by memory: cycles, instructions, L1
+// data and last level cache read misses, branch misses, and the thread's
+// own clock.  They come from Linux perf_event_open, counting user space
+// only, and are off unless enable() is called; the phase changes are then
+// a test of one flag.
+//
+// Every thread opens its own counters the first time it changes phase and
+// reads them at every change after that, a system call each time.  So
+// that the reads stay small next to what they measure, phases change per
+// tile and per wave of rays, never per ray: rendering a path at a time,
+// all of a tile is primary, and only the wavefront integrator, whose waves
+// are a few thousand rays and whose shadow rays are a stage of their own,
+// splits it into finding hits of camera rays, shading, shadow rays, and
+// finding hits of secondary rays.  The report says when it wasn't split.
+// Entering the phase a thread is already in reads nothing.  Counts go to
+// the phase the thread was in, and are kept by render thread number (see
+// RenderThread.h); threads without one, like the one that loads and saves
+// the scene or the server's client threads, share a row of their own
+// called main.  Threads that are still running, like the render
+// scheduler's, are read when the report is made.  Counters the machine
+// doesn't have (in a virtual machine, say) are left out of the report.
+
+#include <stdio.h>
+#include <string>
+
+class PerfCounters
+{
+public:
+	enum Phase
+	{
+		OTHER,			// not in any of the others: tiles, tone mapping, waiting
+		PARSE,			// reading scene files
+		INIT,			// BVH builds and refits, posing animated scenes
+		PRIMARY,		// camera rays, and a path at a time all they lead to
+		SHADING,		// wavefront: shading hits, but for their shadow rays
+		SHADOW,			// wavefront: shadow rays
+		SECONDARY,		// wavefront: hits of reflected and refracted rays
+		OUTPUT,			// writing images
+		PHASES
+	};
+
+	enum Counter
+	{
+		TASK_CLOCK,		// nanoseconds
+		CYCLES,
+		INSTRUCTIONS,
+		L1D_MISSES,
+		LLC_MISSES,
+		BRANCH_MISSES,
+		COUNTERS
+	};
+
+	// Start counting; false, with the reason, if there are no counters at
+	// all.  Call before the threads to be measured start.
+	static bool enable( std::string& error );
+	static bool enabled() { return on; }
+
+	// Move the calling thread to phase p, returning the one it was in.
+	static Phase enter( Phase p );
+
+	static void reset();
+
+	// What was counted so far by every thread, running or done: a table
+	// of phases and one of threads, or the same as JSON with every phase
+	// of every thread.  reset() clears all of them.
+	static void print( FILE *fp );
+	static void writeJson( FILE *fp );
+
+private:
+	static bool on;
+};
+
+// The calling thread is in phase p for as long as this is in scope.
+class PerfPhase
+{
+public:
+	PerfPhase( PerfCounters::Phase p )
+		: active( PerfCounters::enabled() ), previous( PerfCounters::OTHER )
+	{
+		if( active )
+			previous = PerfCounters::enter( p );
+	}
+	~PerfPhase()
+	{
+		if( active )
+			PerfCounters::enter( previous );
+	}
+
+private:
+	bool active;
+	PerfCounters::Phase previous;
+
+	PerfPhase( const PerfPhase& );
+	PerfPhase& operator =( const PerfPhase& );
+};
+
+#endif // __PERFCOUNTERS_H__
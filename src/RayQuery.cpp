@@ -0,0 +1,132 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "RayQuery.h"
+#include "RenderThread.h"
+#include "scene/scene.h"
+#include "scene/ray.h"
+
+// A batch being worked on: the threads take CHUNK rays at a time.
+struct RayQuery::Job
+{
+	const RayBatch *rays;
+	HitBatch *hits;				// closest hits, or
+	unsigned int *blocked;		// occlusion bits
+	std::atomic<int> next;
+};
+
+RayQuery::RayQuery( const Scene *s, int n, int first )
+	: scene( s ), threads( n ), firstThread( first ), primitives( 0 )
+{
+	if( threads <= 0 )
+		threads = std::thread::hardware_concurrency();
+	if( threads < 1 )
+		threads = 1;
+	if( firstThread < 0 || firstThread >= MAX_RENDER_THREADS )
+		firstThread = 0;
+	if( threads > MAX_RENDER_THREADS - firstThread )
+		threads = MAX_RENDER_THREADS - firstThread;
+
+	for( Scene::cgiter j = scene->beginObjects(); j != scene->endObjects(); ++j )
+		++primitives;
+}
+
+// The ray's direction normalized, and the factor from world distances to
+// multiples of the direction it was given.
+static ray makeRay( const RayBatch& rays, int k, double& scale )
+{
+	vec3f d( rays.dx[k], rays.dy[k], rays.dz[k] );
+	scale = d.length();
+	if( scale > 0.0 )
+		d /= scale;
+	return ray( vec3f( rays.ox[k], rays.oy[k], rays.oz[k] ), d, ray::VISIBILITY );
+}
+
+void RayQuery::closestRange( const RayBatch& rays, HitBatch& hits, int begin, int end ) const
+{
+	for( int k = begin; k < end; ++k ) {
+		double scale;
+		ray r = makeRay( rays, k, scale );
+		isect i;
+		bool hit = scale > 0.0 && scene->intersect( r, i )
+			&& (!rays.tmax || i.t < rays.tmax[k] * scale);
+
+		if( hits.t )
+			hits.t[k] = hit ? i.t / scale : -1.0;
+		if( hits.prim )
+			hits.prim[k] = hit && i.obj ? i.obj->getIndex() : -1;
+		if( hits.nx )
+			hits.nx[k] = hit ? i.N[0] : 0.0;
+		if( hits.ny )
+			hits.ny[k] = hit ? i.N[1] : 0.0;
+		if( hits.nz )
+			hits.nz[k] = hit ? i.N[2] : 0.0;
+	}
+}
+
+void RayQuery::occludedRange( const RayBatch& rays, unsigned int *blocked, int begin, int end ) const
+{
+	// begin is a multiple of 32 and no other thread has these words
+	for( int w = begin / 32; w * 32 < end; ++w )
+		blocked[w] = 0;
+
+	for( int k = begin; k < end; ++k ) {
+		double scale;
+		ray r = makeRay( rays, k, scale );
+		if( scale > 0.0 && scene->occluded( r, rays.tmax ? rays.tmax[k] * scale : 1.0e308 ) )
+			blocked[k / 32] |= 1u << (k % 32);
+	}
+}
+
+void RayQuery::work( const RayQuery *q, Job *job, int index )
+{
+	setRenderThreadIndex( index );
+
+	int count = job->rays->count;
+	for( ;; ) {
+		int begin = job->next.fetch_add( CHUNK );
+		if( begin >= count )
+			break;
+		int end = begin + CHUNK < count ? begin + CHUNK : count;
+		if( job->hits )
+			q->closestRange( *job->rays, *job->hits, begin, end );
+		else
+			q->occludedRange( *job->rays, job->blocked, begin, end );
+	}
+}
+
+void RayQuery::run( Job& job ) const
+{
+	job.next = 0;
+	int chunks = (job.rays->count + CHUNK - 1) / CHUNK;
+	int n = chunks < threads ? chunks : threads;
+	if( n <= 1 ) {
+		work( this, &job, renderThreadIndex() );
+		return;
+	}
+
+	std::vector<std::thread> workers;
+	for( int k = 0; k < n; ++k )
+		workers.push_back( std::thread( work, this, &job, firstThread + k ) );
+	for( int k = 0; k < n; ++k )
+		workers[k].join();
+}
+
+void RayQuery::closestHit( const RayBatch& rays, HitBatch& hits ) const
+{
+	Job job;
+	job.rays = &rays;
+	job.hits = &hits;
+	job.blocked = NULL;
+	run( job );
+}
+
+void RayQuery::occluded( const RayBatch& rays, unsigned int *blocked ) const
+{
+	Job job;
+	job.rays = &rays;
+	job.hits = NULL;
+	job.blocked = blocked;
+	run( job );
+}
@@ -0,0 +1,75 @@
+#ifndef __RAYQUERY_H__
+#define __RAYQUERY_H__
+
+// Ray casts against a loaded scene for callers that want hits rather than
+// an image: visibility and line of sight in a simulation, say.  Rays come
+// in batches as separate arrays per coordinate, and a batch is spread over
+// several threads.  Only geometry is involved; materials, lights and the
+// camera are ignored, and a transparent object blocks like any other.
+//
+// Distances are in multiples of each ray's direction, which doesn't have
+// to be of unit length: with a unit direction they are world units, and
+// with the direction from a viewer to a target, tmax = 1 asks whether
+// anything is in between.  As with the renderer's own rays, hits within
+// RAY_EPSILON of the origin aren't counted, so a ray can start on a
+// surface.
+//
+// A primitive is identified by its position in the scene's object list,
+// which is the order of the file; every triangle of a mesh is one.
+
+class Scene;
+
+struct RayBatch
+{
+	int count;
+	const double *ox, *oy, *oz;		// origins
+	const double *dx, *dy, *dz;		// directions
+	const double *tmax;				// farthest hit wanted, NULL for no limit
+};
+
+// Results of closestHit(), one per ray.  Any of the arrays can be NULL if
+// it isn't wanted.
+struct HitBatch
+{
+	double *t;						// distance, or -1 for a miss
+	int *prim;						// primitive, or -1 for a miss
+	double *nx, *ny, *nz;			// unit surface normal, facing outwards
+};
+
+class RayQuery
+{
+public:
+	// The scene has to stay loaded and unchanged while this is used.
+	// threads is how many to use for a batch, 0 for one per core.  They
+	// take render thread numbers from firstThread on, as with
+	// RayTracer::traceImage(), so queries can run beside a render.
+	RayQuery( const Scene *scene, int threads = 0, int firstThread = 0 );
+
+	// The nearest hit of every ray.
+	void closestHit( const RayBatch& rays, HitBatch& hits ) const;
+
+	// Whether anything is hit: bit k % 32 of blocked[k / 32] is set for a
+	// ray k that hits something, so blocked needs (count + 31) / 32 words.
+	// Any hit will do, which makes this the cheaper of the two.
+	void occluded( const RayBatch& rays, unsigned int *blocked ) const;
+
+	int primitiveCount() const { return primitives; }
+
+	// Rays a thread takes at a time; a batch of no more than this stays
+	// on the calling thread.
+	enum { CHUNK = 256 };
+
+private:
+	struct Job;
+	static void work( const RayQuery *q, Job *job, int index );
+	void run( Job& job ) const;
+	void closestRange( const RayBatch& rays, HitBatch& hits, int begin, int end ) const;
+	void occludedRange( const RayBatch& rays, unsigned int *blocked, int begin, int end ) const;
+
+	const Scene *scene;
+	int threads;
+	int firstThread;
+	int primitives;
+};
+
+#endif // __RAYQUERY_H__
@@ -1,17 +1,36 @@
 // The main ray tracer.
 
-#include <Fl/fl_ask.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
 
 #include "RayTracer.h"
-#include "global.h"
-#include "ui/TraceUI.h"
+#include "RenderThread.h"
+#include "PerfCounters.h"
 
 #include "scene/light.h"
 #include "scene/material.h"
 #include "scene/ray.h"
+#include "scene/environment.h"
+#include "scene/animation.h"
 
 #include "fileio/read.h"
 #include "fileio/parse.h"
+#include "fileio/bitmap.h"
+#include "fileio/hdrimage.h"
+#include "fileio/imagewriter.h"
+#include "fileio/partial.h"
 
 #define 	M_PI   3.14159265358979323846	/* pi */
 
@@ -19,108 +38,310 @@
 // through the projection plane, and out into the scene.  All we do is
 // enter the main ray-tracing method, getting things started by plugging
 // in an initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
-vec3f RayTracer::trace( Scene *scene, double x, double y )
+// The result is linear and unclamped; the tone map takes care of that.
+vec3f RayTracer::trace( Scene *scene, double x, double y, GBuffer::Sample *cached )
 {
+	PerfPhase phase( PerfCounters::PRIMARY );
     ray r( vec3f(0,0,0), vec3f(0,0,0), ray::VISIBILITY);
-    scene->getCamera()->rayThrough( x,y,r );
-	return traceRay(scene, r, vec3f(1.0, 1.0, 1.0), traceUI->getDepth()).clamp();
+	cameraRay(scene, x, y, r);
+
+	if (!cached)
+		return traceRay(scene, r, vec3f(1.0, 1.0, 1.0), maxDepth);
+
+	// relighting: the camera ray's hit is only looked for once
+	if (cached->state == GBuffer::Sample::EMPTY)
+		cached->state = findHit(scene, r, cached->hit) ? GBuffer::Sample::HIT : GBuffer::Sample::MISS;
+	if (cached->state == GBuffer::Sample::MISS)
+		return escaped(scene, r);
+	return shadeHit(scene, r, cached->hit, vec3f(1.0, 1.0, 1.0), maxDepth);
+}
+
+void RayTracer::cameraRay( Scene *scene, double x, double y, ray& r )
+{
+	// differentials span one sample, for filtered texture lookups
+	double step = 1.0 / subPixel;
+	scene->getCamera()->rayThrough( x, y, step / buffer_width, step / buffer_height, r );
+}
+
+// Ray differentials of mirror reflection (Igehy, "Tracing Ray Differentials"):
+// R = D - 2 (D.N) N, differentiated with the footprint the hit recorded.
+static void reflectDifferentials( const ray& r, const isect& i, ray& reflected )
+{
+	vec3f D = r.getDirection();
+	vec3f N = i.N;
+	double DN = D * N;
+	vec3f dNdx = i.dNdx(), dNdy = i.dNdy();
+	double dDNdx = r.dDdx() * N + D * dNdx;
+	double dDNdy = r.dDdy() * N + D * dNdy;
+
+	reflected.setDifferentials(
+		i.dPdx, r.dDdx() - 2.0 * (DN * dNdx + dDNdx * N),
+		i.dPdy, r.dDdy() - 2.0 * (DN * dNdy + dDNdy * N) );
+}
+
+// ...and of refraction with relative index eta = n_i / n_t:
+// T = eta D - mu N with N facing the incoming ray, mu = eta (D.N) + cos(theta_t).
+static void refractDifferentials( const ray& r, const isect& i, double eta, ray& refracted )
+{
+	vec3f D = r.getDirection();
+	vec3f N = i.N;
+	vec3f dNdx = i.dNdx(), dNdy = i.dNdy();
+	if (D * N > 0.0) {
+		N = -N;
+		dNdx = -dNdx;
+		dNdy = -dNdy;
+	}
+
+	double DN = D * N;
+	double cosT = -(refracted.getDirection() * N);
+	double mu = eta * DN + cosT;
+	double dmu = cosT > NORMAL_EPSILON ? eta + eta * eta * DN / cosT : eta;
+
+	double dDNdx = r.dDdx() * N + D * dNdx;
+	double dDNdy = r.dDdy() * N + D * dNdy;
+
+	refracted.setDifferentials(
+		i.dPdx, eta * r.dDdx() - (mu * dNdx + dmu * dDNdx * N),
+		i.dPdy, eta * r.dDdy() - (mu * dNdy + dmu * dDNdy * N) );
 }
 
-// Do recursive ray tracing!  You'll want to insert a lot of code here
-// (or places called from here) to handle reflection, refraction, etc etc.
+// The closest hit along r, with the pixel footprint worked out if the ray
+// has differentials.
+bool RayTracer::findHit( Scene *scene, const ray& r, isect& i )
+{
+	if (!scene->intersect(r, i))
+		return false;
+
+	vec3f dPdx, dPdy;
+	if (r.footprintAt(i.t, i.N, dPdx, dPdy))
+		i.setFootprint(dPdx, dPdy);
+	return true;
+}
+
+// Do recursive ray tracing!  The recursion is kept on a stack of frames
+// rather than the call stack: see traceFrames().
 vec3f RayTracer::traceRay( Scene *scene, const ray& r, const vec3f& thresh, int depth )
+{
+	switch (depth) {
+	case 0: return traceStack<0>(scene, r, thresh);
+	case 1: return traceStack<1>(scene, r, thresh);
+	case 2: return traceStack<2>(scene, r, thresh);
+	case 3: return traceStack<3>(scene, r, thresh);
+	case 4: return traceStack<4>(scene, r, thresh);
+	case 5: return traceStack<5>(scene, r, thresh);
+	case 6: return traceStack<6>(scene, r, thresh);
+	case 7: return traceStack<7>(scene, r, thresh);
+	case 8: return traceStack<8>(scene, r, thresh);
+	case 9: return traceStack<9>(scene, r, thresh);
+	case 10: return traceStack<10>(scene, r, thresh);
+	}
+
+	// deeper than the UI goes; the frames go on the heap
+	std::vector<Frame> frames(depth + 1);
+	return traceFrames(scene, r, thresh, depth, &frames[0]);
+}
+
+// A fixed size stack for the depth, known when this is compiled, so the
+// frames live in this call's own stack frame.
+template <int DEPTH>
+vec3f RayTracer::traceStack( Scene *scene, const ray& r, const vec3f& thresh )
+{
+	Frame frames[DEPTH + 1];
+	return traceFrames(scene, r, thresh, DEPTH, frames);
+}
+
+// Start tracing r: false if that is all there is to it, with its radiance
+// in result; otherwise f is set up with r's own shading and the secondary
+// rays whose radiance is still to be added.
+bool RayTracer::openFrame( Scene *scene, const ray& r, const vec3f& thresh, int depth,
+	Frame& f, vec3f& result )
 {
 	isect i;
-	vec3f colorC;
-	if (scene->intersect(r, i)) {
-		// YOUR CODE HERE
-
-		// An intersection occurred!  We've got work to do.  For now,
-		// this code gets the material for the surface that was intersected,
-		// and asks that material to provide a color for the ray.  
-
-		// This is a great place to insert code for recursive ray tracing.
-		// Instead of just returning the result of shade(), add some
-		// more steps: add in the contributions from reflected and refracted
-		// rays.
-
-		const Material& m = i.getMaterial();
-		vec3f intensity = m.shade(scene, r, i);
-		if (depth == 0) return intensity;
-		if (thresh.length() < AdaptiveThreshold) return intensity;
-
-		vec3f Qpt = r.at(i.t);
-		vec3f minusD = -1 * r.getDirection();
-		vec3f cosVector = i.N * (minusD * i.N);
-		vec3f sinVector = cosVector + r.getDirection();
-		vec3f newThresh = thresh;
-
-		// Reflected Ray
-		if (!m.kr(i).iszero())
-		{
-			vec3f reflectedDirection = cosVector + sinVector;
-			reflectedDirection.normalize();
-			ray reflectedRay(Qpt, reflectedDirection, ray::REFLECTION);
-			newThresh = prod(newThresh, i.getMaterial().kr(i)); // change the threshold value
-			intensity = intensity + prod(m.kr(i), traceRay(scene, reflectedRay, newThresh, depth - 1));
-		}
+	if (!findHit(scene, r, i)) {
+		result = escaped(scene, r);
+		return false;
+	}
 
-		//Refracted Ray
-		if (!m.kt(i).iszero())
-		{
-			double cosineAngle = acos(i.N * r.getDirection()) * 180 / M_PI;
-			double n_i, n_r;
-			double criticalAngle = 360;
-			int iDirection;
-			// bool goingIn = true;
-			// double cosThetaI = 0;
-			if (cosineAngle > 90) // Coming into an object from air
-			{
-				n_i = 1;
-				n_r = m.index(i);
-				iDirection = 1;
-				// cosThetaI = i.N * -1 * r.d;
-			}
-			else // Going out from object to air
-			{
-				n_i = m.index(i);
-				n_r = 1;
-				// goingIn = false;
-				// cosThetaI = i.N * r.d;
-				iDirection = -1;
-			}
-			
-			double n = n_i / n_r;
-			if (1 - n * n * (1 - (minusD * i.N) * (minusD * i.N)) > 0.0) // NO total internal refraction
-			{
-				vec3f sinT = n * sinVector;
-				// vec3f cosT = (-1 * i.N) * sqrt(1 - sinT*sinT);
-				// not sure if there are any differences between the two eqn, please check!!!!!!
-				vec3f cosT = (-1 * i.N) * sqrt(1 - n * n * (1 - (minusD * i.N) * (minusD * i.N)));
-				vec3f refractedDirection = cosT + iDirection*sinT;
-				refractedDirection.normalize();
-				ray refractedRay(Qpt, iDirection * refractedDirection, ray::REFRACTION);
-				newThresh = prod(newThresh, i.getMaterial().kt(i)); // change the threshold value
-				intensity = intensity + prod(m.kt(i), traceRay(scene, refractedRay, newThresh, depth - 1));
+	const Material& m = i.getMaterial();
+	f.intensity = m.shade(scene, r, i, thresh, skipBudget);
+	if (depth == 0 || thresh.length() < AdaptiveThreshold) {
+		result = f.intensity;
+		return false;
+	}
+
+	f.thresh = thresh;
+	f.count = bounces(r, i, m, f.b);
+	f.next = 0;
+	return true;
+}
+
+// traceRay() without recursion.  frames[k] is the ray k bounces down the
+// path being followed; a ray's secondary rays are traced one after the
+// other, and each one's radiance is added to its parent's as soon as it
+// is known, in the order shadeHit() adds them, so the sums come out
+// exactly the same.  frames has room for depth + 1 of them.
+inline vec3f RayTracer::traceFrames( Scene *scene, const ray& r, const vec3f& thresh, int depth,
+	Frame *frames )
+{
+	vec3f result;
+	if (!openFrame(scene, r, thresh, depth, frames[0], result))
+		return result;
+
+	int top = 0;
+	for (;;) {
+		Frame& f = frames[top];
+		if (f.next < f.count) {
+			const Bounce& b = f.b[f.next];
+			if (openFrame(scene, b.r, prod(f.thresh, b.k), depth - top - 1, frames[top + 1], result)) {
+				++top;
+				continue;
 			}
+		} else {
+			// every secondary ray of this one is in
+			if (top == 0)
+				return f.intensity;
+			result = f.intensity;
+			--top;
 		}
-		colorC = intensity;
+
+		Frame& parent = frames[top];
+		parent.intensity = parent.intensity + prod(parent.b[parent.next].k, result);
+		++parent.next;
 	}
-	else {
-		// No intersection.  This ray travels to infinity, so we color
-		// it according to the background color, which in this (simple) case
-		// is just black.
-		colorC = vec3f (0.0, 0.0, 0.0);
+}
+
+// No intersection.  This ray travels to infinity, so we color it according
+// to the background: the environment map filtered over the ray's
+// footprint, or black if there is none.
+vec3f RayTracer::escaped( Scene *scene, const ray& r )
+{
+	const EnvironmentMap *env = background ? background : scene->getEnvironment();
+	return env ? env->value(r) : vec3f (0.0, 0.0, 0.0);
+}
+
+vec3f RayTracer::shadeHit( Scene *scene, const ray& r, const isect& i, const vec3f& thresh, int depth )
+{
+	// YOUR CODE HERE
+
+	// An intersection occurred!  We've got work to do.  For now,
+	// this code gets the material for the surface that was intersected,
+	// and asks that material to provide a color for the ray.  
+
+	// This is a great place to insert code for recursive ray tracing.
+	// Instead of just returning the result of shade(), add some
+	// more steps: add in the contributions from reflected and refracted
+	// rays.
+
+	const Material& m = i.getMaterial();
+	vec3f intensity = m.shade(scene, r, i, thresh, skipBudget);
+	if (depth == 0) return intensity;
+	if (thresh.length() < AdaptiveThreshold) return intensity;
+
+	Bounce b[2];
+	int n = bounces(r, i, m, b);
+	for (int k = 0; k < n; ++k)
+		intensity = intensity + prod(b[k].k, traceRay(scene, b[k].r, prod(thresh, b[k].k), depth - 1));
+	return intensity;
+}
+
+// The reflected and refracted rays leaving a hit, in that order, each with
+// the factor (kr or kt) its radiance is scaled by.  Returns how many there
+// are: no reflection without kr, no refraction without kt or past the
+// critical angle.
+int RayTracer::bounces( const ray& r, const isect& i, const Material& m, Bounce *out )
+{
+	// findHit() only worked out a footprint if this holds
+	bool differentials = r.hasDifferentials() && fabs(r.getDirection() * i.N) >= NORMAL_EPSILON;
+	int count = 0;
+
+	vec3f Qpt = r.at(i.t);
+	vec3f minusD = -1 * r.getDirection();
+	vec3f cosVector = i.N * (minusD * i.N);
+	vec3f sinVector = cosVector + r.getDirection();
+
+	// Reflected Ray
+	if (!m.kr(i).iszero())
+	{
+		vec3f reflectedDirection = cosVector + sinVector;
+		reflectedDirection.normalize();
+		ray reflectedRay(Qpt, reflectedDirection, ray::REFLECTION);
+		if (differentials)
+			reflectDifferentials(r, i, reflectedRay);
+		out[count].r = reflectedRay;
+		out[count].k = m.kr(i);
+		++count;
 	}
-	return colorC;
+
+	//Refracted Ray
+	if (!m.kt(i).iszero())
+	{
+		double cosineAngle = acos(i.N * r.getDirection()) * 180 / M_PI;
+		double n_i, n_r;
+		double criticalAngle = 360;
+		int iDirection;
+		// bool goingIn = true;
+		// double cosThetaI = 0;
+		if (cosineAngle > 90) // Coming into an object from air
+		{
+			n_i = 1;
+			n_r = m.index(i);
+			iDirection = 1;
+			// cosThetaI = i.N * -1 * r.d;
+		}
+		else // Going out from object to air
+		{
+			n_i = m.index(i);
+			n_r = 1;
+			// goingIn = false;
+			// cosThetaI = i.N * r.d;
+			iDirection = -1;
+		}
+		
+		double n = n_i / n_r;
+		if (1 - n * n * (1 - (minusD * i.N) * (minusD * i.N)) > 0.0) // NO total internal refraction
+		{
+			vec3f sinT = n * sinVector;
+			// vec3f cosT = (-1 * i.N) * sqrt(1 - sinT*sinT);
+			// not sure if there are any differences between the two eqn, please check!!!!!!
+			vec3f cosT = (-1 * i.N) * sqrt(1 - n * n * (1 - (minusD * i.N) * (minusD * i.N)));
+			vec3f refractedDirection = cosT + iDirection*sinT;
+			refractedDirection.normalize();
+			ray refractedRay(Qpt, iDirection * refractedDirection, ray::REFRACTION);
+			if (differentials)
+				refractDifferentials(r, i, n, refractedRay);
+			out[count].r = refractedRay;
+			out[count].k = m.kt(i);
+			++count;
+		}
+	}
+	return count;
 }
 
 RayTracer::RayTracer()
 {
 	buffer = NULL;
-	buffer_width = buffer_height = 256;
+	bufferShared = false;
+	bufferPitch = 0;
+	buffer_width = buffer_height = buffer_rows = 256;
+	cropX0 = cropY0 = 0;
+	cropX1 = cropY1 = 256;
+	firstTile = 0;
+	lastTile = INT_MAX;
+	tileOrder = TILES_ROWS;
+	focusX = focusY = 0.5;
+	checkpointSeconds = 60.0;
+	progress = NULL;
+	progressData = NULL;
+	tileListener = NULL;
+	cancelToken = &ownCancel;
 	scene = NULL;
+	background = NULL;
 	AdaptiveThreshold = 0.0;
+	maxDepth = 0;
+	updateSkipBudget();
+	subPixel = 1;
+	relight = false;
+	wavefront = false;
 
 	m_bSceneLoaded = false;
 }
@@ -128,8 +349,9 @@ RayTracer::RayTracer()
 
 RayTracer::~RayTracer()
 {
-	delete [] buffer;
+	releaseBuffer();
 	delete scene;
+	delete background;
 }
 
 void RayTracer::setAdaptiveThreshold(double thres) {
@@ -138,6 +360,7 @@ void RayTracer::setAdaptiveThreshold(double thres) {
 
 void RayTracer::getBuffer( unsigned char *&buf, int &w, int &h )
 {
+	ensureBuffer();
 	buf = buffer;
 	w = buffer_width;
 	h = buffer_height;
@@ -153,49 +376,477 @@ bool RayTracer::sceneLoaded()
 	return m_bSceneLoaded;
 }
 
+bool RayTracer::loadBackground( char* fn )
+{
+	if( !fn ) {
+		delete background;
+		background = NULL;
+		return true;
+	}
+
+	EnvironmentMap *env = new EnvironmentMap;
+	if( !env->loadLatLong( fn ) ) {
+		delete env;
+		return false;
+	}
+	delete background;
+	background = env;
+	return true;
+}
+
 bool RayTracer::loadScene( char* fn )
 {
+	// a file that doesn't parse leaves the current scene alone
+	Scene *fresh;
+	{
+		PerfPhase phase( PerfCounters::PARSE );
+		fresh = readScene( fn, &loadError );
+	}
+	if( !fresh )
+		return false;
+
+	useScene( fresh );
+	return true;
+}
+
+bool RayTracer::loadScene( istream& is, string *error )
+{
+	Scene *fresh;
 	try
 	{
-		scene = readScene( fn );
+		PerfPhase phase( PerfCounters::PARSE );
+		fresh = readScene( is );
 	}
-	catch( ParseError pe )
+	catch( ParseError& pe )
 	{
-		fl_alert( "ParseError: %s\n", pe );
+		loadError = pe.getMsg();
+		if( error )
+			*error = loadError;
 		return false;
 	}
 
-	if( !scene )
-		return false;
+	useScene( fresh );
+	return true;
+}
+
+void RayTracer::useScene( Scene *fresh )
+{
+	delete scene;
+	scene = fresh;
 	
 	buffer_width = 256;
 	buffer_height = (int)(buffer_width / scene->getCamera()->getAspectRatio() + 0.5);
+	buffer_rows = buffer_height;
 
 	bufferSize = buffer_width * buffer_height * 3;
+	releaseBuffer();
 	buffer = new unsigned char[ bufferSize ];
+	bufferPitch = buffer_width * 3;
+	memset( buffer, 0, bufferSize );
+	setCrop( 0, 0, buffer_width, buffer_height );
 	
 	// separate objects into bounded and unbounded
-	scene->initScene();
+	{
+		PerfPhase phase( PerfCounters::INIT );
+		scene->initScene();
+	}
 	
 	// Add any specialized scene loading code here
 	
 	m_bSceneLoaded = true;
+}
 
+bool RayTracer::reloadScene( char* fn, Scene::Update *report )
+{
+	if( !scene ) {
+		if( !loadScene( fn ) )
+			return false;
+		if( report ) {
+			Scene::Update u = { 0, 0, 0, true };
+			*report = u;
+		}
+		return true;
+	}
+
+	Scene *fresh;
+	{
+		PerfPhase phase( PerfCounters::PARSE );
+		fresh = readScene( fn, &loadError );
+	}
+	if( !fresh )
+		return false;
+
+	PerfPhase phase( PerfCounters::INIT );
+	Scene::Update u = scene->update( fresh );
+	delete fresh;
+	if( report )
+		*report = u;
+	return true;
+}
+
+void RayTracer::setCrop( int x0, int y0, int x1, int y1 )
+{
+	cropX0 = max( 0, min( x0, buffer_width ) );
+	cropY0 = max( 0, min( y0, buffer_height ) );
+	cropX1 = max( cropX0, min( x1, buffer_width ) );
+	cropY1 = max( cropY0, min( y1, buffer_height ) );
+}
+
+void RayTracer::setTileRange( int first, int last )
+{
+	firstTile = first > 0 ? first : 0;
+	lastTile = last;
+}
+
+int RayTracer::tileCount() const
+{
+	int across = (cropX1 - cropX0 + TILE_SIZE - 1) / TILE_SIZE;
+	int down = (cropY1 - cropY0 + TILE_SIZE - 1) / TILE_SIZE;
+	return across * down;
+}
+
+void RayTracer::getTileRange( int& first, int& last ) const
+{
+	first = firstTile;
+	last = min( lastTile, tileCount() - 1 );
+}
+
+void RayTracer::traceTile( int t )
+{
+	int x0, y0, x1, y1;
+	getTileRect( t, x0, y0, x1, y1 );
+	traceRect( x0, y0, x1, y1 );
+	// a tile stopped halfway isn't finished
+	if( tileListener && !isCancelled() )
+		tileListener->tileFinished( t, x0, y0, x1, y1 );
+}
+
+void RayTracer::getTileRect( int t, int& x0, int& y0, int& x1, int& y1 ) const
+{
+	PartialRect r;
+	tileRect( t, r );
+	// rows from the top to the buffer's rows from the bottom
+	x0 = r.x0;
+	y0 = buffer_height - r.y1;
+	x1 = r.x1;
+	y1 = buffer_height - r.y0;
+}
+
+void RayTracer::setTileFocus( double x, double y )
+{
+	focusX = max( 0.0, min( x, 1.0 ) );
+	focusY = max( 0.0, min( y, 1.0 ) );
+}
+
+// A tile and what it is sorted by.
+struct TileKey
+{
+	int tile;
+	double major, minor;
+
+	bool operator <( const TileKey& k ) const
+	{
+		if( major != k.major )
+			return major < k.major;
+		if( minor != k.minor )
+			return minor < k.minor;
+		return tile < k.tile;
+	}
+};
+
+void RayTracer::orderTiles( std::vector<int>& tiles )
+{
+	tiles.clear();
+	int first, last;
+	getTileRange( first, last );
+	for( int t = first; t <= last; ++t )
+		if( t >= (int)tileDone.size() || !tileDone[t] )
+			tiles.push_back( t );
+	if( tileOrder == TILES_ROWS || tiles.empty() )
+		return;
+
+	int across = (cropX1 - cropX0 + TILE_SIZE - 1) / TILE_SIZE;
+	int down = (cropY1 - cropY0 + TILE_SIZE - 1) / TILE_SIZE;
+	std::vector<TileKey> keys( tiles.size() );
+
+	if( tileOrder == TILES_SPIRAL ) {
+		// the tile under the focus, or the nearest one in the crop window;
+		// the grid starts at the window's bottom left, like tileRect()'s
+		int column = (int)floor( (focusX * buffer_width - cropX0) / TILE_SIZE );
+		int row = down - 1 - (int)floor( ((1.0 - focusY) * buffer_height - cropY0) / TILE_SIZE );
+		column = max( 0, min( column, across - 1 ) );
+		row = max( 0, min( row, down - 1 ) );
+
+		// square rings round it, each once round clockwise from the right
+		for( size_t k = 0; k < tiles.size(); ++k ) {
+			int dx = tiles[k] % across - column, dy = tiles[k] / across - row;
+			keys[k].tile = tiles[k];
+			keys[k].major = max( abs( dx ), abs( dy ) );
+			keys[k].minor = atan2( (double)-dy, (double)-dx );
+		}
+	} else {
+		// four rays per tile, one in each quarter; time is what the
+		// threads are balancing, so it is timed rather than counted
+		for( size_t k = 0; k < tiles.size(); ++k ) {
+			int x0, y0, x1, y1;
+			getTileRect( tiles[k], x0, y0, x1, y1 );
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			if( scene ) {
+				for( int q = 0; q < 4; ++q ) {
+					double x = x0 + (x1 - x0) * (q % 2 ? 0.75 : 0.25);
+					double y = y0 + (y1 - y0) * (q / 2 ? 0.75 : 0.25);
+					trace( scene, x / buffer_width, y / buffer_height );
+				}
+			}
+			keys[k].tile = tiles[k];
+			keys[k].major = -std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+			keys[k].minor = 0.0;
+		}
+	}
+
+	std::sort( keys.begin(), keys.end() );
+	for( size_t k = 0; k < tiles.size(); ++k )
+		tiles[k] = keys[k].tile;
+}
+
+bool RayTracer::savePartial( char *fn, const char *sceneName )
+{
+	PerfPhase phase( PerfCounters::OUTPUT );
+	if( !ensureBuffer() || buffer_rows != buffer_height )
+		return false;
+
+	PartialInfo info;
+	info.width = buffer_width;
+	info.height = buffer_height;
+	info.toneMap = toneMap;
+	info.scene = sceneName ? sceneName : "";
+
+	// the crop window, or the tiles of it that were traced
+	int last = lastTile < tileCount() - 1 ? lastTile : tileCount() - 1;
+	if( firstTile == 0 && last == tileCount() - 1 ) {
+		PartialRect r = { cropX0, buffer_height - cropY1, cropX1, buffer_height - cropY0 };
+		info.rects.push_back( r );
+	} else {
+		for( int t = firstTile; t <= last; ++t ) {
+			PartialRect r;
+			tileRect( t, r );
+			info.rects.push_back( r );
+		}
+	}
+
+	return writePartial( fn, info, hdrBuffer );
+}
+
+// Tile t of the crop window in pixels from the top left, as in partials.
+void RayTracer::tileRect( int t, PartialRect& r ) const
+{
+	int across = (cropX1 - cropX0 + TILE_SIZE - 1) / TILE_SIZE;
+	int down = (cropY1 - cropY0 + TILE_SIZE - 1) / TILE_SIZE;
+	int k = down - 1 - t / across;
+	int j0 = cropY0 + k * TILE_SIZE;
+	r.x0 = cropX0 + (t % across) * TILE_SIZE;
+	r.x1 = min( r.x0 + (int)TILE_SIZE, cropX1 );
+	r.y0 = buffer_height - min( j0 + (int)TILE_SIZE, cropY1 );
+	r.y1 = buffer_height - j0;
+}
+
+bool RayTracer::mergePartials( int n, char **fns, string& error, long& missing )
+{
+	PartialInfo first;
+	if( n < 1 || !readPartial( fns[0], first, NULL ) ) {
+		error = n < 1 ? string( "nothing to merge" ) : string( "couldn't read " ) + fns[0];
+		return false;
+	}
+
+	traceSetup( first.width, first.height );
+	for( int k = 0; k < n; ++k ) {
+		PartialInfo info;
+		if( !readPartial( fns[k], info, NULL ) || info.width != first.width || info.height != first.height ) {
+			error = string( fns[k] ) + " isn't a piece of the same image";
+			return false;
+		}
+		if( !readPartial( fns[k], info, &hdrBuffer ) ) {
+			error = string( "couldn't read " ) + fns[k];
+			return false;
+		}
+	}
+
+	missing = 0;
+	for( int j = 0; j < buffer_height; ++j )
+		for( int i = 0; i < buffer_width; ++i )
+			if( hdrBuffer.getSamples( i, j ) == 0 )
+				++missing;
+
+	// tone mapped as it was rendered
+	setToneMap( first.toneMap );
 	return true;
 }
 
+bool RayTracer::frameRange( int& first, int& last )
+{
+	const Animation *anim = scene ? scene->getAnimation() : NULL;
+	if( !anim )
+		return false;
+	first = anim->firstFrame();
+	last = anim->lastFrame();
+	return true;
+}
+
+void RayTracer::setFrame( double frame )
+{
+	PerfPhase phase( PerfCounters::INIT );
+	if( scene )
+		scene->setFrame( frame );
+}
+
 void RayTracer::traceSetup( int w, int h )
 {
-	if( buffer_width != w || buffer_height != h )
+	if( !buffer || buffer_width != w || buffer_height != h || buffer_rows != h )
 	{
 		buffer_width = w;
 		buffer_height = h;
+		buffer_rows = h;
 
 		bufferSize = buffer_width * buffer_height * 3;
-		delete [] buffer;
+		releaseBuffer();
 		buffer = new unsigned char[ bufferSize ];
+		bufferPitch = buffer_width * 3;
 	}
-	memset( buffer, 0, w*h*3 );
+	clearBuffer();
+	hdrBuffer.resize( w, h );
+	setCrop( 0, 0, w, h );
+	setTileRange( 0, INT_MAX );
+	tileDone.clear();
+
+	if( relight && scene )
+		gbuffer.prepare( scene, w, h, subPixel );
+}
+
+void RayTracer::releaseBuffer()
+{
+	if( !bufferShared )
+		delete [] buffer;
+	buffer = NULL;
+	bufferShared = false;
+}
+
+// A buffer of our own again after dropBufferMemory(), quantized from the
+// radiance.  False if there is no image yet.
+bool RayTracer::ensureBuffer()
+{
+	if( buffer )
+		return true;
+	if( hdrBuffer.getWidth() != buffer_width || hdrBuffer.getHeight() != buffer_rows )
+		return false;
+
+	bufferSize = buffer_width * buffer_rows * 3;
+	buffer = new unsigned char[ bufferSize ];
+	bufferPitch = buffer_width * 3;
+	hdrBuffer.quantize( toneMap, buffer, 0, buffer_rows, bufferPitch );
+	return true;
+}
+
+void RayTracer::clearBuffer()
+{
+	for( int j = 0; j < buffer_rows; ++j )
+		memset( buffer + (ptrdiff_t)j * bufferPitch, 0, buffer_width * 3 );
+}
+
+void RayTracer::setBufferMemory( unsigned char *mem, int rowBytes )
+{
+	if( mem == buffer || !ensureBuffer() )
+		return;
+
+	int row = buffer_width * 3;
+	if( !mem || rowBytes == 0 )
+		rowBytes = row;
+	unsigned char *next = mem ? mem : new unsigned char[ bufferSize ];
+	for( int j = 0; j < buffer_rows; ++j )
+		memcpy( next + (ptrdiff_t)j * rowBytes, buffer + (ptrdiff_t)j * bufferPitch, row );
+	releaseBuffer();
+	buffer = next;
+	bufferPitch = rowBytes;
+	bufferShared = mem != NULL;
+}
+
+void RayTracer::dropBufferMemory()
+{
+	if( bufferShared )
+		releaseBuffer();
+}
+
+void RayTracer::setRelight( bool on )
+{
+	relight = on;
+	if( !relight )
+		gbuffer.release();
+}
+
+// Skipped shadow rays may change a pixel by at most half an 8-bit step
+// once it is tone mapped.  Exposure scales the radiance by 2^exposure
+// first, so the budget shrinks by as much.  Reinhard compression only
+// flattens the curve.  A gamma below 1 steepens it by up to 1/gamma, and
+// one above 1 without bound near black, so then nothing is skipped.  The
+// hits of a path share the budget, a level of bounces each; the rays a
+// hit spawns carry weights that add up to no more than its own, so each
+// level's skipped radiance stays within its share.
+void RayTracer::updateSkipBudget()
+{
+	skipBudget = 0.5 / 255.0 / pow( 2.0, toneMap.exposure ) / (maxDepth + 1);
+	if( toneMap.gamma > 1.0 )
+		skipBudget = 0.0;
+	else if( toneMap.gamma < 1.0 )
+		skipBudget *= toneMap.gamma;
+}
+
+void RayTracer::setToneMap( const ToneMap& tm )
+{
+	toneMap = tm;
+	updateSkipBudget();
+	if( buffer && hdrBuffer.getWidth() == buffer_width && hdrBuffer.getHeight() == buffer_rows )
+		hdrBuffer.quantize( toneMap, buffer, 0, buffer_rows, bufferPitch );
+}
+
+static bool hasExtension( const char *fn, const char *ext )
+{
+	size_t n = strlen( fn );
+	size_t e = strlen( ext );
+	if( n < e )
+		return false;
+
+	for( size_t k = 0; k < e; ++k )
+		if( tolower( fn[n - e + k] ) != ext[k] )
+			return false;
+	return true;
+}
+
+bool RayTracer::saveImage( char *fn )
+{
+	PerfPhase phase( PerfCounters::OUTPUT );
+	if( !ensureBuffer() || buffer_rows != buffer_height )
+		return false;
+
+	if( hasExtension( fn, ".pfm" ) || hasExtension( fn, ".exr" ) ) {
+		float *radiance = hdrBuffer.resolve();
+		bool ok = hasExtension( fn, ".pfm" )
+			? writePFM( fn, buffer_width, buffer_height, radiance )
+			: writeEXR( fn, buffer_width, buffer_height, radiance );
+		delete [] radiance;
+		return ok;
+	}
+
+	ImageWriter *out = ImageWriter::create( fn );
+	bool ok = out->open( fn, buffer_width, buffer_height );
+	if( ok ) {
+		for( int k = 0; ok && k < buffer_height; ++k ) {
+			int j = out->bottomUp() ? k : buffer_height - 1 - k;
+			ok = out->writeRow( buffer + (ptrdiff_t)j * bufferPitch );
+		}
+		if( !out->close() )
+			ok = false;
+	}
+	delete out;
+	return ok;
 }
 
 void RayTracer::traceLines( int start, int stop )
@@ -207,50 +858,754 @@ void RayTracer::traceLines( int start, int stop )
 	if( stop > buffer_height )
 		stop = buffer_height;
 
-	for( int j = start; j < stop; ++j )
+	PerfPhase phase( PerfCounters::PRIMARY );
+	for( int j = start; j < stop && !cancelToken->expired(); ++j )
 		for( int i = 0; i < buffer_width; ++i )
 			tracePixel(i,j);
 }
 
 void RayTracer::tracePixel( int i, int j )
 {
-	if (!scene)
+	if (!scene || cancelToken->stopped())
 		return;
 	
 	vec3f col;
-	unsigned char *pixel = buffer + (i + j * buffer_width) * 3;
+	int row = j % buffer_rows;
+	GBuffer::Sample *cached = relight && gbuffer.fits(buffer_width, buffer_height, subPixel)
+		? gbuffer.pixel(i, j) : NULL;
 
-	int subPixel = traceUI->getSubPixelVal();
 	if (subPixel == 1) {
 		double x = double(i) / double(buffer_width);
 		double y = double(j) / double(buffer_height);
 
-		col = trace(scene, x, y);
-
-		pixel[0] = (int)(255.0 * col[0]);
-		pixel[1] = (int)(255.0 * col[1]);
-		pixel[2] = (int)(255.0 * col[2]);
+		col = trace(scene, x, y, cached);
+		hdrBuffer.addSample(i, row, col);
 	}
 	else {
-		double coef = 1.0 / (subPixel*subPixel);
-		double pixelAvg[3] = { 0.0, 0.0, 0.0 };
+		vec3f sum;
+		int n = 0;
 
 		for (double fragmentx = i; fragmentx < i + 1.0f - RAY_EPSILON; fragmentx += 1.0f / subPixel) {
 			for (double fragmenty = j; fragmenty < j + 1.0f - RAY_EPSILON; fragmenty += 1.0f / subPixel) {
+				if (cancelToken->stopped())
+					return;
 				double x = double(fragmentx) / double(buffer_width);
 				double y = double(fragmenty) / double(buffer_height);
 				
-				col = trace(scene, x, y);
+				sum += trace(scene, x, y, cached ? cached + n : NULL);
+				n++;
+			}
+		}
+
+		hdrBuffer.addSample(i, row, sum, n);
+	}
+
+	hdrBuffer.quantizePixel(toneMap, buffer, i, row, bufferPitch);
+}
+
+void RayTracer::traceRect( int x0, int y0, int x1, int y1 )
+{
+	// relighting keeps a primary hit per sample, which only tracePixel() uses
+	if( wavefront && !relight && scene ) {
+		traceWavefront( x0, y0, x1, y1 );
+		return;
+	}
+
+	// a phase for the tile, so the samples' own don't each read the
+	// counters
+	PerfPhase phase( PerfCounters::PRIMARY );
+	for( int j = y0; j < y1; ++j )
+		for( int i = x0; i < x1; ++i )
+			tracePixel( i, j );
+}
+
+// A ray waiting in a wave, with the product of the kr and kt factors
+// along its path: that weights its radiance, and is the threshold
+// traceRay() would have been given for it.
+struct WaveRay
+{
+	WaveRay( const ray& rr, const vec3f& w, int d, int s )
+		: r( rr ), weight( w ), depth( d ), sample( s ) {}
+
+	ray r;
+	vec3f weight;
+	int depth;		// bounces left
+	int sample;		// whose radiance this adds to
+};
+
+// Spread the low 10 bits of v out to every third bit.
+static unsigned long long spreadBits( unsigned int v )
+{
+	unsigned long long x = v & 0x3ff;
+	x = (x | (x << 16)) & 0x30000ffULL;
+	x = (x | (x << 8)) & 0x300f00fULL;
+	x = (x | (x << 4)) & 0x30c30c3ULL;
+	x = (x | (x << 2)) & 0x9249249ULL;
+	return x;
+}
+
+// Sort key that brings rays likely to visit the same nodes and objects
+// together: the ray type, then the octant of its direction, then the
+// Morton code of its origin in the scene's bounds.
+static unsigned long long coherenceKey( const ray& r, const BoundingBox& bounds )
+{
+	vec3f p = r.getPosition();
+	vec3f d = r.getDirection();
+	unsigned long long morton = 0;
+	for( int k = 0; k < 3; ++k ) {
+		double extent = bounds.max[k] - bounds.min[k];
+		double f = extent > 0.0 ? (p[k] - bounds.min[k]) / extent : 0.0;
+		f = f < 0.0 ? 0.0 : (f > 1.0 ? 1.0 : f);
+		morton |= spreadBits( (unsigned int)(f * 1023.0) ) << k;
+	}
+	unsigned long long octant = (d[0] < 0.0 ? 1 : 0) | (d[1] < 0.0 ? 2 : 0) | (d[2] < 0.0 ? 4 : 0);
+	return ((unsigned long long)r.type() << 40) | (octant << 32) | morton;
+}
+
+struct KeyLess
+{
+	bool operator()( const std::pair<unsigned long long, int>& a,
+		const std::pair<unsigned long long, int>& b ) const
+	{ return a.first < b.first; }
+};
 
-				pixelAvg[0] += coef * (255.0 * col[0]);
-				pixelAvg[1] += coef * (255.0 * col[1]);
-				pixelAvg[2] += coef * (255.0 * col[2]);
+// Trace the rays of a wave: WAVE_SIZE at a time, sorted for coherence,
+// intersected, then shaded, which gives the next wave.  Shading leaves its
+// shadow rays to a stage of their own, sorted by light and then like the
+// wave, so one light's occluder cache and BVH nodes are used by one shadow
+// ray after another.  The next wave is traced before the rest of this one,
+// so no wave holds more than twice WAVE_SIZE rays however deep the tracing
+// goes.  The cancel token is looked at once a chunk.
+void RayTracer::traceWave( std::vector<WaveRay>& wave, vec3f *sums )
+{
+	const BoundingBox& bounds = scene->getBounds();
+	std::vector<WaveRay> next;
+	std::vector< std::pair<unsigned long long, int> > order;
+	std::vector<ShadowQuery> shadows;
+	std::vector<int> shadowOf;		// the wave ray each shadow ray is for
+
+	for( size_t start = 0; start < wave.size(); start += WAVE_SIZE ) {
+		if( cancelToken->expired() )
+			return;
+		int n = (int)min( (size_t)WAVE_SIZE, wave.size() - start );
+
+		// camera rays come in scanline order, which is as coherent as it gets
+		order.resize( n );
+		bool sorted = wave[start].r.type() == ray::VISIBILITY;
+		for( int k = 0; k < n; ++k )
+			order[k] = std::make_pair( sorted ? 0 : coherenceKey( wave[start + k].r, bounds ), (int)start + k );
+		if( !sorted )
+			std::sort( order.begin(), order.end(), KeyLess() );
+
+		std::vector<isect> hits( n );
+		std::vector<char> hit( n );
+		{
+			PerfPhase phase( sorted ? PerfCounters::PRIMARY : PerfCounters::SECONDARY );
+			for( int k = 0; k < n; ++k )
+				hit[k] = findHit( scene, wave[order[k].second].r, hits[k] );
+		}
+
+		next.clear();
+		next.reserve( 2 * n );
+		shadows.clear();
+		shadowOf.clear();
+		{
+			PerfPhase phase( PerfCounters::SHADING );
+			for( int k = 0; k < n; ++k ) {
+				const WaveRay& w = wave[order[k].second];
+				if( !hit[k] ) {
+					sums[w.sample] += prod( w.weight, escaped( scene, w.r ) );
+					continue;
+				}
+
+				const Material& m = hits[k].getMaterial();
+				sums[w.sample] += prod( w.weight, m.shade( scene, w.r, hits[k], w.weight, skipBudget, &shadows ) );
+				shadowOf.resize( shadows.size(), order[k].second );
+				if( w.depth == 0 || w.weight.length() < AdaptiveThreshold )
+					continue;
+
+				Bounce b[2];
+				int count = bounces( w.r, hits[k], m, b );
+				for( int c = 0; c < count; ++c )
+					next.push_back( WaveRay( b[c].r, prod( w.weight, b[c].k ), w.depth - 1, w.sample ) );
+			}
+		}
+
+		{
+			PerfPhase phase( PerfCounters::SHADOW );
+			// the light's number above the ray type, octant and origin
+			order.resize( shadows.size() );
+			for( size_t k = 0; k < shadows.size(); ++k ) {
+				const ShadowQuery& q = shadows[k];
+				ray r( q.P, q.light->getDirection( q.P ), ray::SHADOW );
+				order[k] = std::make_pair( ((unsigned long long)q.lightIndex << 44) | coherenceKey( r, bounds ), (int)k );
+			}
+			std::sort( order.begin(), order.end(), KeyLess() );
+			for( size_t k = 0; k < order.size(); ++k ) {
+				const ShadowQuery& q = shadows[order[k].second];
+				const WaveRay& w = wave[shadowOf[order[k].second]];
+				sums[w.sample] += prod( w.weight, prod( q.light->shadowAttenuation( q.P ), q.brdf ) );
 			}
 		}
 
-		pixel[0] = (int)pixelAvg[0];
-		pixel[1] = (int)pixelAvg[1];
-		pixel[2] = (int)pixelAvg[2];
+		if( !next.empty() )
+			traceWave( next, sums );
+	}
+}
 
+void RayTracer::traceWavefront( int x0, int y0, int x1, int y1 )
+{
+	// the camera rays of every sample, as tracePixel() makes them
+	std::vector<WaveRay> wave;
+	std::vector<int> firstSample;
+	wave.reserve( (x1 - x0) * (y1 - y0) * subPixel * subPixel );
+	firstSample.reserve( (x1 - x0) * (y1 - y0) + 1 );
+	for( int j = y0; j < y1; ++j ) {
+		for( int i = x0; i < x1; ++i ) {
+			firstSample.push_back( (int)wave.size() );
+			for( double fragmentx = i; fragmentx < i + 1.0f - RAY_EPSILON; fragmentx += 1.0f / subPixel ) {
+				for( double fragmenty = j; fragmenty < j + 1.0f - RAY_EPSILON; fragmenty += 1.0f / subPixel ) {
+					ray r( vec3f( 0, 0, 0 ), vec3f( 0, 0, 0 ), ray::VISIBILITY );
+					cameraRay( scene, fragmentx / buffer_width, fragmenty / buffer_height, r );
+					wave.push_back( WaveRay( r, vec3f( 1.0, 1.0, 1.0 ), maxDepth, (int)wave.size() ) );
+				}
+			}
+		}
 	}
-}
\ No newline at end of file
+
+	firstSample.push_back( (int)wave.size() );
+	if( wave.empty() || cancelToken->stopped() )
+		return;
+
+	// a wave stopped part of the way through would leave pixels dark
+	std::vector<vec3f> sums( wave.size() );
+	traceWave( wave, &sums[0] );
+	if( cancelToken->stopped() )
+		return;
+
+	int p = 0;
+	for( int j = y0; j < y1; ++j ) {
+		int row = j % buffer_rows;
+		for( int i = x0; i < x1; ++i, ++p ) {
+			vec3f sum;
+			int n = firstSample[p + 1] - firstSample[p];
+			for( int s = firstSample[p]; s < firstSample[p + 1]; ++s )
+				sum += sums[s];
+			if( subPixel == 1 )
+				hdrBuffer.addSample( i, row, sum );
+			else
+				hdrBuffer.addSample( i, row, sum, n );
+			hdrBuffer.quantizePixel( toneMap, buffer, i, row, bufferPitch );
+		}
+	}
+}
+
+// Shared by the threads of one traceImage() call.  Slots are numbered in
+// output order: bands of TILE_SIZE rows in the order the writer wants them,
+// left to right within a band.  The grid starts at the crop window's
+// corner.  The threads take the slots in the order of order[].
+struct TileQueue
+{
+	int x0, y0;					// crop window
+	int width, height;
+	int tilesAcross, bands;
+	bool topDown;
+	int ringBands;				// bands the buffers can hold at once
+	int firstTile, lastTile;	// the tiles to trace, numbered row by row from the top left
+	std::vector<char> *done;	// by tile number: finished, maybe in an earlier run
+	int finished;				// tiles finished by this call
+	RayTracer::TileListener *listener;
+
+	std::mutex lock;
+	std::condition_variable changed;
+	std::vector<int> order;		// slots to trace
+	int nextTile;				// in order
+	int bandsWritten;
+	std::vector<int> remaining;	// unfinished tiles per band
+
+	// image rows [y0,y1) of the b'th band in output order
+	void bandRows( int b, int& r0, int& r1 ) const
+	{
+		int k = topDown ? bands - 1 - b : b;
+		r0 = k * RayTracer::TILE_SIZE;
+		r1 = r0 + RayTracer::TILE_SIZE < height ? r0 + RayTracer::TILE_SIZE : height;
+		r0 += y0;
+		r1 += y0;
+	}
+};
+
+static void traceTiles( RayTracer *rt, TileQueue *q, int index )
+{
+	setRenderThreadIndex( index );
+
+	for( ;; ) {
+		int t, b;
+		{
+			std::unique_lock<std::mutex> guard( q->lock );
+			if( q->nextTile >= (int)q->order.size() )
+				return;
+			t = q->order[q->nextTile++];
+
+			// don't overwrite a band the writer hasn't taken yet
+			b = t / q->tilesAcross;
+			while( b >= q->bandsWritten + q->ringBands )
+				q->changed.wait( guard );
+		}
+
+		int column = t % q->tilesAcross;
+		int fromTop = q->topDown ? b : q->bands - 1 - b;
+		int index = fromTop * q->tilesAcross + column;
+		bool wanted = index >= q->firstTile && index <= q->lastTile && !(*q->done)[index]
+			&& !rt->getCancelToken().expired();
+
+		int x0 = column * RayTracer::TILE_SIZE;
+		int x1 = x0 + RayTracer::TILE_SIZE < q->width ? x0 + RayTracer::TILE_SIZE : q->width;
+		x0 += q->x0;
+		x1 += q->x0;
+		int y0, y1;
+		q->bandRows( b, y0, y1 );
+
+		if( wanted ) {
+			rt->traceRect( x0, y0, x1, y1 );
+			// a tile stopped halfway has to be traced again on resume
+			wanted = !rt->isCancelled();
+			if( wanted && q->listener )
+				q->listener->tileFinished( index, x0, y0, x1, y1 );
+		}
+
+		std::lock_guard<std::mutex> guard( q->lock );
+		if( wanted ) {
+			(*q->done)[index] = 1;
+			++q->finished;
+		}
+		if( --q->remaining[b] == 0 || !q->topDown )
+			q->changed.notify_all();
+	}
+}
+
+bool RayTracer::traceImage( int nThreads, ImageWriter *out, int firstThread )
+{
+	if( !scene || !ensureBuffer() )
+		return false;
+
+	if( nThreads < 1 )
+		nThreads = 1;
+	if( firstThread < 0 || firstThread >= MAX_RENDER_THREADS )
+		firstThread = 0;
+	if( nThreads > MAX_RENDER_THREADS - firstThread )
+		nThreads = MAX_RENDER_THREADS - firstThread;
+
+	TileQueue q;
+	q.x0 = cropX0;
+	q.y0 = cropY0;
+	q.width = cropX1 - cropX0;
+	q.height = cropY1 - cropY0;
+	if( q.width <= 0 || q.height <= 0 )
+		return false;
+	q.tilesAcross = (q.width + TILE_SIZE - 1) / TILE_SIZE;
+	q.bands = (q.height + TILE_SIZE - 1) / TILE_SIZE;
+	q.topDown = out && !out->bottomUp();
+	q.ringBands = q.bands;
+	q.firstTile = firstTile;
+	q.lastTile = lastTile;
+	tileDone.resize( q.tilesAcross * q.bands, 0 );
+	q.done = &tileDone;
+	q.finished = 0;
+	q.listener = tileListener;
+	q.nextTile = 0;
+	q.bandsWritten = 0;
+	q.remaining.assign( q.bands, q.tilesAcross );
+
+	if( out ) {
+		// every slot, so that every band is counted down
+		for( int t = 0; t < q.tilesAcross * q.bands; ++t )
+			q.order.push_back( t );
+	} else {
+		// bands from the bottom, so slots and tiles are mirrored by row
+		orderTiles( q.order );
+		for( size_t k = 0; k < q.order.size(); ++k )
+			q.order[k] = (q.bands - 1 - q.order[k] / q.tilesAcross) * q.tilesAcross + q.order[k] % q.tilesAcross;
+	}
+
+	if( out ) {
+		// enough bands to keep every thread busy while the oldest is written
+		int ring = 2 + (2 * nThreads - 1) / q.tilesAcross;
+		if( ring < q.bands ) {
+			q.ringBands = ring;
+			buffer_rows = ring * TILE_SIZE;
+			bufferSize = buffer_width * buffer_rows * 3;
+			releaseBuffer();
+			buffer = new unsigned char[ bufferSize ];
+			bufferPitch = buffer_width * 3;
+			memset( buffer, 0, bufferSize );
+			hdrBuffer.resize( buffer_width, buffer_rows );
+		}
+	}
+
+	// counted before the workers start marking tiles done
+	int total = 0;
+	for( int t = 0; t < (int)tileDone.size(); ++t )
+		if( t >= firstTile && t <= lastTile && !tileDone[t] )
+			++total;
+
+	std::vector<std::thread> workers;
+	for( int k = 0; k < nThreads; ++k )
+		workers.push_back( std::thread( traceTiles, this, &q, firstThread + k ) );
+
+	bool ok = true;
+	if( out ) {
+		for( int b = 0; b < q.bands; ++b ) {
+			{
+				std::unique_lock<std::mutex> guard( q.lock );
+				while( q.remaining[b] > 0 )
+					q.changed.wait( guard );
+			}
+
+			int y0, y1;
+			q.bandRows( b, y0, y1 );
+			{
+				PerfPhase phase( PerfCounters::OUTPUT );
+				for( int k = 0; k < y1 - y0; ++k ) {
+					int j = q.topDown ? y1 - 1 - k : y0 + k;
+					if( ok )
+						ok = out->writeRow( buffer + ((j % buffer_rows) * buffer_width + q.x0) * 3 );
+				}
+			}
+			// nobody is taking the rows any more, so don't trace them
+			if( !ok )
+				cancel();
+
+			// the slot is reused for a later band, which starts from zero;
+			// a crop window not on the tile grid can wrap round the ring
+			if( q.ringBands < q.bands ) {
+				int r0 = y0 % buffer_rows, r1 = r0 + (y1 - y0);
+				hdrBuffer.clearRows( r0, r1 );
+				if( r1 > buffer_rows )
+					hdrBuffer.clearRows( 0, r1 - buffer_rows );
+			}
+
+			{
+				std::lock_guard<std::mutex> guard( q.lock );
+				++q.bandsWritten;
+				q.changed.notify_all();
+			}
+			if( progress && !progress( (double)(b + 1) / q.bands, progressData ) )
+				cancel();
+		}
+	}
+
+	if( !out && (!checkpointFile.empty() || progress) ) {
+		// report tiles as they finish, and save them every so often,
+		// until the workers are done
+		std::chrono::steady_clock::duration interval =
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double>( checkpointSeconds ) );
+		std::chrono::steady_clock::time_point due = std::chrono::steady_clock::now() + interval;
+
+		for( int reported = -1; ; ) {
+			std::vector<char> snapshot;
+			int finished;
+			{
+				std::unique_lock<std::mutex> guard( q.lock );
+				while( q.finished < total && q.finished == reported && !isCancelled() ) {
+					if( checkpointFile.empty() )
+						q.changed.wait( guard );
+					else if( q.changed.wait_until( guard, due ) == std::cv_status::timeout )
+						break;
+				}
+				finished = q.finished;
+				if( !checkpointFile.empty() && finished < total && !isCancelled()
+					&& std::chrono::steady_clock::now() >= due ) {
+					snapshot = tileDone;
+					due = std::chrono::steady_clock::now() + interval;
+				}
+			}
+			if( progress && finished != reported && !progress( total ? (double)finished / total : 1.0, progressData ) )
+				cancel();
+			reported = finished;
+			// finished tiles aren't written to again, so no lock is needed
+			if( !snapshot.empty() && !writeCheckpoint( snapshot ) )
+				fprintf( stderr, "couldn't write checkpoint %s\n", checkpointFile.c_str() );
+			if( finished == total || isCancelled() )
+				break;
+		}
+	}
+
+	for( int k = 0; k < nThreads; ++k )
+		workers[k].join();
+
+	if( !out && !checkpointFile.empty() ) {
+		// a finished render has nothing to resume, a cancelled one keeps
+		// every tile it got through
+		if( !isCancelled() )
+			remove( checkpointFile.c_str() );
+		else if( !writeCheckpoint( tileDone ) )
+			fprintf( stderr, "couldn't write checkpoint %s\n", checkpointFile.c_str() );
+	}
+	tileDone.clear();
+
+	if( isCancelled() )
+		ok = false;
+	ownCancel.reset();
+	return ok;
+}
+
+void RayTracer::setCheckpoint( const string& fn, double seconds, const string& settings )
+{
+	checkpointFile = fn;
+	checkpointSeconds = seconds > 0.0 ? seconds : 1.0;
+	checkpointSettings = settings;
+}
+
+bool RayTracer::writeCheckpoint( const std::vector<char>& done )
+{
+	PartialInfo info;
+	info.width = buffer_width;
+	info.height = buffer_height;
+	info.toneMap = toneMap;
+	info.settings = checkpointSettings;
+	for( int t = 0; t < (int)done.size(); ++t ) {
+		if( done[t] ) {
+			PartialRect r;
+			tileRect( t, r );
+			info.rects.push_back( r );
+		}
+	}
+
+	// never leave a half written checkpoint in place of a good one
+	string tmp = checkpointFile + ".tmp";
+	if( !writePartial( tmp.c_str(), info, hdrBuffer ) )
+		return false;
+#ifdef WIN32
+	remove( checkpointFile.c_str() );
+#endif
+	return rename( tmp.c_str(), checkpointFile.c_str() ) == 0;
+}
+
+bool RayTracer::resume( string& error )
+{
+	PartialInfo info;
+	if( !readPartial( checkpointFile.c_str(), info, NULL ) ) {
+		error = "no checkpoint in " + checkpointFile;
+		return false;
+	}
+	if( !ensureBuffer() || info.width != buffer_width || info.height != buffer_height
+		|| info.settings != checkpointSettings ) {
+		error = checkpointFile + " was made with other settings";
+		return false;
+	}
+
+	// tiles are known by their rectangles
+	std::map< std::pair<int,int>, int > tiles;
+	for( int t = 0; t < tileCount(); ++t ) {
+		PartialRect r;
+		tileRect( t, r );
+		tiles[ std::make_pair( r.x0, r.y0 ) ] = t;
+	}
+	tileDone.assign( tileCount(), 0 );
+	for( size_t k = 0; k < info.rects.size(); ++k ) {
+		std::map< std::pair<int,int>, int >::iterator t =
+			tiles.find( std::make_pair( info.rects[k].x0, info.rects[k].y0 ) );
+		if( t == tiles.end() ) {
+			error = checkpointFile + " has tiles of another size";
+			return false;
+		}
+		tileDone[ t->second ] = 1;
+	}
+
+	hdrBuffer.clear();
+	if( !readPartial( checkpointFile.c_str(), info, &hdrBuffer ) ) {
+		error = "couldn't read " + checkpointFile;
+		return false;
+	}
+	hdrBuffer.quantize( toneMap, buffer );
+	return true;
+}
+
+// Radical inverse of i in the given base; sample n of a progressive pixel
+// is at offset (radicalInverse( n, 2 ), radicalInverse( n, 3 )), so the
+// first is where a plain render puts its one sample and any number of
+// them is well spread over the pixel.
+static double radicalInverse( int i, int base )
+{
+	double inv = 1.0 / base;
+	double f = inv;
+	double r = 0.0;
+	while( i > 0 ) {
+		r += f * (i % base);
+		i /= base;
+		f *= inv;
+	}
+	return r;
+}
+
+static double luminance( const vec3f& c )
+{
+	return 0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2];
+}
+
+// One pass of traceProgressive(), shared by its threads.
+struct PassQueue
+{
+	std::vector<int> pixels;		// i + j * width, in the order to trace them
+	std::atomic<int> next;
+	std::chrono::steady_clock::time_point deadline;
+	bool finish;					// trace every pixel, whatever the time
+	std::vector<float> squares;		// summed squared luminance per pixel
+	std::atomic<long> traced;
+};
+
+// Orders pixels by estimated error, largest first.
+struct ErrorGreater
+{
+	const std::vector<float> *error;
+	bool operator()( int a, int b ) const { return (*error)[a] > (*error)[b]; }
+};
+
+void RayTracer::tracePass( PassQueue *q, int index )
+{
+	setRenderThreadIndex( index );
+
+	// pixels are handed out a few at a time, and the clock only checked
+	// between them
+	const int CHUNK = 64;
+	int size = (int)q->pixels.size();
+	long traced = 0;
+	for( ;; ) {
+		int first = q->next.fetch_add( CHUNK );
+		if( first >= size )
+			break;
+		if( !q->finish && std::chrono::steady_clock::now() >= q->deadline )
+			break;
+		if( cancelToken->expired() )
+			break;
+
+		int last = first + CHUNK < size ? first + CHUNK : size;
+		PerfPhase phase( PerfCounters::PRIMARY );
+		for( int k = first; k < last; ++k ) {
+			int p = q->pixels[k];
+			int i = p % buffer_width;
+			int j = p / buffer_width;
+			int n = hdrBuffer.getSamples( i, j );
+			double x = (i + radicalInverse( n, 2 )) / buffer_width;
+			double y = (j + radicalInverse( n, 3 )) / buffer_height;
+
+			vec3f col = trace( scene, x, y );
+			hdrBuffer.addSample( i, j, col );
+			double l = luminance( col );
+			q->squares[p] += (float)(l * l);
+			hdrBuffer.quantizePixel( toneMap, buffer, i, j, bufferPitch );
+		}
+		traced += last - first;
+	}
+	q->traced += traced;
+}
+
+// The pixels of the crop window worth another sample, noisiest first; false
+// if none are.
+bool RayTracer::noisiestPixels( const std::vector<float>& squares, std::vector<int>& pixels ) const
+{
+	// the standard error of each pixel's mean, relative to its brightness
+	// so dark pixels count as much as bright ones, but not below a floor
+	// where noise can't be seen
+	std::vector<float> error( squares.size(), 0.0f );
+	for( int j = cropY0; j < cropY1; ++j ) {
+		for( int i = cropX0; i < cropX1; ++i ) {
+			int n = hdrBuffer.getSamples( i, j );
+			if( n < 2 )
+				continue;
+			int p = i + j * buffer_width;
+			double mean = luminance( hdrBuffer.getSum( i, j ) ) / n;
+			double variance = (squares[p] / n - mean * mean) * n / (n - 1);
+			if( variance > 0.0 )
+				error[p] = (float)(sqrt( variance / n ) / (fabs( mean ) + 0.05));
+		}
+	}
+
+	// two samples can agree by chance next to an edge or a shadow, so a
+	// pixel is as noisy as the worst of its neighbours
+	std::vector<float> spread( error.size(), 0.0f );
+	pixels.clear();
+	for( int j = cropY0; j < cropY1; ++j ) {
+		for( int i = cropX0; i < cropX1; ++i ) {
+			float e = 0.0f;
+			for( int v = max( j - 1, cropY0 ); v <= min( j + 1, cropY1 - 1 ); ++v )
+				for( int u = max( i - 1, cropX0 ); u <= min( i + 1, cropX1 - 1 ); ++u )
+					e = max( e, error[u + v * buffer_width] );
+			int p = i + j * buffer_width;
+			spread[p] = e;
+			// about a tenth of an 8-bit step
+			if( e > 0.0004f )
+				pixels.push_back( p );
+		}
+	}
+	if( pixels.empty() )
+		return false;
+
+	// a pass covers at most a quarter of the window, so the noisiest
+	// pixels are looked at again soon
+	ErrorGreater greater;
+	greater.error = &spread;
+	size_t most = max( (size_t)1, (size_t)(cropX1 - cropX0) * (cropY1 - cropY0) / 4 );
+	if( pixels.size() > most ) {
+		std::nth_element( pixels.begin(), pixels.begin() + most, pixels.end(), greater );
+		pixels.resize( most );
+	}
+	std::sort( pixels.begin(), pixels.end(), greater );
+	return true;
+}
+
+int RayTracer::traceProgressive( int nThreads, double seconds, int firstThread, long *samples )
+{
+	if( samples )
+		*samples = 0;
+	if( !scene || !ensureBuffer() || buffer_rows != buffer_height
+		|| cropX1 <= cropX0 || cropY1 <= cropY0 )
+		return 0;
+
+	if( nThreads < 1 )
+		nThreads = 1;
+	if( firstThread < 0 || firstThread >= MAX_RENDER_THREADS )
+		firstThread = 0;
+	if( nThreads > MAX_RENDER_THREADS - firstThread )
+		nThreads = MAX_RENDER_THREADS - firstThread;
+
+	PassQueue q;
+	q.deadline = std::chrono::steady_clock::now()
+		+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>( seconds ) );
+	q.squares.assign( buffer_width * buffer_height, 0.0f );
+	q.traced = 0;
+
+	std::vector<int> window;
+	for( int j = cropY0; j < cropY1; ++j )
+		for( int i = cropX0; i < cropX1; ++i )
+			window.push_back( i + j * buffer_width );
+
+	// the first two passes sample every pixel, the second one so there
+	// is a variance to go by
+	int passes = 0;
+	for( ;; ) {
+		if( passes < 2 )
+			q.pixels = window;
+		else if( !noisiestPixels( q.squares, q.pixels ) )
+			break;
+		q.finish = passes == 0;
+		q.next = 0;
+
+		std::vector<std::thread> workers;
+		for( int k = 0; k < nThreads; ++k )
+			workers.push_back( std::thread( &RayTracer::tracePass, this, &q, firstThread + k ) );
+		for( int k = 0; k < nThreads; ++k )
+			workers[k].join();
+		++passes;
+
+		if( std::chrono::steady_clock::now() >= q.deadline || cancelToken->expired() )
+			break;
+	}
+
+	if( samples )
+		*samples = q.traced;
+	ownCancel.reset();
+	return passes;
+}
@@ -3,8 +3,19 @@
 
 // The main ray tracer.
 
+#include <vector>
+
 #include "scene/scene.h"
 #include "scene/ray.h"
+#include "FrameBuffer.h"
+#include "GBuffer.h"
+#include "CancelToken.h"
+
+class ImageWriter;
+class EnvironmentMap;
+struct PartialRect;
+struct PassQueue;
+struct WaveRay;
 
 class RayTracer
 {
@@ -12,25 +23,278 @@ public:
     RayTracer();
     ~RayTracer();
 
-    vec3f trace( Scene *scene, double x, double y );
+    vec3f trace( Scene *scene, double x, double y, GBuffer::Sample *cached = NULL );
 	vec3f traceRay( Scene *scene, const ray& r, const vec3f& thresh, int depth );
 
 	void setAdaptiveThreshold(double thres);
+	void setDepth( int d ) { maxDepth = d; updateSkipBudget(); }
+	void setSubPixel( int n ) { subPixel = n > 0 ? n : 1; }
 	void getBuffer( unsigned char *&buf, int &w, int &h );
 	double aspectRatio();
+
+	// Relighting keeps the primary hit of every sample in a G-buffer and
+	// reuses it for as long as the camera, image size, sampling and scene
+	// geometry don't change, so renders after a light or material change
+	// only redo shading and secondary rays.
+	void setRelight( bool on );
+
+	// Call after setSubPixel(); with relighting on, this is where the
+	// G-buffer is checked against the scene and camera.
 	void traceSetup( int w, int h );
 	void traceLines( int start = 0, int stop = 10000000 );
 	void tracePixel( int i, int j );
 
+	// Trace pixels [x0,x1) x [y0,y1), rows from the bottom: pixel by
+	// pixel, or a wave of rays at a time with the wavefront integrator.
+	void traceRect( int x0, int y0, int x1, int y1 );
+
+	// The wavefront integrator traces the camera rays of a whole tile,
+	// then all the reflected and refracted rays they spawn, and so on,
+	// with every wave sorted by ray type, direction and origin so that
+	// neighbouring rays go through the same part of the BVH and the same
+	// objects one after another.  A wave's shadow rays are traced after
+	// it is shaded, sorted the same way by light.  The image is the same
+	// apart from rounding.  Relighting renders don't use it.
+	void setWavefront( bool on ) { wavefront = on; }
+
+	// Render the whole image in TILE_SIZE square tiles on nThreads threads.
+	// With a writer, finished rows are streamed to it while later tiles
+	// are still being traced, and the buffers only hold a few bands of
+	// tiles instead of the whole image; they have to be set up again with
+	// traceSetup() before anything else is rendered.  The threads take
+	// render thread numbers from firstThread on, so ray tracers working
+	// side by side must be given ranges that don't overlap.
+	// False if a row couldn't be written or the render was cancelled.
+	bool traceImage( int nThreads, ImageWriter *out = NULL, int firstThread = 0 );
+
+	// Called on the thread running traceImage() as tiles finish (with a
+	// writer, as bands are written), with the fraction of the image done;
+	// returning false cancels the render.  NULL for none.
+	typedef bool (*ProgressFunc)( double done, void *data );
+	void setProgress( ProgressFunc f, void *data ) { progress = f; progressData = data; }
+
+	// Told about every tile traceImage() finishes, on the thread that
+	// traced it, once its pixels are in the buffers.  Tiles are numbered
+	// as for setTileRange(); the rectangle's rows count from the bottom.
+	class TileListener
+	{
+	public:
+		virtual ~TileListener() {}
+		virtual void tileFinished( int tile, int x0, int y0, int x1, int y1 ) = 0;
+	};
+	void setTileListener( TileListener *l ) { tileListener = l; }
+
+	// Quantize into mem instead of a buffer of our own, from now until
+	// the image size changes or NULL goes back to one: after traceSetup(),
+	// height rows of width * 3 bytes, which the caller keeps mapped.  The
+	// rows are rowBytes apart, 0 for packed ones like getBuffer()'s; for
+	// rows stored top row first it is negative and mem is where the bottom
+	// row starts.  What the buffer holds is copied over either way.  Not
+	// for traceImage() with a writer, which keeps its own bands.
+	void setBufferMemory( unsigned char *mem, int rowBytes = 0 );
+	// Let go of setBufferMemory()'s memory without copying it back; a
+	// buffer of our own is quantized from the radiance when next needed.
+	void dropBufferMemory();
+
+	// Stop the render in progress from any thread, within a sample: the
+	// tiles, rows or passes not finished are left out, and traceImage()
+	// returns false.  A checkpoint keeps the tiles that were done, so
+	// resume() can carry on from there.  The token can also have a
+	// deadline (see CancelToken.h).  The ray tracer's own token is cleared
+	// when traceImage() or traceProgressive() returns, so a cancel() sent
+	// before one starts stops it and doesn't outlive it; a shared token is
+	// the caller's to reset.
+	void cancel() { cancelToken->cancel(); }
+	bool isCancelled() const { return cancelToken->stopped(); }
+	CancelToken& getCancelToken() { return *cancelToken; }
+	// Use a token shared with other renders; NULL goes back to our own.
+	void setCancelToken( CancelToken *t ) { cancelToken = t ? t : &ownCancel; }
+
+	// Limit traceImage() to pixels [x0,x1) x [y0,y1), rows counted from
+	// the bottom like the buffer's.  A writer then gets rows of the crop
+	// width; pixels outside stay black.  traceSetup() resets it to the
+	// whole image.
+	void setCrop( int x0, int y0, int x1, int y1 );
+
+	// Only trace tiles first..last of the crop window, numbered row by
+	// row from the top left; traceSetup() resets this to all of them.
+	void setTileRange( int first, int last );
+	int tileCount() const;
+	// The tile range, within the tiles there are; first > last if none.
+	void getTileRange( int& first, int& last ) const;
+
+	// The order tiles are traced in, so the part of the image that matters
+	// shows up first, or the slow tiles don't straggle at the end:
+	//   TILES_ROWS    row by row from the top left
+	//   TILES_SPIRAL  ring by ring outwards from the focus point
+	//   TILES_COST    the slowest first, timed with a few rays per tile
+	// The focus is a fraction of the width and height from the top left,
+	// the middle unless set.  traceSetup() keeps both.  traceImage() with
+	// a writer goes in the writer's order regardless.
+	enum TileOrder { TILES_ROWS, TILES_SPIRAL, TILES_COST };
+	void setTileOrder( TileOrder o ) { tileOrder = o; }
+	TileOrder getTileOrder() const { return tileOrder; }
+	void setTileFocus( double x, double y );
+	// The tiles of the tile range not traced yet, in that order.
+	void orderTiles( std::vector<int>& tiles );
+	// Tile t's pixels [x0,x1) x [y0,y1), rows from the bottom.
+	void getTileRect( int t, int& x0, int& y0, int& x1, int& y1 ) const;
+
+	// Trace one tile, for callers that hand tiles to threads themselves
+	// (see RenderScheduler.h).  The tile listener is told as with
+	// traceImage(); progress and checkpoints are up to the caller, and
+	// a tile stopped by cancel() is left unfinished.
+	void traceTile( int t );
+
+	// The part of the image traced so far (the crop window, or its tiles
+	// in the tile range) as a partial for mergePartials(); see
+	// fileio/partial.h.
+	bool savePartial( char *fn, const char *sceneName = NULL );
+
+	// Put the pieces of an image back together, ready for saveImage().
+	// missing is the number of pixels no piece covered.
+	bool mergePartials( int n, char **fns, string& error, long& missing );
+
+	// Every so many seconds while traceImage() runs without a writer,
+	// save the finished tiles' radiance to fn, replacing the previous
+	// checkpoint; the file is removed once the image is done.  settings
+	// describes the render (scene, size, options) and has to match for
+	// resume() to accept the file.  An empty fn turns this off.
+	void setCheckpoint( const string& fn, double seconds, const string& settings );
+
+	// After traceSetup() and setCrop()/setTileRange(): take the finished
+	// tiles from the checkpoint so traceImage() only traces the others.
+	// Sampling is a function of the pixel alone, so the result is the
+	// same as a render that was never interrupted.
+	bool resume( string& error );
+
+	// Render the crop window in passes for as long as seconds allow,
+	// leaving the best image so far: one sample per pixel, a second one
+	// everywhere to estimate the noise, then passes over the noisiest
+	// pixels first, each sample at a new place in its pixel.  The first
+	// pass is always finished, so the image is whole however short the
+	// budget; it stops early once no pixel is noisy.  Call after
+	// traceSetup(); the setting for sub-pixels doesn't apply.  Returns the
+	// number of passes, with the samples traced in *samples.
+	int traceProgressive( int nThreads, double seconds, int firstThread = 0, long *samples = NULL );
+
+	enum { TILE_SIZE = 32 };
+	// Rays sorted and intersected at once; with their hits that is about
+	// half a megabyte, which stays in cache.
+	enum { WAVE_SIZE = 1024 };
+
+	// Tone mapping turns the float buffer into the 8-bit one.  Changing it
+	// re-quantizes what has been rendered so far, no rays are traced.  The
+	// shadow rays left out as too dim to show are judged by the tone map
+	// and depth set when rendering (see updateSkipBudget()).
+	void setToneMap( const ToneMap& tm );
+	const ToneMap& getToneMap() const { return toneMap; }
+	const FrameBuffer& getFrameBuffer() const { return hdrBuffer; }
+
+	// Save the current image; .pfm and .exr keep the float radiance,
+	// .png and .ppm get the tone mapped 8-bit image, as does BMP for
+	// anything else.
+	bool saveImage( char *fn );
+
+	// Nothing here talks to the user: when a scene can't be loaded the
+	// reason is kept for getLoadError().
 	bool loadScene( char* fn );
+	// The text of a scene file; texture maps are looked for relative to
+	// the working directory.  A parse error also goes to *error if given.
+	bool loadScene( istream& is, string *error = NULL );
+	const string& getLoadError() const { return loadError; }
 	bool sceneLoaded();
+	// The loaded scene, for queries that don't render (see RayQuery.h).
+	const Scene *getScene() const { return scene; }
+
+	// Read the file again and update the loaded scene from it in place,
+	// keeping what didn't change (see Scene::update()).  Unlike
+	// loadScene() the image size and buffers are left alone.  False if
+	// the file didn't parse, in which case the scene is as it was.
+	bool reloadScene( char* fn, Scene::Update *report = NULL );
+
+	// The frames of the scene's animation; false if it has none.
+	bool frameRange( int& first, int& last );
+	// Pose the scene for a frame; call traceSetup() before rendering it.
+	void setFrame( double frame );
+
+	// A lat-long background image that replaces the scene's environment
+	// (or black) for rays that miss everything, kept across scene loads.
+	// NULL clears it.
+	bool loadBackground( char* fn );
 
 private:
+	void useScene( Scene *fresh );
+	void releaseBuffer();
+	void updateSkipBudget();
+	bool ensureBuffer();
+	void clearBuffer();
+	void tileRect( int t, PartialRect& r ) const;
+	bool writeCheckpoint( const std::vector<char>& done );
+	void tracePass( PassQueue *q, int index );
+	bool noisiestPixels( const std::vector<float>& squares, std::vector<int>& pixels ) const;
+	// A secondary ray and the factor its radiance is scaled by.
+	struct Bounce
+	{
+		Bounce() : r( vec3f(), vec3f(), ray::VISIBILITY ) {}
+		ray r;
+		vec3f k;
+	};
+
+	// A ray of traceRay()'s path: its shading so far and the secondary
+	// rays still to be added.
+	struct Frame
+	{
+		vec3f intensity;
+		vec3f thresh;
+		Bounce b[2];
+		int count;		// secondary rays
+		int next;		// the one being traced
+	};
+
+	template <int DEPTH>
+	vec3f traceStack( Scene *scene, const ray& r, const vec3f& thresh );
+	vec3f traceFrames( Scene *scene, const ray& r, const vec3f& thresh, int depth, Frame *frames );
+	bool openFrame( Scene *scene, const ray& r, const vec3f& thresh, int depth, Frame& f, vec3f& result );
+	void cameraRay( Scene *scene, double x, double y, ray& r );
+	int bounces( const ray& r, const isect& i, const Material& m, Bounce *out );
+	void traceWave( std::vector<WaveRay>& wave, vec3f *sums );
+	void traceWavefront( int x0, int y0, int x1, int y1 );
+	bool findHit( Scene *scene, const ray& r, isect& i );
+	vec3f shadeHit( Scene *scene, const ray& r, const isect& i, const vec3f& thresh, int depth );
+	vec3f escaped( Scene *scene, const ray& r );
+
 	unsigned char *buffer;
+	bool bufferShared;		// buffer is setBufferMemory()'s, not ours to free
+	FrameBuffer hdrBuffer;
+	ToneMap toneMap;
 	int buffer_width, buffer_height;
+	int buffer_rows;	// rows allocated; image row j lives in row j % buffer_rows
 	int bufferSize;
+	int bufferPitch;	// bytes from a row of buffer to the one above it
+	int cropX0, cropY0, cropX1, cropY1;
+	int firstTile, lastTile;
+	std::vector<char> tileDone;		// tiles traced, by number; see resume()
+	TileOrder tileOrder;
+	double focusX, focusY;
+	string checkpointFile;
+	double checkpointSeconds;
+	string checkpointSettings;
+	ProgressFunc progress;
+	void *progressData;
+	TileListener *tileListener;
+	CancelToken ownCancel;
+	CancelToken *cancelToken;
+	string loadError;
 	Scene *scene;
+	EnvironmentMap *background;
 	float AdaptiveThreshold;
+	int maxDepth;
+	double skipBudget;		// for Material::shade(), from updateSkipBudget()
+	int subPixel;
+	bool relight;
+	bool wavefront;
+	GBuffer gbuffer;
 
 	bool m_bSceneLoaded;
 };
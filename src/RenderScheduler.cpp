@@ -0,0 +1,247 @@
+#include "RenderScheduler.h"
+#include "RayTracer.h"
+#include "RenderThread.h"
+
+struct RenderScheduler::Job
+{
+	// tiles [next,end) of a thread's run
+	struct Run
+	{
+		int next, end;
+	};
+
+	int id;
+	RayTracer *rt;
+	Priority priority;
+	bool hasDeadline;
+	Clock::time_point deadline;
+	Clock::time_point submitted, done;
+	std::vector<int> tiles;		// in the tracer's tile order, a slice of it per run
+	std::vector<Run> runs;		// one per thread
+	int left;					// tiles not started
+	int running;				// being traced
+	int traced;
+	double cpuSeconds;
+	bool cancelled;
+	bool finished;
+
+	// whether this job's tiles go before j's
+	bool before( const Job& j ) const
+	{
+		if( priority != j.priority )
+			return priority > j.priority;
+		if( hasDeadline != j.hasDeadline )
+			return hasDeadline;
+		if( hasDeadline && deadline != j.deadline )
+			return deadline < j.deadline;
+		return id < j.id;
+	}
+};
+
+RenderScheduler::RenderScheduler( int n, int firstThread )
+	: nextJob( 1 ), stopping( false )
+{
+	if( n <= 0 )
+		n = std::thread::hardware_concurrency();
+	if( n < 1 )
+		n = 1;
+	if( firstThread < 0 || firstThread >= MAX_RENDER_THREADS )
+		firstThread = 0;
+	if( n > MAX_RENDER_THREADS - firstThread )
+		n = MAX_RENDER_THREADS - firstThread;
+
+	for( int k = 0; k < n; ++k )
+		threads.push_back( std::thread( &RenderScheduler::work, this, k, firstThread + k ) );
+}
+
+RenderScheduler::~RenderScheduler()
+{
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		stopping = true;
+		ready.notify_all();
+	}
+	for( size_t k = 0; k < threads.size(); ++k )
+		threads[k].join();
+
+	// nobody should be waiting by now, but don't leave them hanging
+	std::lock_guard<std::mutex> guard( lock );
+	for( std::list<Job>::iterator j = jobs.begin(); j != jobs.end(); ++j ) {
+		if( !j->finished ) {
+			j->cancelled = j->cancelled || j->left > 0;
+			j->left = 0;
+			j->finished = true;
+			j->done = Clock::now();
+		}
+	}
+	finished.notify_all();
+}
+
+int RenderScheduler::submit( RayTracer *rt, Priority priority, double deadline )
+{
+	Job j;
+	j.rt = rt;
+	j.priority = priority;
+	j.submitted = Clock::now();
+	j.hasDeadline = deadline > 0.0;
+	if( j.hasDeadline )
+		j.deadline = j.submitted + std::chrono::duration_cast<Clock::duration>(
+			std::chrono::duration<double>( deadline ) );
+	j.running = 0;
+	j.traced = 0;
+	j.cpuSeconds = 0.0;
+	j.cancelled = false;
+
+	rt->orderTiles( j.tiles );
+	j.left = (int)j.tiles.size();
+
+	// a run of neighbouring tiles for every thread, or for tiles in some
+	// other order one run they all take from the front of
+	int n = rt->getTileOrder() == RayTracer::TILES_ROWS ? (int)threads.size() : 1;
+	for( int k = 0; k < n; ++k ) {
+		Job::Run r;
+		r.next = (int)((long long)j.left * k / n);
+		r.end = (int)((long long)j.left * (k + 1) / n);
+		j.runs.push_back( r );
+	}
+	j.finished = j.left == 0;
+	j.done = j.submitted;
+
+	std::lock_guard<std::mutex> guard( lock );
+	j.id = nextJob++;
+	jobs.push_back( j );
+	ready.notify_all();
+	return j.id;
+}
+
+RenderScheduler::Job *RenderScheduler::find( int job )
+{
+	for( std::list<Job>::iterator j = jobs.begin(); j != jobs.end(); ++j )
+		if( j->id == job )
+			return &*j;
+	return NULL;
+}
+
+void RenderScheduler::cancel( int job )
+{
+	std::lock_guard<std::mutex> guard( lock );
+	Job *j = find( job );
+	if( !j || j->finished || !j->left )
+		return;
+	j->cancelled = true;
+	j->left = 0;
+	if( !j->running ) {
+		j->finished = true;
+		j->done = Clock::now();
+		finished.notify_all();
+	}
+}
+
+void RenderScheduler::describe( const Job& j, Status& s ) const
+{
+	Clock::time_point end = j.finished ? j.done : Clock::now();
+	s.tiles = (int)j.tiles.size();
+	s.traced = j.traced;
+	s.finished = j.finished;
+	s.cancelled = j.cancelled;
+	s.late = j.hasDeadline && end > j.deadline;
+	s.cpuSeconds = j.cpuSeconds;
+	s.wallSeconds = std::chrono::duration<double>( end - j.submitted ).count();
+}
+
+bool RenderScheduler::status( int job, Status& s )
+{
+	std::lock_guard<std::mutex> guard( lock );
+	Job *j = find( job );
+	if( j )
+		describe( *j, s );
+	return j != NULL;
+}
+
+bool RenderScheduler::wait( int job, Status *s )
+{
+	std::unique_lock<std::mutex> guard( lock );
+	std::list<Job>::iterator j = jobs.begin();
+	while( j != jobs.end() && j->id != job )
+		++j;
+	if( j == jobs.end() )
+		return false;
+
+	while( !j->finished )
+		finished.wait( guard );
+	bool complete = !j->cancelled;
+	if( s )
+		describe( *j, *s );
+	jobs.erase( j );
+	return complete;
+}
+
+// The most urgent job with tiles left, and the tile for this thread to
+// trace next: from its own run, or the end of the longest other one.
+// Called with the lock held.
+RenderScheduler::Job *RenderScheduler::nextTile( int thread, int& tile )
+{
+	Job *best = NULL;
+	for( std::list<Job>::iterator j = jobs.begin(); j != jobs.end(); ++j ) {
+		if( j->left && j->rt->getCancelToken().expired() ) {
+			j->cancelled = true;
+			j->left = 0;
+			if( !j->running ) {
+				j->finished = true;
+				j->done = Clock::now();
+				finished.notify_all();
+			}
+		}
+		if( j->left && (!best || j->before( *best )) )
+			best = &*j;
+	}
+	if( !best )
+		return NULL;
+
+	Job::Run *own = &best->runs[thread % best->runs.size()];
+	if( own->next < own->end ) {
+		tile = best->tiles[own->next++];
+	} else {
+		Job::Run *longest = NULL;
+		for( size_t k = 0; k < best->runs.size(); ++k ) {
+			Job::Run& r = best->runs[k];
+			if( r.end > r.next && (!longest || r.end - r.next > longest->end - longest->next) )
+				longest = &r;
+		}
+		tile = best->tiles[--longest->end];
+	}
+	--best->left;
+	++best->running;
+	return best;
+}
+
+void RenderScheduler::work( int thread, int index )
+{
+	setRenderThreadIndex( index );
+
+	std::unique_lock<std::mutex> guard( lock );
+	for( ;; ) {
+		Job *j;
+		int tile;
+		while( !stopping && !(j = nextTile( thread, tile )) )
+			ready.wait( guard );
+		if( stopping )
+			break;
+
+		guard.unlock();
+		double start = threadCpuSeconds();
+		j->rt->traceTile( tile );
+		double cpu = threadCpuSeconds() - start;
+		bool complete = !j->rt->isCancelled();
+		guard.lock();
+
+		j->cpuSeconds += cpu;
+		if( complete )
+			++j->traced;
+		if( --j->running == 0 && !j->left ) {
+			j->finished = true;
+			j->done = Clock::now();
+			finished.notify_all();
+		}
+	}
+}
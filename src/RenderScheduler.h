@@ -0,0 +1,98 @@
+#ifndef __RENDERSCHEDULER_H__
+#define __RENDERSCHEDULER_H__
+
+// Several images rendered at once on one pool of threads, instead of a
+// process or a traceImage() per image, each starting threads of its own
+// and all of them fighting over the cores.  A job is a RayTracer set up
+// for an image (traceSetup(), setCrop(), setTileRange(), tone map); the
+// pool traces its tiles while the caller goes on, and waits for it or
+// polls it when it wants the image.
+//
+// Every time a thread finishes a tile it takes its next one from the most
+// urgent job: interactive before batch, then the earliest deadline, then
+// the oldest.  An interactive job that comes in while batch jobs are
+// rendering so gets every thread within one tile, and the batch jobs go
+// on where they were once it is done.  Within a job every thread starts
+// on a run of tiles of its own, next to each other in the image so they
+// share what is in its cache, and once that is done steals from the far
+// end of the longest run left.  A job whose tiles go in some other order
+// (RayTracer::setTileOrder()) has them taken from the front by every
+// thread instead.
+//
+// The CPU time of every tile is measured on the thread that traced it and
+// added to its job's.
+//
+// Jobs share the render thread numbers: per-thread state belongs to the
+// lights and textures of a job's own scene, or only counts statistics.
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class RayTracer;
+
+class RenderScheduler
+{
+public:
+	enum Priority { BATCH = 0, INTERACTIVE = 1 };
+
+	struct Status
+	{
+		int tiles;				// in the job
+		int traced;				// so far
+		bool finished;			// no tiles left to trace or being traced
+		bool cancelled;			// some were left out
+		bool late;				// finished after the deadline, or not yet and past it
+		double cpuSeconds;		// thread time spent on its tiles
+		double wallSeconds;		// from submit() until finished, or now
+	};
+
+	// threads for the pool, 0 for one per core, with render thread numbers
+	// from firstThread on.
+	RenderScheduler( int threads = 0, int firstThread = 0 );
+	// Jobs still going are cancelled, and the tiles being traced finished.
+	~RenderScheduler();
+
+	// Render rt's image as it is set up; rt belongs to the pool until the
+	// job is finished.  deadline is in seconds from now, 0 for none.
+	// Returns the job's number.
+	int submit( RayTracer *rt, Priority priority = BATCH, double deadline = 0.0 );
+
+	// Leave out the job's tiles that haven't been started.  RayTracer's
+	// cancel() and its token's deadline also stop the tiles being traced.
+	void cancel( int job );
+
+	// False if there is no such job (or it was waited for already).
+	bool status( int job, Status& s );
+
+	// Block until the job is finished, then forget it.  True if every tile
+	// was traced.
+	bool wait( int job, Status *s = NULL );
+
+	int threadCount() const { return (int)threads.size(); }
+
+private:
+	struct Job;
+	typedef std::chrono::steady_clock Clock;
+
+	void work( int thread, int index );
+	Job *nextTile( int thread, int& tile );
+	Job *find( int job );
+	void describe( const Job& j, Status& s ) const;
+
+	std::mutex lock;
+	std::condition_variable ready;		// tiles to trace, or stopping
+	std::condition_variable finished;	// a job finished
+	std::list<Job> jobs;
+	std::vector<std::thread> threads;
+	int nextJob;
+	bool stopping;
+
+	RenderScheduler( const RenderScheduler& );
+	RenderScheduler& operator =( const RenderScheduler& );
+};
+
+#endif // __RENDERSCHEDULER_H__
@@ -0,0 +1,584 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#ifndef WIN32
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#include "RenderServer.h"
+#include "RayTracer.h"
+
+#ifndef WIN32
+
+// One client: buffered reads of request lines and inline scenes.
+class RenderServer::Connection
+{
+public:
+	Connection( int f ) : fd( f ), start( 0 ), end( 0 ) {}
+
+	bool readLine( std::string& line );
+	bool readBytes( size_t n, std::string& text );
+	bool write( const void *data, size_t n );
+	bool print( const char *fmt, ... );
+
+private:
+	bool fill();
+
+	int fd;
+	char buf[4096];
+	size_t start, end;
+};
+
+bool RenderServer::Connection::fill()
+{
+	ssize_t n;
+	do {
+		n = ::read( fd, buf, sizeof(buf) );
+	} while( n < 0 && errno == EINTR );
+	if( n <= 0 )
+		return false;
+	start = 0;
+	end = (size_t)n;
+	return true;
+}
+
+bool RenderServer::Connection::readLine( std::string& line )
+{
+	line.clear();
+	for( ;; ) {
+		if( start == end && !fill() )
+			return !line.empty();
+		char c = buf[start++];
+		if( c == '\n' )
+			return true;
+		if( c != '\r' )
+			line += c;
+	}
+}
+
+bool RenderServer::Connection::readBytes( size_t n, std::string& text )
+{
+	text.clear();
+	text.reserve( n );
+	while( text.size() < n ) {
+		if( start == end && !fill() )
+			return false;
+		size_t k = end - start < n - text.size() ? end - start : n - text.size();
+		text.append( buf + start, k );
+		start += k;
+	}
+	return true;
+}
+
+bool RenderServer::Connection::write( const void *data, size_t n )
+{
+	const char *p = (const char *)data;
+	while( n > 0 ) {
+		ssize_t k = ::write( fd, p, n );
+		if( k < 0 && errno == EINTR )
+			continue;
+		if( k <= 0 )
+			return false;
+		p += k;
+		n -= (size_t)k;
+	}
+	return true;
+}
+
+bool RenderServer::Connection::print( const char *fmt, ... )
+{
+	char line[512];
+	va_list args;
+	va_start( args, fmt );
+	vsnprintf( line, sizeof(line), fmt, args );
+	va_end( args );
+	return write( line, strlen( line ) );
+}
+
+// The finished tiles of a job, counted by band of the crop window from the
+// top, so that rows can go to the client as soon as their band is done.
+class RenderServer::Bands : public RayTracer::TileListener
+{
+public:
+	Bands( int across, int down ) : tilesAcross( across ), left( down, across ) {}
+
+	virtual void tileFinished( int tile, int x0, int y0, int x1, int y1 )
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		--left[tile / tilesAcross];
+		changed.notify_all();
+	}
+
+	// Block until band b is finished, or the job stopped without it.
+	bool wait( int b, RenderScheduler& scheduler, int job )
+	{
+		std::unique_lock<std::mutex> guard( lock );
+		RenderScheduler::Status s;
+		while( left[b] > 0 ) {
+			// the last tile is counted before the job is marked finished
+			if( !scheduler.status( job, s ) || s.finished )
+				return false;
+			changed.wait_for( guard, std::chrono::milliseconds( 50 ) );
+		}
+		return true;
+	}
+
+private:
+	int tilesAcross;
+	std::vector<int> left;
+	std::mutex lock;
+	std::condition_variable changed;
+};
+
+// 64-bit FNV-1a
+static unsigned long long hashBytes( const std::string& s, unsigned long long h = 14695981039346656037ULL )
+{
+	for( size_t k = 0; k < s.size(); ++k ) {
+		h ^= (unsigned char)s[k];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// The texture and environment maps a loaded scene read, by name, size
+// and modification time, so that one edited since is noticed.  The
+// background is counted too.
+static unsigned long long fileStamp( const RayTracer *rt, const std::string& background )
+{
+	std::vector<std::string> files( rt->getScene()->getFiles() );
+	if( !background.empty() )
+		files.push_back( background );
+
+	unsigned long long h = 14695981039346656037ULL;
+	for( size_t k = 0; k < files.size(); ++k ) {
+		struct stat st;
+		std::ostringstream stamp;
+		stamp << files[k];
+		if( stat( files[k].c_str(), &st ) == 0 )
+			stamp << ' ' << (long long)st.st_size << ' ' << (long long)st.st_mtime;
+		h = hashBytes( stamp.str() + '\n', h );
+	}
+	return h;
+}
+
+RenderServer::RenderServer( int n, int size )
+	: scheduler( n ), cacheSize( size > 0 ? size : 1 ), hits( 0 ), misses( 0 ),
+	listener( -1 ), quitting( false )
+{
+}
+
+RenderServer::~RenderServer()
+{
+	for( std::list<Entry>::iterator e = cache.begin(); e != cache.end(); ++e )
+		delete e->tracer;
+}
+
+// Drop the least recently used scenes not being rendered while there are
+// too many.  Called with the lock held.
+void RenderServer::trim()
+{
+	std::list<Entry>::iterator e = cache.end();
+	while( (int)cache.size() > cacheSize && e != cache.begin() ) {
+		--e;
+		if( !e->busy ) {
+			delete e->tracer;
+			e = cache.erase( e );
+		}
+	}
+}
+
+// The cached ray tracer for a scene, moved to the front, or a new one
+// with the scene loaded from path (or text if there is no path).  It
+// belongs to the caller until release(); a client that wants a scene
+// another is rendering waits for it.
+RayTracer *RenderServer::findScene( unsigned long long key, const std::string& text,
+	const std::string& path, bool& hit, std::string& error )
+{
+	{
+		std::unique_lock<std::mutex> guard( lock );
+		for( std::list<Entry>::iterator e = cache.begin(); e != cache.end(); ) {
+			if( e->key != key ) {
+				++e;
+				continue;
+			}
+			if( e->busy ) {
+				released.wait( guard );
+				e = cache.begin();
+				continue;
+			}
+			if( fileStamp( e->tracer, background ) != e->files ) {
+				// a texture changed under it
+				delete e->tracer;
+				e = cache.erase( e );
+				continue;
+			}
+			cache.splice( cache.begin(), cache, e );
+			cache.front().busy = true;
+			hit = true;
+			++hits;
+			return cache.front().tracer;
+		}
+		++misses;
+	}
+
+	hit = false;
+	RayTracer *rt = new RayTracer();
+	if( !background.empty() ) {
+		std::vector<char> fn( background.begin(), background.end() );
+		fn.push_back( '\0' );
+		rt->loadBackground( &fn[0] );
+	}
+
+	bool ok;
+	if( path.empty() ) {
+		std::istringstream is( text );
+		ok = rt->loadScene( is, &error );
+	} else {
+		std::vector<char> fn( path.begin(), path.end() );
+		fn.push_back( '\0' );
+		ok = rt->loadScene( &fn[0] );
+		if( !ok )
+			error = rt->getLoadError();
+	}
+	if( !ok ) {
+		delete rt;
+		return NULL;
+	}
+
+	Entry e;
+	e.key = key;
+	e.files = fileStamp( rt, background );
+	e.tracer = rt;
+	e.busy = true;
+	std::lock_guard<std::mutex> guard( lock );
+	cache.push_front( e );
+	trim();
+	return rt;
+}
+
+// Give back a ray tracer from findScene().
+void RenderServer::release( RayTracer *rt )
+{
+	std::lock_guard<std::mutex> guard( lock );
+	for( std::list<Entry>::iterator e = cache.begin(); e != cache.end(); ++e )
+		if( e->tracer == rt )
+			e->busy = false;
+	trim();
+	released.notify_all();
+}
+
+// Releases a ray tracer at the end of a job, however it ends.
+class RenderServer::Lease
+{
+public:
+	Lease( RenderServer& s, RayTracer *t ) : server( s ), rt( t ) {}
+	~Lease() { if( rt ) server.release( rt ); }
+
+private:
+	RenderServer& server;
+	RayTracer *rt;
+};
+
+bool RenderServer::render( Connection& c, const std::string& request )
+{
+	std::istringstream words( request );
+	std::string word;
+	words >> word;		// "render"
+
+	std::string path, text;
+	int width = 150, height = 0, depth = 0, subPixel = 1;
+	double threshold = 0.0, frame = 0.0, deadline = 0.0;
+	bool hasFrame = false, hasCrop = false;
+	int crop[4] = { 0, 0, 0, 0 };
+	RenderScheduler::Priority priority = RenderScheduler::BATCH;
+	ToneMap tm;
+	size_t inlineBytes = 0;
+	std::string bad;
+
+	while( words >> word ) {
+		std::string::size_type eq = word.find( '=' );
+		std::string name = word.substr( 0, eq );
+		std::string value = eq == std::string::npos ? std::string() : word.substr( eq + 1 );
+		const char *v = value.c_str();
+
+		if( name == "scene" ) path = value;
+		else if( name == "inline" ) inlineBytes = (size_t)atol( v );
+		else if( name == "width" ) width = atoi( v );
+		else if( name == "height" ) height = atoi( v );
+		else if( name == "depth" ) depth = atoi( v );
+		else if( name == "subpixel" ) subPixel = atoi( v );
+		else if( name == "threshold" ) threshold = atof( v );
+		else if( name == "exposure" ) tm.exposure = atof( v );
+		else if( name == "gamma" ) tm.gamma = atof( v );
+		else if( name == "reinhard" ) tm.reinhard = atoi( v ) != 0;
+		else if( name == "frame" ) { frame = atof( v ); hasFrame = true; }
+		else if( name == "deadline" ) deadline = atof( v );
+		else if( name == "crop" ) {
+			hasCrop = sscanf( v, "%d,%d,%d,%d", &crop[0], &crop[1], &crop[2], &crop[3] ) == 4;
+			if( !hasCrop )
+				bad = "bad crop " + value;
+		} else if( name == "priority" ) {
+			if( value == "interactive" )
+				priority = RenderScheduler::INTERACTIVE;
+			else if( value == "batch" )
+				priority = RenderScheduler::BATCH;
+			else
+				bad = "bad priority " + value;
+		} else
+			bad = "unknown setting " + name;
+	}
+
+	// an inline scene has to be read even for a bad request, or it would
+	// be taken for the next ones
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	if( inlineBytes && !c.readBytes( inlineBytes, text ) )
+		return false;
+	if( !bad.empty() )
+		return c.print( "error %s\n", bad.c_str() );
+
+	unsigned long long key;
+	if( inlineBytes ) {
+		key = hashBytes( text );
+		path.clear();
+	} else if( !path.empty() ) {
+		// a path is hashed by what is in the file now, and where its
+		// textures will be looked for
+		std::ifstream f( path.c_str(), std::ios::binary );
+		if( !f )
+			return c.print( "error couldn't read %s\n", path.c_str() );
+		std::ostringstream contents;
+		contents << f.rdbuf();
+		std::string::size_type slash = path.find_last_of( "/\\" );
+		key = hashBytes( contents.str(),
+			hashBytes( slash == std::string::npos ? std::string() : path.substr( 0, slash ) ) );
+	} else {
+		return c.print( "error no scene\n" );
+	}
+
+	bool hit;
+	std::string error;
+	RayTracer *rt = findScene( key, text, path, hit, error );
+	if( !rt )
+		return c.print( "error %s\n", error.c_str() );
+	Lease lease( *this, rt );
+
+	if( width < 1 )
+		width = 1;
+	if( height < 1 )
+		height = (int)(width / rt->aspectRatio() + 0.5);
+	if( height < 1 )
+		height = 1;
+
+	rt->setDepth( depth );
+	rt->setSubPixel( subPixel );
+	rt->setAdaptiveThreshold( threshold );
+
+	// animated scenes are posed for every job, they may have been left
+	// at another frame
+	int first, last;
+	if( rt->frameRange( first, last ) )
+		rt->setFrame( hasFrame ? frame : first );
+
+	rt->traceSetup( width, height );
+	rt->setToneMap( tm );
+
+	int x0 = 0, y0 = 0, x1 = width, y1 = height;
+	if( hasCrop ) {
+		x0 = max( 0, min( crop[0], width ) );
+		y0 = max( 0, min( crop[1], height ) );
+		x1 = max( x0, min( crop[2], width ) );
+		y1 = max( y0, min( crop[3], height ) );
+		if( x0 == x1 || y0 == y1 )
+			return c.print( "error empty crop window\n" );
+	}
+	// the buffer's rows count from the bottom
+	rt->setCrop( x0, height - y1, x1, height - y0 );
+
+	int across = (x1 - x0 + RayTracer::TILE_SIZE - 1) / RayTracer::TILE_SIZE;
+	int down = (y1 - y0 + RayTracer::TILE_SIZE - 1) / RayTracer::TILE_SIZE;
+	Bands bands( across, down );
+	rt->setTileListener( &bands );
+	// the last job on this scene cleared its token when it was done
+	std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+	rt->getCancelToken().setDeadline( deadline );
+	int job = scheduler.submit( rt, priority, deadline );
+
+	double load = std::chrono::duration<double>( t1 - t0 ).count();
+	bool ok = c.print( "ok %d %d %s %.6f %d\n", x1 - x0, y1 - y0, hit ? "hit" : "miss", load, job );
+
+	// the grid is anchored at the window's bottom, so the top band can be
+	// short; the bands of a job stopped short go as they are
+	unsigned char *buf;
+	int bw, bh;
+	rt->getBuffer( buf, bw, bh );
+	for( int b = 0; b < down && ok; ++b ) {
+		bands.wait( b, scheduler, job );
+		int bottom = (height - y1) + (down - 1 - b) * RayTracer::TILE_SIZE;
+		int top = min( bottom + (int)RayTracer::TILE_SIZE, height - y0 );
+		for( int y = top - 1; y >= bottom && ok; --y )
+			ok = c.write( buf + ((size_t)y * bw + x0) * 3, (size_t)(x1 - x0) * 3 );
+	}
+	if( !ok )
+		scheduler.cancel( job );
+	RenderScheduler::Status st;
+	bool complete = scheduler.wait( job, &st );
+	rt->setTileListener( NULL );
+	rt->getCancelToken().reset();
+	if( !ok ) {
+		fprintf( stderr, "%s: client went away, cancelled after %d of %d tiles\n",
+			path.empty() ? "(inline)" : path.c_str(), st.traced, st.tiles );
+		return false;
+	}
+
+	double t = std::chrono::duration<double>( std::chrono::steady_clock::now() - t1 ).count();
+	fprintf( stderr, "job %d: %s %dx%d, %s, scene %s in %.3f s, %s in %.3f s (%.3f s of CPU)\n",
+		job, path.empty() ? "(inline)" : path.c_str(), x1 - x0, y1 - y0,
+		priority == RenderScheduler::INTERACTIVE ? "interactive" : "batch",
+		hit ? "cached" : "loaded", load, complete ? "rendered" : "stopped", t, st.cpuSeconds );
+	if( !complete )
+		return c.print( "stopped %.6f %d %d\n", t, st.traced, st.tiles );
+	return c.print( "done %.6f\n", t );
+}
+
+// Jobs from one client until it hangs up; false once one says "quit".
+bool RenderServer::serve( Connection& c )
+{
+	std::string line;
+	while( c.readLine( line ) ) {
+		if( line.compare( 0, 6, "render" ) == 0 ) {
+			if( !render( c, line ) )
+				break;
+		} else if( line.compare( 0, 7, "cancel " ) == 0 ) {
+			scheduler.cancel( atoi( line.c_str() + 7 ) );
+			c.print( "ok\n" );
+		} else if( line == "stats" ) {
+			std::lock_guard<std::mutex> guard( lock );
+			int connected = 0;
+			for( std::list<Client>::iterator k = clients.begin(); k != clients.end(); ++k )
+				if( k->fd >= 0 )
+					++connected;
+			c.print( "ok %d scenes, %ld hits, %ld misses, %d clients\n", (int)cache.size(), hits, misses,
+				connected );
+		} else if( line == "quit" ) {
+			c.print( "ok\n" );
+			return false;
+		} else if( !line.empty() ) {
+			c.print( "error unknown request\n" );
+		}
+	}
+	return true;
+}
+
+// A client's thread: it is served until it hangs up, and a "quit" stops
+// the server.
+void RenderServer::client( RenderServer *server, Client *me )
+{
+	Connection c( me->fd );
+	if( !server->serve( c ) ) {
+		std::lock_guard<std::mutex> guard( server->lock );
+		server->quitting = true;
+		// wakes accept()
+		shutdown( server->listener, SHUT_RDWR );
+	}
+
+	std::lock_guard<std::mutex> guard( server->lock );
+	close( me->fd );
+	me->fd = -1;
+}
+
+bool RenderServer::run( const char *path )
+{
+	// a client that hangs up mid-image shouldn't take the server down
+	signal( SIGPIPE, SIG_IGN );
+
+	sockaddr_un addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	if( strlen( path ) >= sizeof(addr.sun_path) ) {
+		fprintf( stderr, "socket path %s is too long\n", path );
+		return false;
+	}
+	strcpy( addr.sun_path, path );
+
+	listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+	unlink( path );
+	if( listener < 0 || bind( listener, (sockaddr *)&addr, sizeof(addr) ) != 0
+		|| listen( listener, 16 ) != 0 ) {
+		perror( path );
+		if( listener >= 0 )
+			close( listener );
+		listener = -1;
+		return false;
+	}
+	fprintf( stderr, "serving on %s\n", path );
+
+	for( ;; ) {
+		int fd = accept( listener, NULL, NULL );
+		std::lock_guard<std::mutex> guard( lock );
+		if( quitting ) {
+			if( fd >= 0 )
+				close( fd );
+			break;
+		}
+		if( fd < 0 ) {
+			if( errno == EINTR || errno == ECONNABORTED )
+				continue;
+			perror( "accept" );
+			break;
+		}
+
+		// clients that have hung up are joined as new ones come in
+		for( std::list<Client>::iterator k = clients.begin(); k != clients.end(); ) {
+			if( k->fd < 0 ) {
+				k->thread.join();
+				k = clients.erase( k );
+			} else {
+				++k;
+			}
+		}
+		clients.resize( clients.size() + 1 );
+		clients.back().fd = fd;
+		clients.back().thread = std::thread( client, this, &clients.back() );
+	}
+
+	// the others are hung up on; their jobs are cancelled as their
+	// writes fail
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		for( std::list<Client>::iterator k = clients.begin(); k != clients.end(); ++k )
+			if( k->fd >= 0 )
+				shutdown( k->fd, SHUT_RDWR );
+	}
+	for( std::list<Client>::iterator k = clients.begin(); k != clients.end(); ++k )
+		k->thread.join();
+	clients.clear();
+
+	close( listener );
+	listener = -1;
+	unlink( path );
+	return true;
+}
+
+#else
+
+bool RenderServer::run( const char *path )
+{
+	fprintf( stderr, "the render server needs Unix domain sockets\n" );
+	return false;
+}
+
+#endif // WIN32
@@ -0,0 +1,114 @@
+#ifndef __RENDERSERVER_H__
+#define __RENDERSERVER_H__
+
+// A renderer that stays up between images, for pipelines that would
+// otherwise start the command line tracer for every one of them and pay
+// for the parse, the BVH build and texture loads each time.  Clients
+// connect to a Unix domain socket and send jobs, one line each:
+//
+//     render scene=<path> width=320 depth=3
+//     render inline=<bytes> width=320 crop=0,0,64,64
+//     cancel <job>
+//     stats
+//     quit
+//
+// An inline job is followed by that many bytes of scene file text.  The
+// render settings are width, height (default: from the camera's aspect
+// ratio), depth, subpixel, threshold, exposure, gamma, reinhard=0|1,
+// frame (for animated scenes), crop=x0,y0,x1,y1, a window in pixels
+// counted from the top left, x1 and y1 excluded,
+// priority=interactive|batch (default batch) and deadline=<seconds> from
+// when the scene is ready.  Batch jobs with a deadline go before those
+// without, the earliest first, and a job still going at its deadline is
+// stopped.
+//
+// A render is answered with "ok <width> <height> <hit|miss> <load
+// seconds> <job>", a newline, the crop window's 8-bit RGB rows top down as
+// their band of tiles is finished, and a "done <render seconds>" line; a
+// failed job gets an "error <message>" line instead.  A job cancelled
+// from another connection or past its deadline still sends every row,
+// black where tiles were left out, and ends with "stopped <render
+// seconds> <tiles traced> <tiles>".
+//
+// Every client has a thread of its own and can send any number of jobs.
+// Jobs are rendered on one pool of threads by a RenderScheduler, so an
+// interactive job takes the threads from batch jobs within a tile, and a
+// client that hangs up mid-image has the rest of its tiles cancelled.
+// "quit" hangs up on the other clients.
+//
+// Loaded scenes are kept, BVH and textures included, in a least recently
+// used cache keyed by a hash of the scene text (and for a path, the
+// directory its textures are found in), so a repeat render of an
+// unchanged scene only traces rays.  An edited scene hashes differently
+// and is loaded fresh, and so is one whose texture or environment maps
+// have changed size or modification time since.  A scene is rendered for
+// one client at a time; another that wants it waits.
+
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "RenderScheduler.h"
+
+class RayTracer;
+
+class RenderServer
+{
+public:
+	RenderServer( int threads, int cacheSize );
+	~RenderServer();
+
+	// A background image for rays that miss, in every scene.
+	void setBackground( const char *fn ) { background = fn ? fn : ""; }
+
+	// Serve clients on a socket made at path until one sends "quit".
+	// False if the socket can't be made.
+	bool run( const char *path );
+
+	enum { DEFAULT_CACHE_SIZE = 8 };
+
+private:
+	struct Entry
+	{
+		unsigned long long key;
+		unsigned long long files;	// fileStamp() when it was loaded
+		RayTracer *tracer;
+		bool busy;					// a client is rendering it
+	};
+
+	struct Client
+	{
+		int fd;						// -1 once it has hung up
+		std::thread thread;
+	};
+
+	class Connection;
+	class Bands;
+	class Lease;
+
+	static void client( RenderServer *server, Client *me );
+	bool serve( Connection& c );
+	bool render( Connection& c, const std::string& request );
+	RayTracer *findScene( unsigned long long key, const std::string& text,
+		const std::string& path, bool& hit, std::string& error );
+	void release( RayTracer *rt );
+	void trim();
+
+	RenderScheduler scheduler;
+	int cacheSize;
+	std::string background;
+	std::mutex lock;			// the cache, the counts and the clients
+	std::condition_variable released;
+	std::list<Entry> cache;		// most recently used first
+	long hits, misses;
+	std::list<Client> clients;
+	int listener;
+	bool quitting;
+
+	RenderServer( const RenderServer& );
+	RenderServer& operator =( const RenderServer& );
+};
+
+#endif // __RENDERSERVER_H__
@@ -0,0 +1,97 @@
+#include "RenderStats.h"
+#include "RenderThread.h"
+#include "scene/texturecache.h"
+
+// one set of counters per render thread, each on its own cache lines
+struct PaddedStats
+{
+	RenderStats stats;
+	char pad[CACHE_LINE_SIZE];
+};
+
+static PaddedStats s_stats[MAX_RENDER_THREADS];
+
+void RenderStats::clear()
+{
+	shadowRays = 0;
+	shadowSkippedBackfacing = 0;
+	shadowSkippedNegligible = 0;
+	occluderCacheHits = 0;
+	occluderCacheMisses = 0;
+	areaLightLookups = 0;
+	areaLightSamples = 0;
+	areaLightEarlyOuts = 0;
+	textureHandleHits = 0;
+	textureCacheHits = 0;
+	textureCacheMisses = 0;
+}
+
+RenderStats& RenderStats::operator +=( const RenderStats& other )
+{
+	shadowRays += other.shadowRays;
+	shadowSkippedBackfacing += other.shadowSkippedBackfacing;
+	shadowSkippedNegligible += other.shadowSkippedNegligible;
+	occluderCacheHits += other.occluderCacheHits;
+	occluderCacheMisses += other.occluderCacheMisses;
+	areaLightLookups += other.areaLightLookups;
+	areaLightSamples += other.areaLightSamples;
+	areaLightEarlyOuts += other.areaLightEarlyOuts;
+	textureHandleHits += other.textureHandleHits;
+	textureCacheHits += other.textureCacheHits;
+	textureCacheMisses += other.textureCacheMisses;
+	return *this;
+}
+
+void RenderStats::print( FILE *fp ) const
+{
+	long avoided = shadowSkippedBackfacing + shadowSkippedNegligible;
+	long candidates = shadowRays + avoided;
+
+	fprintf( fp, "shadow rays traced    = %ld\n", shadowRays );
+	fprintf( fp, "shadow rays avoided   = %ld (%.1f%%)\n", avoided,
+		candidates ? 100.0 * avoided / candidates : 0.0 );
+	fprintf( fp, "  back-facing/no kd,ks = %ld\n", shadowSkippedBackfacing );
+	fprintf( fp, "  below 8-bit step     = %ld\n", shadowSkippedNegligible );
+
+	long cacheTests = occluderCacheHits + occluderCacheMisses;
+	fprintf( fp, "occluder cache hits   = %ld of %ld tests (%.1f%%)\n",
+		occluderCacheHits, cacheTests,
+		cacheTests ? 100.0 * occluderCacheHits / cacheTests : 0.0 );
+
+	if( areaLightLookups ) {
+		fprintf( fp, "area light samples    = %ld (%.2f per lookup)\n",
+			areaLightSamples, (double)areaLightSamples / areaLightLookups );
+		fprintf( fp, "  adaptive early outs  = %ld of %ld lookups\n",
+			areaLightEarlyOuts, areaLightLookups );
+	}
+
+	long tileLookups = textureHandleHits + textureCacheHits + textureCacheMisses;
+	if( tileLookups ) {
+		fprintf( fp, "texture tile lookups  = %ld\n", tileLookups );
+		fprintf( fp, "  thread handle hits   = %ld (%.1f%%)\n", textureHandleHits,
+			100.0 * textureHandleHits / tileLookups );
+		fprintf( fp, "  shared cache hits    = %ld (%.1f%%)\n", textureCacheHits,
+			100.0 * textureCacheHits / tileLookups );
+		fprintf( fp, "  misses, read         = %ld (%.1f MB)\n", textureCacheMisses,
+			textureCacheMisses * (3.0 * TiledTexture::TILE_SIZE * TiledTexture::TILE_SIZE) / (1 << 20) );
+	}
+}
+
+RenderStats& RenderStats::local()
+{
+	return s_stats[renderThreadIndex()].stats;
+}
+
+RenderStats RenderStats::total()
+{
+	RenderStats sum;
+	for( int k = 0; k < MAX_RENDER_THREADS; ++k )
+		sum += s_stats[k].stats;
+	return sum;
+}
+
+void RenderStats::reset()
+{
+	for( int k = 0; k < MAX_RENDER_THREADS; ++k )
+		s_stats[k].stats.clear();
+}
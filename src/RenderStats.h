@@ -0,0 +1,43 @@
+#ifndef __RENDERSTATS_H__
+#define __RENDERSTATS_H__
+
+// Counters gathered while rendering.  They are cheap enough to leave on
+// all the time and are printed by the -t option in text mode.
+
+#include <stdio.h>
+
+class RenderStats
+{
+public:
+	RenderStats() { clear(); }
+
+	void clear();
+	RenderStats& operator +=( const RenderStats& other );
+	void print( FILE *fp ) const;
+
+	// counters for the calling render thread
+	static RenderStats& local();
+	// sum of the counters of every render thread
+	static RenderStats total();
+	static void reset();
+
+public:
+	// shadow rays
+	long shadowRays;				// shadow rays actually traced
+	long shadowSkippedBackfacing;	// light behind the surface or no kd/ks
+	long shadowSkippedNegligible;	// contribution below one 8-bit step
+	long occluderCacheHits;			// blocked by the thread's last occluder
+	long occluderCacheMisses;		// last occluder tested but missed
+
+	// area lights
+	long areaLightLookups;			// shadowAttenuation() calls
+	long areaLightSamples;			// visibility samples taken
+	long areaLightEarlyOuts;		// lookups stopped after the adaptive test
+
+	// tiled texture cache
+	long textureHandleHits;			// tile found in the thread's own handles
+	long textureCacheHits;			// tile found in the shared cache
+	long textureCacheMisses;		// tile read from disk
+};
+
+#endif // __RENDERSTATS_H__
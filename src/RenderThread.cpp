@@ -0,0 +1,46 @@
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "RenderThread.h"
+
+static RENDER_THREAD_LOCAL int s_threadIndex = 0;
+static RENDER_THREAD_LOCAL bool s_numbered = false;
+
+int renderThreadIndex()
+{
+	return s_threadIndex;
+}
+
+void setRenderThreadIndex( int index )
+{
+	if( index < 0 || index >= MAX_RENDER_THREADS )
+		index = 0;
+	s_threadIndex = index;
+	s_numbered = true;
+}
+
+bool isRenderThread()
+{
+	return s_numbered;
+}
+
+double threadCpuSeconds()
+{
+#ifdef WIN32
+	FILETIME created, exited, kernel, user;
+	if( !GetThreadTimes( GetCurrentThread(), &created, &exited, &kernel, &user ) )
+		return 0.0;
+	// 100 ns units
+	unsigned long long k = ((unsigned long long)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+	unsigned long long u = ((unsigned long long)user.dwHighDateTime << 32) | user.dwLowDateTime;
+	return (k + u) * 1e-7;
+#else
+	timespec ts;
+	if( clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts ) != 0 )
+		return 0.0;
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
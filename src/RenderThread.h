@@ -0,0 +1,29 @@
+#ifndef __RENDERTHREAD_H__
+#define __RENDERTHREAD_H__
+
+// Render threads are numbered 0..MAX_RENDER_THREADS-1, so per-thread state
+// (statistics, shadow caches, ...) can live in plain arrays indexed by the
+// thread number instead of behind a lock.  A thread that never called
+// setRenderThreadIndex() is thread 0, but isRenderThread() tells it apart.
+
+#ifdef _MSC_VER
+#define RENDER_THREAD_LOCAL __declspec(thread)
+#else
+#define RENDER_THREAD_LOCAL __thread
+#endif
+
+const int MAX_RENDER_THREADS = 64;
+
+// Size used to pad per-thread slots so that two threads never write to the
+// same cache line.
+const int CACHE_LINE_SIZE = 64;
+
+int renderThreadIndex();
+void setRenderThreadIndex( int index );
+bool isRenderThread();
+
+// CPU time the calling thread has used, in seconds; differences are what
+// count.
+double threadCpuSeconds();
+
+#endif // __RENDERTHREAD_H__
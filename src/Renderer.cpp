@@ -0,0 +1,80 @@
+#include <string.h>
+
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "Renderer.h"
+
+Renderer::Options::Options()
+	: width( 256 ), height( 256 ), depth( 0 ), subPixel( 1 ), threshold( 0.0 ),
+	threads( 0 ), firstThread( 0 )
+{
+}
+
+Renderer::Renderer()
+{
+}
+
+bool Renderer::load( const char *path )
+{
+	std::vector<char> fn( path, path + strlen( path ) + 1 );
+	return tracer.loadScene( &fn[0] );
+}
+
+bool Renderer::load( const char *text, size_t size )
+{
+	std::istringstream is( std::string( text, size ) );
+	return tracer.loadScene( is );
+}
+
+int Renderer::heightFor( int width )
+{
+	int h = (int)(width / tracer.aspectRatio() + 0.5);
+	return h > 0 ? h : 1;
+}
+
+bool Renderer::render( const Options& opts, unsigned char *rgb, int rowBytes,
+	RayTracer::ProgressFunc f, void *data )
+{
+	if( !tracer.sceneLoaded() || opts.width < 1 || opts.height < 1 )
+		return false;
+
+	int threads = opts.threads;
+	if( threads <= 0 )
+		threads = std::thread::hardware_concurrency();
+	if( threads < 1 )
+		threads = 1;
+
+	tracer.setDepth( opts.depth );
+	tracer.setSubPixel( opts.subPixel );
+	tracer.setAdaptiveThreshold( opts.threshold );
+	tracer.traceSetup( opts.width, opts.height );
+	tracer.setToneMap( opts.toneMap );
+
+	// straight into rgb; the buffer's rows count from the bottom, so
+	// they go from rgb's last row upwards
+	if( rowBytes <= 0 )
+		rowBytes = opts.width * 3;
+	tracer.setBufferMemory( rgb + (size_t)(opts.height - 1) * rowBytes, -rowBytes );
+
+	tracer.setProgress( f, data );
+	bool ok = tracer.traceImage( threads, NULL, opts.firstThread );
+	tracer.setProgress( NULL, NULL );
+	tracer.dropBufferMemory();
+	return ok;
+}
+
+void Renderer::getRadiance( float *rgb ) const
+{
+	const FrameBuffer& fb = tracer.getFrameBuffer();
+	int w = fb.getWidth(), h = fb.getHeight();
+	for( int j = 0; j < h; ++j )
+		for( int i = 0; i < w; ++i ) {
+			vec3f c = fb.getAverage( i, h - 1 - j );
+			float *p = rgb + ((size_t)j * w + i) * 3;
+			p[0] = (float)c[0];
+			p[1] = (float)c[1];
+			p[2] = (float)c[2];
+		}
+}
@@ -0,0 +1,82 @@
+#ifndef __RENDERER_H__
+#define __RENDERER_H__
+
+// The ray tracer for programs that embed it: a scene loaded from a file
+// or from text in memory, rendered into the caller's own pixels, with
+// progress reports and a way to stop.  Nothing here opens a window or
+// prints; errors come back through error().  This and the headers it
+// includes are all the rayCore library asks of its users.
+//
+//     Renderer r;
+//     if( !r.load( "scene.ray" ) )
+//         complain( r.error() );
+//     Renderer::Options opts;
+//     opts.width = 640;
+//     opts.height = r.heightFor( 640 );
+//     std::vector<unsigned char> rgb( 640 * opts.height * 3 );
+//     r.render( opts, &rgb[0] );
+//
+// One Renderer renders one image at a time; several can run side by side
+// as long as their threads' numbers don't overlap (see firstThread).
+
+#include <stddef.h>
+#include <string>
+
+#include "RayTracer.h"
+
+class Renderer
+{
+public:
+	struct Options
+	{
+		Options();
+
+		int width, height;
+		int depth;				// reflection and refraction bounces
+		int subPixel;			// samples per pixel are subPixel squared
+		double threshold;		// adaptive termination, 0 for none
+		int threads;			// 0 for one per core
+		int firstThread;		// render thread numbers start here
+		ToneMap toneMap;
+	};
+
+	Renderer();
+
+	// False if the scene can't be read; the reason is in error().
+	bool load( const char *path );
+	// Scene file text; texture maps are looked for relative to the
+	// working directory.
+	bool load( const char *text, size_t size );
+	bool loaded() { return tracer.sceneLoaded(); }
+	const std::string& error() const { return tracer.getLoadError(); }
+
+	// The image height that keeps the camera's aspect ratio.
+	int heightFor( int width );
+
+	// Render straight into rgb: opts.height rows of opts.width 8-bit RGB pixels,
+	// top row first, rowBytes apart (0 for packed rows).  Progress goes to
+	// f, on this thread, as a fraction of the image; returning false
+	// cancels.  False if no scene is loaded or the render was cancelled,
+	// in which case the tiles that were finished are in rgb and the rest
+	// is black.
+	bool render( const Options& opts, unsigned char *rgb, int rowBytes = 0,
+		RayTracer::ProgressFunc f = NULL, void *data = NULL );
+
+	// The last render's radiance, linear and before tone mapping: three
+	// floats per pixel, top row first.
+	void getRadiance( float *rgb ) const;
+
+	// Stop the render in progress, from any thread.
+	void cancel() { tracer.cancel(); }
+
+	// For anything else, like animation frames or relighting.
+	RayTracer& getTracer() { return tracer; }
+
+private:
+	RayTracer tracer;
+
+	Renderer( const Renderer& );
+	Renderer& operator =( const Renderer& );
+};
+
+#endif // __RENDERER_H__
@@ -33,12 +33,22 @@ bool Box::intersectLocal( const ray& r, isect& i ) const {
 
 	vec3f isectP = r.at(i.t);
 	for (int j = 0; j < 3; j++) {
+		bool hit = false;
 		if (abs(isectP[j] - (-size)) < RAY_EPSILON) {
 			i.N = vec3f(-(float)(j == 0), -(float)(j == 1), -(float)(j == 2));
-			return true;
+			hit = true;
 		}
 		else if (abs(isectP[j] - size) < RAY_EPSILON) {
 			i.N = vec3f((float)(j == 0), (float)(j == 1), (float)(j == 2));
+			hit = true;
+		}
+		if (hit) {
+			// each face is mapped along the two other axes
+			int a = (j + 1) % 3, b = (j + 2) % 3;
+			vec3f dPdu, dPdv;
+			dPdu[a] = 1.0;
+			dPdv[b] = 1.0;
+			i.setUV(isectP[a] + size, isectP[b] + size, dPdu, dPdv);
 			return true;
 		}
 	}
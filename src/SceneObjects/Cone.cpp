@@ -3,6 +3,29 @@
 
 #include "Cone.h"
 
+#define PI 3.14159265358979323846
+
+// u runs around the axis, v from the base to the top; the caps are mapped
+// from above, scaled by the wider end.
+static void setBodyUV( const vec3f& P, double height, double b_radius, double t_radius, isect& i )
+{
+	double phi = atan2( P[1], P[0] );
+	if( phi < 0.0 )
+		phi += 2.0 * PI;
+	double dr = t_radius - b_radius;
+	// the normal turns with u and is constant along a line from base to top
+	i.setUV( phi / (2.0 * PI), P[2] / height,
+		vec3f( -2.0 * PI * P[1], 2.0 * PI * P[0], 0.0 ),
+		vec3f( dr * cos( phi ), dr * sin( phi ), height ),
+		vec3f( -2.0 * PI * i.N[1], 2.0 * PI * i.N[0], 0.0 ) );
+}
+
+static void setCapUV( const vec3f& P, double radius, isect& i )
+{
+	double s = 0.5 / radius;
+	i.setUV( s * P[0] + 0.5, s * P[1] + 0.5, vec3f( 2.0 * radius, 0.0, 0.0 ), vec3f( 0.0, 2.0 * radius, 0.0 ) );
+}
+
 bool Cone::intersectLocal( const ray& r, isect& i ) const
 {
 	i.obj = this;
@@ -55,8 +78,7 @@ bool Cone::intersectBody( const ray& r, isect& i ) const
 			i.t = t1;
             i.N = vec3f( P[0], P[1], 
               -(C*P[2]+(t_radius-b_radius)*t_radius/height)).normalize();
-				
-			
+			setBodyUV( P, height, b_radius, t_radius, i );
 			return true;
 		}
 	}
@@ -74,6 +96,7 @@ bool Cone::intersectBody( const ray& r, isect& i ) const
 		if( !capped && (i.N).dot( r.getDirection() ) > 0 )
 				i.N = -i.N;
 
+        setBodyUV( P, height, b_radius, t_radius, i );
         return true;
 	}
 
@@ -124,6 +147,7 @@ bool Cone::intersectCaps( const ray& r, isect& i ) const
 			} else {
 				i.N = vec3f( 0.0, 0.0, 1.0 );
 			}
+			setCapUV( p, b_radius > t_radius ? b_radius : t_radius, i );
 			return true;
 		}
 	}
@@ -137,6 +161,7 @@ bool Cone::intersectCaps( const ray& r, isect& i ) const
 		} else {
 			i.N = vec3f( 0.0, 0.0, -1.0 );
 		}
+		setCapUV( p, b_radius > t_radius ? b_radius : t_radius, i );
 		return true;
 	}
 
@@ -36,6 +36,12 @@ public:
 	bool intersectBody( const ray& r, isect& i ) const;
 	bool intersectCaps( const ray& r, isect& i ) const;
 
+	virtual bool sameShape( const Geometry& other ) const
+	{
+		const Cone& c = static_cast<const Cone&>( other );
+		return height == c.height && b_radius == c.b_radius
+			&& t_radius == c.t_radius && capped == c.capped;
+	}
 
 protected:
 	void computeABC()
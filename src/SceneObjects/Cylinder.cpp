@@ -2,6 +2,25 @@
 
 #include "Cylinder.h"
 
+#define PI 3.14159265358979323846
+
+// u runs around the axis, v along it; the caps are mapped from above.
+static void setBodyUV( const vec3f& P, isect& i )
+{
+	double phi = atan2( P[1], P[0] );
+	if( phi < 0.0 )
+		phi += 2.0 * PI;
+	// the normal turns with u and stays put along v
+	i.setUV( phi / (2.0 * PI), P[2],
+		vec3f( -2.0 * PI * P[1], 2.0 * PI * P[0], 0.0 ), vec3f( 0.0, 0.0, 1.0 ),
+		vec3f( -2.0 * PI * i.N[1], 2.0 * PI * i.N[0], 0.0 ) );
+}
+
+static void setCapUV( const vec3f& P, isect& i )
+{
+	i.setUV( 0.5 * P[0] + 0.5, 0.5 * P[1] + 0.5, vec3f( 2.0, 0.0, 0.0 ), vec3f( 0.0, 2.0, 0.0 ) );
+}
+
 bool Cylinder::intersectLocal( const ray& r, isect& i ) const
 {
 	i.obj = this;
@@ -62,6 +81,7 @@ bool Cylinder::intersectBody( const ray& r, isect& i ) const
 			// It's okay.
 			i.t = t1;
 			i.N = vec3f( P[0], P[1], 0.0 ).normalize();
+			setBodyUV( P, i );
 			return true;
 		}
 	}
@@ -79,6 +99,7 @@ bool Cylinder::intersectBody( const ray& r, isect& i ) const
 			normal = -normal;
 
 		i.N = normal.normalize();
+		setBodyUV( P, i );
 		return true;
 	}
 
@@ -123,6 +144,7 @@ bool Cylinder::intersectCaps( const ray& r, isect& i ) const
 			} else {
 				i.N = vec3f( 0.0, 0.0, 1.0 );
 			}
+			setCapUV( p, i );
 			return true;
 		}
 	}
@@ -136,6 +158,7 @@ bool Cylinder::intersectCaps( const ray& r, isect& i ) const
 		} else {
 			i.N = vec3f( 0.0, 0.0, -1.0 );
 		}
+		setCapUV( p, i );
 		return true;
 	}
 
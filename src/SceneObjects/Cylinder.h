@@ -26,6 +26,9 @@ public:
     bool intersectBody( const ray& r, isect& i ) const;
 	bool intersectCaps( const ray& r, isect& i ) const;
 
+	virtual bool sameShape( const Geometry& other ) const
+	{ return capped == static_cast<const Cylinder&>( other ).capped; }
+
 protected:
 	bool capped;
 };
@@ -2,6 +2,8 @@
 
 #include "Sphere.h"
 
+#define PI 3.14159265358979323846
+
 bool Sphere::intersectLocal( const ray& r, isect& i ) const
 {
 	vec3f v = -r.getPosition();
@@ -31,6 +33,20 @@ bool Sphere::intersectLocal( const ray& r, isect& i ) const
 		i.N = r.at( t2 ).normalize();
 	}
 
+	// longitude around z, latitude from the -z pole up
+	const vec3f& P = i.N;
+	double phi = atan2( P[1], P[0] );
+	if( phi < 0.0 )
+		phi += 2.0 * PI;
+	double rxy = sqrt( P[0]*P[0] + P[1]*P[1] );
+	double cosPhi = rxy > 0.0 ? P[0] / rxy : 1.0;
+	double sinPhi = rxy > 0.0 ? P[1] / rxy : 0.0;
+	vec3f dPdu( -2.0 * PI * P[1], 2.0 * PI * P[0], 0.0 );
+	vec3f dPdv( -PI * P[2] * cosPhi, -PI * P[2] * sinPhi, PI * rxy );
+	// on the unit sphere the normal is the position
+	i.setUV( phi / (2.0 * PI), 1.0 - acos( P[2] < -1.0 ? -1.0 : (P[2] > 1.0 ? 1.0 : P[2]) ) / PI,
+		dPdu, dPdv, dPdu, dPdv );
+
 	return true;
 }
 
@@ -34,6 +34,7 @@ bool Square::intersectLocal( const ray& r, isect& i ) const
 	} else {
 		i.N = vec3f( 0.0, 0.0, 1.0 );
 	}
+	i.setUV( P[0] + 0.5, P[1] + 0.5, vec3f( 1.0, 0.0, 0.0 ), vec3f( 0.0, 1.0, 0.0 ) );
 
 	return true;
 }
@@ -26,6 +26,11 @@ void Trimesh::addNormal( const vec3f &n )
     normals.push_back( n );
 }
 
+void Trimesh::addTexCoord( double u, double v )
+{
+    texcoords.push_back( vec3f( u, v, 0.0 ) );
+}
+
 // Returns false if the vertices a,b,c don't all exist
 bool Trimesh::addFace( int a, int b, int c )
 {
@@ -41,6 +46,21 @@ bool Trimesh::addFace( int a, int b, int c )
     return true;
 }
 
+bool Trimesh::sameShape( const Geometry& other ) const
+{
+    const Trimesh& m = static_cast<const Trimesh&>( other );
+    if( !materials.empty() || !m.materials.empty() )
+        return false;
+    if( vertices != m.vertices || normals != m.normals || texcoords != m.texcoords
+        || faces.size() != m.faces.size() )
+        return false;
+
+    for( size_t k = 0; k < faces.size(); ++k )
+        if( !faces[k]->sameShape( *m.faces[k] ) )
+            return false;
+    return true;
+}
+
 char *
 Trimesh::doubleCheck()
 // Check to make sure that if we have per-vertex materials or normals
@@ -50,6 +70,8 @@ Trimesh::doubleCheck()
         return "Bad Trimesh: Wrong number of materials.";
     if( normals.size() && normals.size() != vertices.size() )
         return "Bad Trimesh: Wrong number of normals.";
+    if( texcoords.size() && texcoords.size() != vertices.size() )
+        return "Bad Trimesh: Wrong number of texture coordinates.";
 
     return 0;
 }
@@ -130,6 +152,36 @@ bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
     }
     i.obj = this;
 
+    // texture coordinates: interpolated if given, else the barycentric
+    // coordinates themselves.  Interpolated normals also change across
+    // the face, which bends ray differentials like a curved surface would.
+    vec3f nb, nc;
+    if( parent->normals.size() )
+    {
+        nb = parent->normals[ids[1]] - parent->normals[ids[0]];
+        nc = parent->normals[ids[2]] - parent->normals[ids[0]];
+    }
+
+    if( parent->texcoords.size() )
+    {
+        const vec3f& ta = parent->texcoords[ids[0]];
+        const vec3f& tb = parent->texcoords[ids[1]];
+        const vec3f& tc = parent->texcoords[ids[2]];
+        vec3f uv = bary[0] * ta + bary[1] * tb + bary[2] * tc;
+
+        // solve ab = du1 * dPdu + dv1 * dPdv, ac = du2 * dPdu + dv2 * dPdv
+        double du1 = tb[0] - ta[0], dv1 = tb[1] - ta[1];
+        double du2 = tc[0] - ta[0], dv2 = tc[1] - ta[1];
+        double det = du1 * dv2 - du2 * dv1;
+        if( det != 0.0 )
+            i.setUV( uv[0], uv[1], (dv2 * ab - dv1 * ac) / det, (du1 * ac - du2 * ab) / det,
+                     (dv2 * nb - dv1 * nc) / det, (du1 * nc - du2 * nb) / det );
+        else
+            i.setUV( uv[0], uv[1], ab, ac, nb, nc );
+    } else {
+        i.setUV( bary[1], bary[2], ab, ac, nb, nc );
+    }
+
     // linearly interpolate materials
     if( parent->materials.size() )
     {
@@ -16,10 +16,12 @@ class Trimesh : public MaterialSceneObject
     typedef vector<vec3f> Vertices;
     typedef vector<TrimeshFace*> Faces;
     typedef vector<Material*> Materials;
+    typedef vector<vec3f> TexCoords;
     Vertices vertices;
     Faces faces;
     Normals normals;
     Materials materials;
+    TexCoords texcoords;        // (u,v,unused) per vertex, optional
 public:
     Trimesh( Scene *scene, Material *mat, TransformNode *transform )
         : MaterialSceneObject(scene, mat)
@@ -33,12 +35,17 @@ public:
     void addVertex( const vec3f & );
     void addMaterial( Material *m );
     void addNormal( const vec3f & );
+    void addTexCoord( double u, double v );
 
     bool addFace( int a, int b, int c );
 
     char *doubleCheck();
     
     void generateNormals();
+
+    // Same vertices, normals, texture coordinates and faces.  Meshes with
+    // per-vertex materials never compare equal.
+    virtual bool sameShape( const Geometry& other ) const;
 };
 
 class TrimeshFace : public MaterialSceneObject
@@ -63,6 +70,13 @@ public:
     virtual bool intersectLocal( const ray& r, isect& i ) const;
 
     virtual bool hasBoundingBoxCapability() const { return true; }
+
+    virtual const Geometry *shapeOwner() const { return parent; }
+    virtual bool sameShape( const Geometry& other ) const
+    {
+        const TrimeshFace& f = static_cast<const TrimeshFace&>( other );
+        return ids[0] == f.ids[0] && ids[1] == f.ids[1] && ids[2] == f.ids[2];
+    }
       
     virtual BoundingBox ComputeLocalBoundingBox()
     {
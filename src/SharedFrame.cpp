@@ -0,0 +1,175 @@
+#include <string.h>
+#include <errno.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "SharedFrame.h"
+
+// The words are the machine's own; every platform this builds on is
+// little endian.
+struct SharedFrame::Header
+{
+	char magic[8];
+	unsigned int tableOffset;
+	unsigned int pixelOffset;
+	unsigned int width, height;
+	unsigned int tileSize, tilesAcross, tilesDown;
+	unsigned int generation;
+	std::atomic<unsigned int> state;
+	std::atomic<unsigned int> sequence;
+	unsigned int reserved[4];
+};
+
+struct SharedFrame::Tile
+{
+	std::atomic<unsigned int> place;
+	unsigned int x0, y0, x1, y1;
+	unsigned int reserved[3];
+};
+
+static const char MAGIC[8] = { 'R', 'A', 'Y', 'F', 'B', '0', '0', '2' };
+
+static_assert( sizeof(std::atomic<unsigned int>) == 4, "atomic words must be plain words" );
+
+SharedFrame::SharedFrame()
+	: base( NULL ), size( 0 ), pixelOffset( 0 ), header( NULL ), tiles( NULL ), tileCount( 0 ),
+	finished( 0 )
+{
+}
+
+SharedFrame::~SharedFrame()
+{
+	close();
+}
+
+bool SharedFrame::isSharedName( const char *name )
+{
+	size_t n = strlen( name );
+	return strncmp( name, "shm:", 4 ) == 0 || (n > 3 && strcmp( name + n - 3, ".fb" ) == 0);
+}
+
+#ifndef WIN32
+
+bool SharedFrame::open( const char *name, int width, int height, std::string& error )
+{
+	close();
+
+	static_assert( sizeof(Tile) == 32, "a tile entry is 8 words" );
+
+	int tileSize = RayTracer::TILE_SIZE;
+	int across = (width + tileSize - 1) / tileSize, down = (height + tileSize - 1) / tileSize;
+	size_t table = sizeof(Header);
+	// pixels start on a cache line
+	size_t pixels = (table + (size_t)across * down * sizeof(Tile) + 63) & ~(size_t)63;
+	size_t bytes = pixels + (size_t)width * height * 3;
+
+	int fd;
+	if( strncmp( name, "shm:", 4 ) == 0 )
+		fd = shm_open( (std::string( "/" ) + (name + 4)).c_str(), O_RDWR | O_CREAT, 0644 );
+	else
+		fd = ::open( name, O_RDWR | O_CREAT, 0644 );
+	if( fd < 0 ) {
+		error = std::string( "couldn't open " ) + name + ": " + strerror( errno );
+		return false;
+	}
+
+	// a segment of the same size is reused, so a consumer can keep it
+	// mapped from one generation to the next
+	struct stat st;
+	bool same = fstat( fd, &st ) == 0 && (size_t)st.st_size == bytes;
+	if( !same && ftruncate( fd, (off_t)bytes ) != 0 ) {
+		error = std::string( "couldn't size " ) + name + ": " + strerror( errno );
+		::close( fd );
+		return false;
+	}
+	void *mem = mmap( NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	::close( fd );
+	if( mem == MAP_FAILED ) {
+		error = std::string( "couldn't map " ) + name + ": " + strerror( errno );
+		return false;
+	}
+
+	base = (unsigned char *)mem;
+	size = bytes;
+	pixelOffset = pixels;
+	header = (Header *)base;
+	tiles = (Tile *)(base + table);
+	tileCount = across * down;
+	finished = 0;
+
+	unsigned int generation = same && memcmp( header->magic, MAGIC, 8 ) == 0 ? header->generation + 1 : 1;
+
+	// anyone watching sees the state change before the table is cleared
+	header->state.store( RENDERING, std::memory_order_release );
+	header->sequence.store( 0, std::memory_order_release );
+	for( int t = 0; t < tileCount; ++t ) {
+		tiles[t].place.store( 0, std::memory_order_relaxed );
+		tiles[t].x0 = tiles[t].y0 = tiles[t].x1 = tiles[t].y1 = 0;
+		memset( tiles[t].reserved, 0, sizeof(tiles[t].reserved) );
+	}
+	memset( base + pixels, 0, bytes - pixels );
+
+	memcpy( header->magic, MAGIC, 8 );
+	header->tableOffset = (unsigned int)table;
+	header->pixelOffset = (unsigned int)pixels;
+	header->width = width;
+	header->height = height;
+	header->tileSize = tileSize;
+	header->tilesAcross = across;
+	header->tilesDown = down;
+	memset( header->reserved, 0, sizeof(header->reserved) );
+	std::atomic_thread_fence( std::memory_order_release );
+	header->generation = generation;
+	return true;
+}
+
+void SharedFrame::close()
+{
+	if( base )
+		munmap( base, size );
+	base = NULL;
+	header = NULL;
+	tiles = NULL;
+	size = 0;
+	tileCount = 0;
+}
+
+#else
+
+bool SharedFrame::open( const char *name, int width, int height, std::string& error )
+{
+	error = "shared memory output needs POSIX shm_open and mmap";
+	return false;
+}
+
+void SharedFrame::close()
+{
+}
+
+#endif // WIN32
+
+void SharedFrame::tileFinished( int tile, int x0, int y0, int x1, int y1 )
+{
+	if( !header || tile < 0 || tile >= tileCount )
+		return;
+	Tile& e = tiles[tile];
+	e.x0 = x0;
+	e.y0 = y0;
+	e.x1 = x1;
+	e.y1 = y1;
+	// the place goes in before sequence moves, so a consumer that sees
+	// sequence at n finds at least n tiles
+	e.place.store( ++finished, std::memory_order_release );
+	header->sequence.fetch_add( 1, std::memory_order_release );
+}
+
+void SharedFrame::finish( bool complete )
+{
+	if( header )
+		header->state.store( complete ? DONE : STOPPED, std::memory_order_release );
+}
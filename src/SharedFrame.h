@@ -0,0 +1,93 @@
+#ifndef __SHAREDFRAME_H__
+#define __SHAREDFRAME_H__
+
+// An image in memory another process can map, for a compositor that takes
+// tiles as soon as they are finished instead of waiting for a file and
+// decoding it.  The ray tracer quantizes straight into it (see
+// RayTracer::setBufferMemory()), so nothing is copied or encoded.
+//
+// The name is either "shm:<name>", a POSIX shared memory object
+// ("/<name>" to shm_open), or a file ending in .fb, which is mapped.
+// Both stay when the render is done; removing them is up to the consumer.
+// The layout, in 32-bit little endian words:
+//
+//     0   "RAYFB002"
+//     8   offset of the tile table (64)
+//     12  offset of the pixels
+//     16  width, height
+//     24  tile size, tiles across, tiles down
+//     36  generation		one more for every render into the same name
+//     40  state			0 rendering, 1 done, 2 stopped short
+//     44  sequence			tiles finished so far
+//     48  (reserved)
+//     64  tile table		8 words per tile, in the renderer's tile order
+//         pixels			8-bit RGB, width * 3 bytes a row, bottom row first
+//
+// A tile's entry is
+//
+//     0   place			0 until the tile is finished, then its place in
+//							the order tiles finished, from 1
+//     4   x0, y0, x1, y1	the pixels it covers: columns x0 to x1 - 1 and
+//							rows y0 to y1 - 1, counted from the bottom as the
+//							pixels are stored
+//     20  (reserved)
+//
+// The renderer numbers tiles row by row over the crop window, from its top
+// left, but the grid is anchored at the window's bottom left, so tiles in
+// the top row and right column can be partial and the table can have
+// unused entries after the last tile; take the rect from the entry rather
+// than working it out from the tile number.  The rect is written before
+// the place, and the place before sequence moves.  A consumer polls
+// sequence and, when it moves, takes the tiles with a place it hasn't seen
+// yet.  Places, sequence and state are written with release semantics
+// after the pixels they cover, so read them with an atomic acquire load
+// before the rect and pixels.  A new generation starts with the table
+// cleared and a black image.
+
+#include <stddef.h>
+#include <atomic>
+#include <string>
+
+#include "RayTracer.h"
+
+class SharedFrame : public RayTracer::TileListener
+{
+public:
+	enum State { RENDERING = 0, DONE = 1, STOPPED = 2 };
+
+	SharedFrame();
+	~SharedFrame();
+
+	// Whether an output name means shared memory rather than a file
+	// format.
+	static bool isSharedName( const char *name );
+
+	// Make or reuse the segment for a width x height image and start a new
+	// generation in it.
+	bool open( const char *name, int width, int height, std::string& error );
+	void close();
+
+	unsigned char *pixels() const { return base ? base + pixelOffset : NULL; }
+
+	virtual void tileFinished( int tile, int x0, int y0, int x1, int y1 );
+
+	// Mark the generation done, or stopped with tiles missing.
+	void finish( bool complete );
+
+private:
+	struct Header;
+	struct Tile;
+
+	unsigned char *base;
+	size_t size;
+	size_t pixelOffset;
+	Header *header;
+	Tile *tiles;
+	int tileCount;
+	std::atomic<unsigned int> finished;		// the last tile's place in the order
+
+	SharedFrame( const SharedFrame& );
+	SharedFrame& operator =( const SharedFrame& );
+};
+
+#endif // __SHAREDFRAME_H__
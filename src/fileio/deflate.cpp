@@ -0,0 +1,195 @@
+//
+// deflate.cpp
+//
+// See deflate.h.  Matches are found with a hash of the next three bytes and
+// a chain of earlier positions with the same hash, limited to MAX_CHAIN
+// probes.  Each write() call becomes one fixed Huffman block.
+//
+
+#include <string.h>
+
+#include "deflate.h"
+
+// length codes 257..285: base length and number of extra bits
+static const int lengthBase[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const int lengthExtra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+// distance codes 0..29
+static const int distBase[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const int distExtra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+Deflater::Deflater()
+	: histStart( 0 ), head( 1 << HASH_BITS, -1 ), prev( WINDOW, -1 ),
+	  bitBuffer( 0 ), bitCount( 0 ), headerDone( false ), adlerA( 1 ), adlerB( 0 )
+{
+}
+
+unsigned int Deflater::hash( const unsigned char *p )
+{
+	unsigned int h = (p[0] << 16) | (p[1] << 8) | p[2];
+	return (h * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// deflate packs bits starting with the least significant one
+void Deflater::putBits( unsigned int bits, int n, std::vector<unsigned char>& out )
+{
+	bitBuffer |= bits << bitCount;
+	bitCount += n;
+	while( bitCount >= 8 ) {
+		out.push_back( (unsigned char)bitBuffer );
+		bitBuffer >>= 8;
+		bitCount -= 8;
+	}
+}
+
+// ...but Huffman codes are defined most significant bit first
+void Deflater::putHuffman( unsigned int code, int n, std::vector<unsigned char>& out )
+{
+	unsigned int rev = 0;
+	for( int k = 0; k < n; ++k ) {
+		rev = (rev << 1) | (code & 1);
+		code >>= 1;
+	}
+	putBits( rev, n, out );
+}
+
+void Deflater::putLiteral( int lit, std::vector<unsigned char>& out )
+{
+	if( lit < 144 )
+		putHuffman( 0x30 + lit, 8, out );
+	else if( lit < 256 )
+		putHuffman( 0x190 + lit - 144, 9, out );
+	else if( lit < 280 )
+		putHuffman( lit - 256, 7, out );
+	else
+		putHuffman( 0xc0 + lit - 280, 8, out );
+}
+
+void Deflater::putMatch( int length, int distance, std::vector<unsigned char>& out )
+{
+	int lc = 28;
+	while( lengthBase[lc] > length )
+		--lc;
+	putLiteral( 257 + lc, out );
+	putBits( length - lengthBase[lc], lengthExtra[lc], out );
+
+	int dc = 29;
+	while( distBase[dc] > distance )
+		--dc;
+	putHuffman( dc, 5, out );
+	putBits( distance - distBase[dc], distExtra[dc], out );
+}
+
+void Deflater::write( const unsigned char *data, int len, std::vector<unsigned char>& out )
+{
+	if( !headerDone ) {
+		out.push_back( 0x78 );		// deflate, 32K window
+		out.push_back( 0x01 );		// fastest, check bits
+		headerDone = true;
+	}
+	if( len <= 0 )
+		return;
+
+	// checksum of the uncompressed data, reduced often enough not to overflow
+	for( int k = 0; k < len; ) {
+		int n = len - k < 5552 ? len - k : 5552;
+		for( int e = k + n; k < e; ++k ) {
+			adlerA += data[k];
+			adlerB += adlerA;
+		}
+		adlerA %= 65521;
+		adlerB %= 65521;
+	}
+
+	// keep only one window of history in front of the new data
+	if( (int)hist.size() > WINDOW ) {
+		int drop = (int)hist.size() - WINDOW;
+		hist.erase( hist.begin(), hist.begin() + drop );
+		histStart += drop;
+	}
+	int begin = (int)hist.size();
+	hist.insert( hist.end(), data, data + len );
+	int end = (int)hist.size();
+	const unsigned char *h = &hist[0];
+
+	putBits( 0, 1, out );			// not the final block
+	putBits( 1, 2, out );			// fixed Huffman codes
+
+	int pos = begin;
+	while( pos < end ) {
+		int bestLen = 0;
+		int bestDist = 0;
+
+		if( pos + MIN_MATCH <= end ) {
+			unsigned int hv = hash( h + pos );
+			long long cand = head[hv];
+			long long abs = histStart + pos;
+			int maxLen = end - pos < MAX_MATCH ? end - pos : MAX_MATCH;
+
+			for( int chain = 0; chain < MAX_CHAIN && cand >= histStart && abs - cand <= WINDOW; ++chain ) {
+				const unsigned char *a = h + (cand - histStart);
+				const unsigned char *b = h + pos;
+				if( a[bestLen] == b[bestLen] ) {
+					int l = 0;
+					while( l < maxLen && a[l] == b[l] )
+						++l;
+					if( l > bestLen ) {
+						bestLen = l;
+						bestDist = (int)(abs - cand);
+						if( l == maxLen )
+							break;
+					}
+				}
+				cand = prev[cand % WINDOW];
+			}
+
+			prev[abs % WINDOW] = head[hv];
+			head[hv] = abs;
+		}
+
+		if( bestLen >= MIN_MATCH ) {
+			putMatch( bestLen, bestDist, out );
+			// index the strings inside the match too
+			for( int k = 1; k < bestLen; ++k ) {
+				int p = pos + k;
+				if( p + MIN_MATCH > end )
+					break;
+				unsigned int hv = hash( h + p );
+				long long abs = histStart + p;
+				prev[abs % WINDOW] = head[hv];
+				head[hv] = abs;
+			}
+			pos += bestLen;
+		} else {
+			putLiteral( h[pos], out );
+			++pos;
+		}
+	}
+
+	putLiteral( 256, out );			// end of block
+}
+
+void Deflater::finish( std::vector<unsigned char>& out )
+{
+	write( NULL, 0, out );			// makes sure the header is out
+
+	putBits( 1, 1, out );			// final block
+	putBits( 1, 2, out );			// fixed Huffman codes
+	putLiteral( 256, out );			// ...which is empty
+	if( bitCount > 0 )
+		putBits( 0, 8 - bitCount, out );
+
+	unsigned int adler = (adlerB << 16) | adlerA;
+	out.push_back( (unsigned char)(adler >> 24) );
+	out.push_back( (unsigned char)(adler >> 16) );
+	out.push_back( (unsigned char)(adler >> 8) );
+	out.push_back( (unsigned char)adler );
+}
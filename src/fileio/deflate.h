@@ -0,0 +1,51 @@
+//
+// deflate.h
+//
+// A small streaming zlib (RFC 1950/1951) compressor, so PNG output doesn't
+// need an external library.  It uses LZ77 with hash chains and the fixed
+// Huffman code, which is most of the gain on rendered images at a fraction
+// of the complexity of dynamic codes.
+//
+
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <vector>
+
+class Deflater
+{
+public:
+	Deflater();
+
+	// Compress len more bytes.  Output is appended to out as it becomes
+	// available; some bits may be held back until the next call.
+	void write( const unsigned char *data, int len, std::vector<unsigned char>& out );
+
+	// End the stream: final block, padding and the adler32 checksum.
+	void finish( std::vector<unsigned char>& out );
+
+private:
+	enum { WINDOW = 32768, HASH_BITS = 15, MAX_CHAIN = 16, MIN_MATCH = 3, MAX_MATCH = 258 };
+
+	void putBits( unsigned int bits, int n, std::vector<unsigned char>& out );
+	void putHuffman( unsigned int code, int n, std::vector<unsigned char>& out );
+	void putLiteral( int lit, std::vector<unsigned char>& out );
+	void putMatch( int length, int distance, std::vector<unsigned char>& out );
+
+	static unsigned int hash( const unsigned char *p );
+
+	// history: the last WINDOW bytes followed by the data being compressed.
+	// histStart is the stream position of hist[0].
+	std::vector<unsigned char> hist;
+	long long histStart;
+
+	std::vector<long long> head;	// stream position of the last string with each hash
+	std::vector<long long> prev;	// previous position with the same hash, by pos % WINDOW
+
+	unsigned int bitBuffer;
+	int bitCount;
+	bool headerDone;
+	unsigned int adlerA, adlerB;
+};
+
+#endif
@@ -0,0 +1,309 @@
+//
+// hdrimage.cpp
+//
+// PFM and OpenEXR output, PFM and Radiance input.  Only what is needed to
+// write a plain RGB image is implemented: PFM is trivial, and an EXR file
+// with NO_COMPRESSION is a small header, a table of scanline offsets and
+// the raw half floats.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "hdrimage.h"
+
+bool writePFM(char *iname, int width, int height, const float *data)
+{
+	FILE *fp = fopen(iname, "wb");
+	if (!fp)
+		return false;
+
+	// a negative scale means little endian; rows go bottom to top, which
+	// is already how data is stored
+	fprintf(fp, "PF\n%d %d\n-1.0\n", width, height);
+
+	bool ok = true;
+	for (int j = 0; j < height && ok; ++j) {
+		const float *row = data + j * width * 3;
+		for (int k = 0; k < width * 3 && ok; ++k) {
+			unsigned int bits;
+			memcpy(&bits, &row[k], 4);
+			unsigned char b[4] = { (unsigned char)bits, (unsigned char)(bits >> 8),
+				(unsigned char)(bits >> 16), (unsigned char)(bits >> 24) };
+			ok = fwrite(b, 4, 1, fp) == 1;
+		}
+	}
+
+	fclose(fp);
+	return ok;
+}
+
+unsigned short floatToHalf(float f)
+{
+	unsigned int x;
+	memcpy(&x, &f, 4);
+
+	unsigned int sign = (x >> 16) & 0x8000;
+	int exponent = (int)((x >> 23) & 0xff) - 127 + 15;
+	unsigned int mantissa = x & 0x7fffff;
+
+	if (((x >> 23) & 0xff) == 0xff)					// inf or nan
+		return (unsigned short)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+	if (exponent >= 31)								// too big, inf
+		return (unsigned short)(sign | 0x7c00);
+	if (exponent <= 0) {							// denormal or zero
+		if (exponent < -10)
+			return (unsigned short)sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		unsigned int half = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1)			// round
+			++half;
+		return (unsigned short)(sign | half);
+	}
+
+	unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000)							// round, may carry into the exponent
+		++half;
+	return (unsigned short)half;
+}
+
+// little endian helpers for the EXR header
+static void put32(FILE *fp, unsigned int v)
+{
+	unsigned char b[4] = { (unsigned char)v, (unsigned char)(v >> 8),
+		(unsigned char)(v >> 16), (unsigned char)(v >> 24) };
+	fwrite(b, 4, 1, fp);
+}
+
+static void put64(FILE *fp, unsigned long long v)
+{
+	put32(fp, (unsigned int)(v & 0xffffffff));
+	put32(fp, (unsigned int)(v >> 32));
+}
+
+static void putFloat(FILE *fp, float f)
+{
+	unsigned int bits;
+	memcpy(&bits, &f, 4);
+	put32(fp, bits);
+}
+
+static void putAttribute(FILE *fp, const char *name, const char *type, unsigned int size)
+{
+	fwrite(name, strlen(name) + 1, 1, fp);
+	fwrite(type, strlen(type) + 1, 1, fp);
+	put32(fp, size);
+}
+
+bool writeEXR(char *iname, int width, int height, const float *data)
+{
+	FILE *fp = fopen(iname, "wb");
+	if (!fp)
+		return false;
+
+	put32(fp, 20000630);			// magic
+	put32(fp, 2);					// version 2, scanline file
+
+	// channels, which must be sorted by name: B, G, R, all HALF (1)
+	const char *channels[3] = { "B", "G", "R" };
+	putAttribute(fp, "channels", "chlist", 3 * 18 + 1);
+	for (int c = 0; c < 3; ++c) {
+		fwrite(channels[c], 2, 1, fp);
+		put32(fp, 1);				// pixel type
+		put32(fp, 0);				// pLinear + reserved
+		put32(fp, 1);				// xSampling
+		put32(fp, 1);				// ySampling
+	}
+	fputc(0, fp);
+
+	putAttribute(fp, "compression", "compression", 1);
+	fputc(0, fp);					// NO_COMPRESSION
+
+	putAttribute(fp, "dataWindow", "box2i", 16);
+	put32(fp, 0); put32(fp, 0); put32(fp, width - 1); put32(fp, height - 1);
+
+	putAttribute(fp, "displayWindow", "box2i", 16);
+	put32(fp, 0); put32(fp, 0); put32(fp, width - 1); put32(fp, height - 1);
+
+	putAttribute(fp, "lineOrder", "lineOrder", 1);
+	fputc(0, fp);					// INCREASING_Y
+
+	putAttribute(fp, "pixelAspectRatio", "float", 4);
+	putFloat(fp, 1.0f);
+
+	putAttribute(fp, "screenWindowCenter", "v2f", 8);
+	putFloat(fp, 0.0f); putFloat(fp, 0.0f);
+
+	putAttribute(fp, "screenWindowWidth", "float", 4);
+	putFloat(fp, 1.0f);
+
+	fputc(0, fp);					// end of header
+
+	// one scanline per block: y, byte count, then each channel's halfs
+	unsigned int blockBytes = width * 3 * 2;
+	unsigned long long offset = (unsigned long long)ftell(fp) + 8ULL * height;
+	for (int y = 0; y < height; ++y) {
+		put64(fp, offset);
+		offset += 8 + blockBytes;
+	}
+
+	unsigned short *line = new unsigned short[width * 3];
+	bool ok = true;
+	for (int y = 0; y < height && ok; ++y) {
+		// EXR's first line is the top of the image
+		const float *row = data + (height - 1 - y) * width * 3;
+		for (int c = 0; c < 3; ++c) {
+			int src = 2 - c;		// B, G, R from R, G, B
+			for (int i = 0; i < width; ++i)
+				line[c * width + i] = floatToHalf(row[i * 3 + src]);
+		}
+
+		put32(fp, y);
+		put32(fp, blockBytes);
+		for (int k = 0; k < width * 3; ++k) {
+			unsigned char b[2] = { (unsigned char)line[k], (unsigned char)(line[k] >> 8) };
+			fwrite(b, 2, 1, fp);
+		}
+		ok = !ferror(fp);
+	}
+
+	delete [] line;
+	fclose(fp);
+	return ok;
+}
+
+float *readPFM(char *iname, int& width, int& height)
+{
+	FILE *fp = fopen(iname, "rb");
+	if (!fp)
+		return NULL;
+
+	char kind[3] = { 0, 0, 0 };
+	double scale;
+	if (fscanf(fp, "%2s %d %d %lf", kind, &width, &height, &scale) != 4
+		|| kind[0] != 'P' || (kind[1] != 'F' && kind[1] != 'f')
+		|| width <= 0 || height <= 0) {
+		fclose(fp);
+		return NULL;
+	}
+	fgetc(fp);						// the single whitespace before the data
+
+	int channels = kind[1] == 'F' ? 3 : 1;
+	bool bigEndian = scale > 0.0;
+
+	float *data = new float[width * height * 3];
+	unsigned char *row = new unsigned char[width * channels * 4];
+	bool ok = true;
+	for (int j = 0; j < height && ok; ++j) {
+		ok = fread(row, width * channels * 4, 1, fp) == 1;
+		for (int i = 0; i < width && ok; ++i) {
+			for (int c = 0; c < 3; ++c) {
+				const unsigned char *b = row + (i * channels + (channels == 3 ? c : 0)) * 4;
+				unsigned int bits = bigEndian
+					? ((unsigned int)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3]
+					: ((unsigned int)b[3] << 24) | (b[2] << 16) | (b[1] << 8) | b[0];
+				memcpy(&data[(j * width + i) * 3 + c], &bits, 4);
+			}
+		}
+	}
+
+	delete [] row;
+	fclose(fp);
+	if (!ok) {
+		delete [] data;
+		return NULL;
+	}
+	return data;
+}
+
+// One RGBE scanline into rgbe[width * 4], either new style run length
+// encoded (each component separately) or flat.
+static bool readRGBELine(FILE *fp, int width, unsigned char *rgbe)
+{
+	unsigned char head[4];
+	if (fread(head, 4, 1, fp) != 1)
+		return false;
+
+	if (width < 8 || width > 0x7fff || head[0] != 2 || head[1] != 2 || (head[2] & 0x80)) {
+		memcpy(rgbe, head, 4);
+		return width == 1 || fread(rgbe + 4, (width - 1) * 4, 1, fp) == 1;
+	}
+	if (((head[2] << 8) | head[3]) != width)
+		return false;
+
+	for (int c = 0; c < 4; ++c) {
+		int i = 0;
+		while (i < width) {
+			int count = fgetc(fp);
+			if (count == EOF)
+				return false;
+			if (count > 128) {				// a run of one value
+				count -= 128;
+				int value = fgetc(fp);
+				if (value == EOF || i + count > width)
+					return false;
+				while (count--)
+					rgbe[(i++) * 4 + c] = (unsigned char)value;
+			} else {						// count literal values
+				if (count == 0 || i + count > width)
+					return false;
+				while (count--) {
+					int value = fgetc(fp);
+					if (value == EOF)
+						return false;
+					rgbe[(i++) * 4 + c] = (unsigned char)value;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+float *readHDR(char *iname, int& width, int& height)
+{
+	FILE *fp = fopen(iname, "rb");
+	if (!fp)
+		return NULL;
+
+	// text header up to a blank line, then the resolution
+	char line[256];
+	bool ok = fgets(line, sizeof line, fp) && line[0] == '#' && line[1] == '?';
+	while (ok && fgets(line, sizeof line, fp)) {
+		if (line[0] == '\n' || line[0] == '\r')
+			break;
+		if (!strncmp(line, "FORMAT=", 7) && strncmp(line + 7, "32-bit_rle_rgbe", 15))
+			ok = false;
+	}
+
+	char ysign, yaxis, xsign, xaxis;
+	if (!ok || fscanf(fp, " %c%c %d %c%c %d", &ysign, &yaxis, &height, &xsign, &xaxis, &width) != 6
+		|| yaxis != 'Y' || xaxis != 'X' || xsign != '+' || width <= 0 || height <= 0) {
+		fclose(fp);
+		return NULL;
+	}
+	fgetc(fp);
+
+	// -Y means the first scanline is the top of the image
+	float *data = new float[width * height * 3];
+	unsigned char *rgbe = new unsigned char[width * 4];
+	for (int y = 0; y < height && ok; ++y) {
+		ok = readRGBELine(fp, width, rgbe);
+		float *row = data + (ysign == '-' ? height - 1 - y : y) * width * 3;
+		for (int i = 0; i < width && ok; ++i) {
+			const unsigned char *p = rgbe + i * 4;
+			float f = p[3] ? (float)ldexp(1.0, p[3] - (128 + 8)) : 0.0f;
+			for (int c = 0; c < 3; ++c)
+				row[i * 3 + c] = p[3] ? (p[c] + 0.5f) * f : 0.0f;
+		}
+	}
+
+	delete [] rgbe;
+	fclose(fp);
+	if (!ok) {
+		delete [] data;
+		return NULL;
+	}
+	return data;
+}
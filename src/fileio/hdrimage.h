@@ -0,0 +1,31 @@
+//
+// hdrimage.h
+//
+// Readers and writers for floating point images, so that rendered radiance
+// can leave the program without being clamped to 8 bits, and HDR maps can
+// come in.
+//
+// All of them use packed RGB floats stored bottom row first, the way the
+// ray tracer's buffers are laid out.
+//
+
+#ifndef HDRIMAGE_H
+#define HDRIMAGE_H
+
+// Portable float map: 32-bit floats, little endian.
+extern bool writePFM(char *iname, int width, int height, const float *data);
+
+// OpenEXR scanline image with uncompressed half float R, G and B channels.
+extern bool writeEXR(char *iname, int width, int height, const float *data);
+
+// Readers return an array allocated with new[], or NULL if the file can't
+// be read.  Greyscale PFMs are expanded to RGB.
+extern float *readPFM(char *iname, int& width, int& height);
+
+// Radiance RGBE (.hdr, .pic), flat or run length encoded scanlines.
+extern float *readHDR(char *iname, int& width, int& height);
+
+// IEEE 754 single to half precision, rounding to nearest.
+extern unsigned short floatToHalf(float f);
+
+#endif
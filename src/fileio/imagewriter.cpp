@@ -0,0 +1,368 @@
+//
+// imagewriter.cpp
+//
+// BMP, binary PPM and PNG writers.  PNG rows are filtered with the usual
+// minimum sum of absolute differences heuristic and compressed with the
+// Deflater from deflate.h, one IDAT chunk per batch of rows.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <vector>
+
+#include "imagewriter.h"
+#include "bitmap.h"
+#include "deflate.h"
+
+static bool hasExtension( const char *fn, const char *ext )
+{
+	size_t n = strlen( fn );
+	size_t e = strlen( ext );
+	if( n < e )
+		return false;
+
+	for( size_t k = 0; k < e; ++k )
+		if( tolower( fn[n - e + k] ) != ext[k] )
+			return false;
+	return true;
+}
+
+//
+// BMP: stored bottom row first, rows padded to 4 bytes, BGR.
+//
+class BMPWriter : public ImageWriter
+{
+public:
+	BMPWriter() : fp( NULL ), ok( false ) {}
+	~BMPWriter() { if( fp ) fclose( fp ); }
+
+	bool open( char *iname, int width, int height );
+	bool writeRow( const unsigned char *row );
+	bool close();
+	bool bottomUp() const { return true; }
+
+private:
+	FILE *fp;
+	bool ok;
+	std::vector<unsigned char> scanline;
+	int width;
+};
+
+static void put16( FILE *fp, unsigned int v )
+{
+	fputc( v & 0xff, fp );
+	fputc( (v >> 8) & 0xff, fp );
+}
+
+static void put32( FILE *fp, unsigned int v )
+{
+	put16( fp, v & 0xffff );
+	put16( fp, v >> 16 );
+}
+
+bool BMPWriter::open( char *iname, int w, int height )
+{
+	fp = fopen( iname, "wb" );
+	if( !fp )
+		return false;
+
+	width = w;
+	int bytes = width * 3;
+	int pad = (bytes % 4) ? 4 - (bytes % 4) : 0;
+	scanline.assign( bytes + pad, 0 );
+
+	unsigned int offBits = 14 + sizeof(BMP_BITMAPINFOHEADER);
+	put16( fp, 0x4d42 );			// "BM"
+	put32( fp, offBits + (unsigned int)scanline.size() * height );
+	put16( fp, 0 );
+	put16( fp, 0 );
+	put32( fp, offBits );
+
+	put32( fp, sizeof(BMP_BITMAPINFOHEADER) );
+	put32( fp, width );
+	put32( fp, height );
+	put16( fp, 1 );					// planes
+	put16( fp, 24 );				// bits per pixel
+	put32( fp, BMP_BI_RGB );
+	put32( fp, 0 );					// image size, may be 0 for BI_RGB
+	put32( fp, (int)(100 / 2.54 * 72) );
+	put32( fp, (int)(100 / 2.54 * 72) );
+	put32( fp, 0 );
+	put32( fp, 0 );
+
+	ok = !ferror( fp );
+	return ok;
+}
+
+bool BMPWriter::writeRow( const unsigned char *row )
+{
+	for( int i = 0; i < width; ++i ) {
+		scanline[i*3] = row[i*3+2];
+		scanline[i*3+1] = row[i*3+1];
+		scanline[i*3+2] = row[i*3];
+	}
+	if( fwrite( &scanline[0], scanline.size(), 1, fp ) != 1 )
+		ok = false;
+	return ok;
+}
+
+bool BMPWriter::close()
+{
+	if( !fp )
+		return false;
+	if( fclose( fp ) != 0 )
+		ok = false;
+	fp = NULL;
+	return ok;
+}
+
+//
+// PPM: "P6" binary RGB, top row first.
+//
+class PPMWriter : public ImageWriter
+{
+public:
+	PPMWriter() : fp( NULL ), ok( false ) {}
+	~PPMWriter() { if( fp ) fclose( fp ); }
+
+	bool open( char *iname, int width, int height );
+	bool writeRow( const unsigned char *row );
+	bool close();
+
+private:
+	FILE *fp;
+	bool ok;
+	int width;
+};
+
+bool PPMWriter::open( char *iname, int w, int height )
+{
+	fp = fopen( iname, "wb" );
+	if( !fp )
+		return false;
+
+	width = w;
+	fprintf( fp, "P6\n%d %d\n255\n", width, height );
+	ok = !ferror( fp );
+	return ok;
+}
+
+bool PPMWriter::writeRow( const unsigned char *row )
+{
+	if( fwrite( row, width * 3, 1, fp ) != 1 )
+		ok = false;
+	return ok;
+}
+
+bool PPMWriter::close()
+{
+	if( !fp )
+		return false;
+	if( fclose( fp ) != 0 )
+		ok = false;
+	fp = NULL;
+	return ok;
+}
+
+//
+// PNG: 8-bit truecolor, top row first, no interlacing.
+//
+class PNGWriter : public ImageWriter
+{
+public:
+	PNGWriter() : fp( NULL ), ok( false ) {}
+	~PNGWriter() { if( fp ) fclose( fp ); }
+
+	bool open( char *iname, int width, int height );
+	bool writeRow( const unsigned char *row );
+	bool close();
+
+private:
+	// compress this much filtered data at a time, one IDAT each
+	enum { BATCH_BYTES = 1 << 18 };
+
+	void flush( bool last );
+	void writeChunk( const char *type, const unsigned char *data, unsigned int len );
+
+	FILE *fp;
+	bool ok;
+	int width;
+
+	Deflater deflater;
+	std::vector<unsigned char> previous;	// unfiltered row above, zeros at the top
+	std::vector<unsigned char> filtered;	// filter byte + filtered row, per row
+	std::vector<unsigned char> compressed;
+	std::vector<unsigned char> candidate;
+};
+
+static unsigned int crcTable[256];
+
+static void makeCrcTable()
+{
+	for( unsigned int n = 0; n < 256; ++n ) {
+		unsigned int c = n;
+		for( int k = 0; k < 8; ++k )
+			c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		crcTable[n] = c;
+	}
+}
+
+static unsigned int updateCrc( unsigned int crc, const unsigned char *p, unsigned int len )
+{
+	for( unsigned int k = 0; k < len; ++k )
+		crc = crcTable[(crc ^ p[k]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static void putBE32( unsigned char *p, unsigned int v )
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+void PNGWriter::writeChunk( const char *type, const unsigned char *data, unsigned int len )
+{
+	unsigned char word[4];
+
+	putBE32( word, len );
+	fwrite( word, 4, 1, fp );
+	fwrite( type, 4, 1, fp );
+	if( len )
+		fwrite( data, len, 1, fp );
+
+	unsigned int crc = updateCrc( 0xffffffffu, (const unsigned char *)type, 4 );
+	crc = updateCrc( crc, data, len );
+	putBE32( word, crc ^ 0xffffffffu );
+	fwrite( word, 4, 1, fp );
+
+	if( ferror( fp ) )
+		ok = false;
+}
+
+bool PNGWriter::open( char *iname, int w, int height )
+{
+	if( !crcTable[1] )
+		makeCrcTable();
+
+	fp = fopen( iname, "wb" );
+	if( !fp )
+		return false;
+	ok = true;
+
+	width = w;
+	previous.assign( width * 3, 0 );
+	candidate.resize( width * 3 );
+
+	static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	fwrite( signature, 8, 1, fp );
+
+	unsigned char ihdr[13];
+	putBE32( ihdr, width );
+	putBE32( ihdr + 4, height );
+	ihdr[8] = 8;		// bits per channel
+	ihdr[9] = 2;		// truecolor
+	ihdr[10] = 0;		// deflate
+	ihdr[11] = 0;		// adaptive filtering
+	ihdr[12] = 0;		// not interlaced
+	writeChunk( "IHDR", ihdr, 13 );
+
+	return ok;
+}
+
+static int paeth( int a, int b, int c )
+{
+	int p = a + b - c;
+	int pa = abs( p - a );
+	int pb = abs( p - b );
+	int pc = abs( p - c );
+	if( pa <= pb && pa <= pc )
+		return a;
+	return pb <= pc ? b : c;
+}
+
+bool PNGWriter::writeRow( const unsigned char *row )
+{
+	int n = width * 3;
+	const unsigned char *up = &previous[0];
+
+	// try each filter type, keep the one with the smallest sum of
+	// absolute (signed) residuals
+	int bestType = 0;
+	long bestCost = -1;
+	size_t start = filtered.size();
+	filtered.resize( start + 1 + n );
+
+	for( int type = 0; type < 5; ++type ) {
+		long cost = 0;
+		for( int k = 0; k < n; ++k ) {
+			int a = k >= 3 ? row[k-3] : 0;
+			int b = up[k];
+			int c = k >= 3 ? up[k-3] : 0;
+			int pred;
+			switch( type ) {
+			case 0: pred = 0; break;
+			case 1: pred = a; break;
+			case 2: pred = b; break;
+			case 3: pred = (a + b) >> 1; break;
+			default: pred = paeth( a, b, c ); break;
+			}
+			unsigned char v = (unsigned char)(row[k] - pred);
+			candidate[k] = v;
+			cost += v < 128 ? v : 256 - v;
+		}
+		if( bestCost < 0 || cost < bestCost ) {
+			bestCost = cost;
+			bestType = type;
+			memcpy( &filtered[start + 1], &candidate[0], n );
+		}
+	}
+	filtered[start] = (unsigned char)bestType;
+	memcpy( &previous[0], row, n );
+
+	if( filtered.size() >= BATCH_BYTES )
+		flush( false );
+	return ok;
+}
+
+void PNGWriter::flush( bool last )
+{
+	if( !filtered.empty() )
+		deflater.write( &filtered[0], (int)filtered.size(), compressed );
+	filtered.clear();
+	if( last )
+		deflater.finish( compressed );
+
+	if( !compressed.empty() )
+		writeChunk( "IDAT", &compressed[0], (unsigned int)compressed.size() );
+	compressed.clear();
+}
+
+bool PNGWriter::close()
+{
+	// never opened, or closed already
+	if( !fp )
+		return false;
+	flush( true );
+	writeChunk( "IEND", NULL, 0 );
+
+	if( fclose( fp ) != 0 )
+		ok = false;
+	fp = NULL;
+	return ok;
+}
+
+ImageWriter *ImageWriter::create( const char *iname )
+{
+	if( hasExtension( iname, ".pfm" ) || hasExtension( iname, ".exr" ) )
+		return NULL;
+	if( hasExtension( iname, ".png" ) )
+		return new PNGWriter;
+	if( hasExtension( iname, ".ppm" ) )
+		return new PPMWriter;
+	return new BMPWriter;
+}
@@ -0,0 +1,33 @@
+//
+// imagewriter.h
+//
+// Row-at-a-time writers for 8-bit RGB images.  The ray tracer hands rows
+// over as soon as they are finished, so an image never has to be in
+// memory as a whole to be saved.
+//
+
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+class ImageWriter
+{
+public:
+	virtual ~ImageWriter() {}
+
+	virtual bool open( char *iname, int width, int height ) = 0;
+
+	// One row of packed RGB.  Rows come in file order: top row first,
+	// unless bottomUp() says otherwise.
+	virtual bool writeRow( const unsigned char *row ) = 0;
+
+	// Flush and close the file; false if anything failed along the way.
+	virtual bool close() = 0;
+
+	virtual bool bottomUp() const { return false; }
+
+	// A writer chosen by the file extension: .png, .ppm, or .bmp for
+	// anything else.  Returns NULL for the float formats (.pfm, .exr).
+	static ImageWriter *create( const char *iname );
+};
+
+#endif
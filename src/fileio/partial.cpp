@@ -0,0 +1,139 @@
+//
+// partial.cpp
+//
+// Reading and writing the partial images of a render split across
+// processes.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "partial.h"
+
+static void putWord(unsigned char *b, unsigned int bits)
+{
+	b[0] = (unsigned char)bits;
+	b[1] = (unsigned char)(bits >> 8);
+	b[2] = (unsigned char)(bits >> 16);
+	b[3] = (unsigned char)(bits >> 24);
+}
+
+static unsigned int getWord(const unsigned char *b)
+{
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned int)b[3] << 24);
+}
+
+static std::string restOfLine(const char *s)
+{
+	std::string r(s);
+	if (!r.empty() && r[r.size() - 1] == '\n')
+		r.erase(r.size() - 1);
+	return r;
+}
+
+bool writePartial(const char *fn, const PartialInfo& info, const FrameBuffer& fb)
+{
+	FILE *fp = fopen(fn, "wb");
+	if (!fp)
+		return false;
+
+	fprintf(fp, "RAYPART 1\nimage %d %d\n", info.width, info.height);
+	fprintf(fp, "tonemap %.17g %.17g %d\n", info.toneMap.exposure, info.toneMap.gamma,
+		info.toneMap.reinhard ? 1 : 0);
+	fprintf(fp, "scene %s\n", info.scene.c_str());
+	if (!info.settings.empty())
+		fprintf(fp, "settings %s\n", info.settings.c_str());
+	fprintf(fp, "rects %d\n", (int)info.rects.size());
+	for (size_t k = 0; k < info.rects.size(); ++k) {
+		const PartialRect& r = info.rects[k];
+		fprintf(fp, "%d %d %d %d\n", r.x0, r.y0, r.x1, r.y1);
+	}
+	fprintf(fp, "data\n");
+
+	bool ok = true;
+	std::vector<unsigned char> row;
+	for (size_t k = 0; k < info.rects.size() && ok; ++k) {
+		const PartialRect& r = info.rects[k];
+		row.resize((size_t)(r.x1 - r.x0) * 16);
+		for (int y = r.y0; y < r.y1 && ok; ++y) {
+			int j = info.height - 1 - y;
+			unsigned char *b = row.empty() ? NULL : &row[0];
+			for (int i = r.x0; i < r.x1; ++i, b += 16) {
+				vec3f sum = fb.getSum(i, j);
+				for (int c = 0; c < 3; ++c) {
+					float f = (float)sum[c];
+					unsigned int bits;
+					memcpy(&bits, &f, 4);
+					putWord(b + c * 4, bits);
+				}
+				putWord(b + 12, (unsigned int)fb.getSamples(i, j));
+			}
+			ok = row.empty() || fwrite(&row[0], row.size(), 1, fp) == 1;
+		}
+	}
+
+	if (fclose(fp) != 0)
+		ok = false;
+	return ok;
+}
+
+bool readPartial(const char *fn, PartialInfo& info, FrameBuffer *fb)
+{
+	FILE *fp = fopen(fn, "rb");
+	if (!fp)
+		return false;
+
+	char line[1024];
+	int version = 0, reinhard = 0, n = 0;
+	bool ok = fgets(line, sizeof(line), fp) && sscanf(line, "RAYPART %d", &version) == 1 && version == 1
+		&& fgets(line, sizeof(line), fp) && sscanf(line, "image %d %d", &info.width, &info.height) == 2
+		&& fgets(line, sizeof(line), fp)
+		&& sscanf(line, "tonemap %lf %lf %d", &info.toneMap.exposure, &info.toneMap.gamma, &reinhard) == 3
+		&& fgets(line, sizeof(line), fp) && strncmp(line, "scene ", 6) == 0;
+	if (ok) {
+		info.toneMap.reinhard = reinhard != 0;
+		info.scene = restOfLine(line + 6);
+		info.settings.clear();
+		ok = fgets(line, sizeof(line), fp) != NULL;
+		if (ok && strncmp(line, "settings ", 9) == 0) {
+			info.settings = restOfLine(line + 9);
+			ok = fgets(line, sizeof(line), fp) != NULL;
+		}
+		ok = ok && sscanf(line, "rects %d", &n) == 1 && n >= 0;
+	}
+
+	info.rects.clear();
+	for (int k = 0; ok && k < n; ++k) {
+		PartialRect r;
+		ok = fgets(line, sizeof(line), fp) && sscanf(line, "%d %d %d %d", &r.x0, &r.y0, &r.x1, &r.y1) == 4
+			&& 0 <= r.x0 && r.x0 <= r.x1 && r.x1 <= info.width
+			&& 0 <= r.y0 && r.y0 <= r.y1 && r.y1 <= info.height;
+		info.rects.push_back(r);
+	}
+	ok = ok && fgets(line, sizeof(line), fp) && strcmp(line, "data\n") == 0;
+
+	if (ok && fb) {
+		ok = fb->getWidth() == info.width && fb->getHeight() == info.height;
+		std::vector<unsigned char> row;
+		for (int k = 0; k < n && ok; ++k) {
+			const PartialRect& r = info.rects[k];
+			row.resize((size_t)(r.x1 - r.x0) * 16);
+			for (int y = r.y0; y < r.y1 && ok; ++y) {
+				ok = row.empty() || fread(&row[0], row.size(), 1, fp) == 1;
+				int j = info.height - 1 - y;
+				const unsigned char *b = row.empty() ? NULL : &row[0];
+				for (int i = r.x0; i < r.x1 && ok; ++i, b += 16) {
+					float f[3];
+					for (int c = 0; c < 3; ++c) {
+						unsigned int bits = getWord(b + c * 4);
+						memcpy(&f[c], &bits, 4);
+					}
+					fb->addSample(i, j, vec3f(f[0], f[1], f[2]), (int)getWord(b + 12));
+				}
+			}
+		}
+	}
+
+	fclose(fp);
+	return ok;
+}
@@ -0,0 +1,55 @@
+//
+// partial.h
+//
+// Pieces of one image rendered by separate processes, to be merged into
+// the final image once all of them are done.  A partial keeps the summed
+// radiance and sample count of every pixel it covers, so the merged image
+// is exactly what a single process would have made, in any output format
+// and with the tone mapping it was rendered with.
+//
+// The file starts with a few lines of text,
+//
+//     RAYPART 1
+//     image <width> <height>
+//     tonemap <exposure> <gamma> <reinhard>
+//     scene <name>
+//     settings <text>			(optional)
+//     rects <n>
+//     <x0> <y0> <x1> <y1>			(n of these)
+//     data
+//
+// followed, rectangle by rectangle and row by row from the top, by three
+// floats and an int per pixel, little endian.  Rectangles are in pixels
+// from the top left, x1 and y1 not included.
+//
+
+#ifndef PARTIAL_H
+#define PARTIAL_H
+
+#include <string>
+#include <vector>
+
+#include "../FrameBuffer.h"
+
+struct PartialRect
+{
+	int x0, y0, x1, y1;
+};
+
+struct PartialInfo
+{
+	int width, height;
+	ToneMap toneMap;
+	std::string scene;
+	std::string settings;	// what a checkpoint was rendered with
+	std::vector<PartialRect> rects;
+};
+
+// fb is the whole image, rows bottom first, of info's size.
+bool writePartial( const char *fn, const PartialInfo& info, const FrameBuffer& fb );
+
+// Read the header, and if fb is given add the pixels into it; it must
+// already be the size the header says.
+bool readPartial( const char *fn, PartialInfo& info, FrameBuffer *fb );
+
+#endif
@@ -14,6 +14,9 @@
 
 #include "../scene/scene.h"
 #include "../SceneObjects/trimesh.h"
+#include "../scene/texture.h"
+#include "../scene/environment.h"
+#include "../scene/animation.h"
 #include "../SceneObjects/Box.h"
 #include "../SceneObjects/Cone.h"
 #include "../SceneObjects/Cylinder.h"
@@ -33,29 +36,48 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 static void processTrimesh( string name, Obj *child, Scene *scene,
                                      const mmap& materials, TransformNode *transform );
 static void processCamera( Obj *child, Scene *scene );
-static Material *getMaterial( Obj *child, const mmap& bindings );
-static Material *processMaterial( Obj *child, mmap *bindings = NULL );
+static void processEnvironment( Obj *child, Scene *scene );
+static void processAnimation( Obj *child, Scene *scene );
+static Animation *sceneAnimation( Scene *scene );
+static double keyFrame( Obj *key );
+static vec4f keyValue( Obj *key, const string& name, size_t size );
+static Material *getMaterial( Obj *child, const mmap& bindings, Scene *scene );
+static Material *processMaterial( Obj *child, Scene *scene, mmap *bindings = NULL );
+static MaterialParameter processParameter( Obj *child, Scene *scene );
 static void verifyTuple( const mytuple& tup, size_t size );
 
-Scene *readScene( const string& filename )
+Scene *readScene( const string& filename, string *error )
 {
 	ifstream ifs( filename.c_str() );
 	if( !ifs ) {
-		cerr << "Error: couldn't read scene file " << filename << endl;
+		if( error )
+			*error = "couldn't read scene file " + filename;
+		else
+			cerr << "Error: couldn't read scene file " << filename << endl;
 		return NULL;
 	}
 
+	string::size_type slash = filename.find_last_of( "/\\" );
+	string directory = slash == string::npos ? string( "" ) : filename.substr( 0, slash + 1 );
+
+	Scene *scene;
 	try {
-		return readScene( ifs );
+		scene = readScene( ifs, directory );
 	} catch( ParseError& pe ) {
-		cout << "Parse error: " << pe << endl;
-		return NULL;
+		if( error )
+			*error = pe.getMsg();
+		else
+			cout << "Parse error: " << pe << endl;
+		scene = NULL;
 	}
+
+	return scene;
 }
 
-Scene *readScene( istream& is )
+Scene *readScene( istream& is, const string& directory )
 {
 	Scene *ret = new Scene;
+	ret->setDirectory( directory );
 	
 	// Extract the file header
 	static const int MAXNAME = 80;
@@ -100,6 +122,10 @@ Scene *readScene( istream& is )
 		delete cur;
 	}
 
+	// posed at the first frame until told otherwise
+	if( ret->getAnimation() )
+		ret->setFrame( ret->getAnimation()->firstFrame() );
+
 	return ret;
 }
 
@@ -291,6 +317,33 @@ static void processGeometry( string name, Obj *child, Scene *scene,
                                                              l4[1]->getScalar(),
                                                              l4[2]->getScalar(),
                                                              l4[3]->getScalar() ) ) ) );
+	} else if( name == "animate" ) {
+		// animate( { frame = 0; rotate = (0,0,1,0); }, { frame = 100; ... }, object )
+		const mytuple& tup = child->getTuple();
+		if( tup.size() < 2 )
+			throw ParseError( "animate needs at least one key and an object" );
+
+		TransformNode *node = transform->createChild( mat4f() );
+		TransformAnimation *anim = new TransformAnimation( node );
+		sceneAnimation( scene )->add( anim );
+		for( size_t k = 0; k + 1 < tup.size(); ++k ) {
+			Obj *key = tup[k];
+			double frame = keyFrame( key );
+			if( hasField( key, "translate" ) )
+				anim->translate.add( frame, keyValue( key, "translate", 3 ) );
+			if( hasField( key, "rotate" ) )
+				anim->rotate.add( frame, keyValue( key, "rotate", 4 ) );
+			if( hasField( key, "scale" ) ) {
+				Obj *sc = getField( key, "scale" );
+				if( sc->getTypeName() == "scalar" ) {
+					double v = sc->getScalar();
+					anim->scale.add( frame, vec4f( v, v, v, 0.0 ) );
+				} else {
+					anim->scale.add( frame, keyValue( key, "scale", 3 ) );
+				}
+			}
+		}
+		processGeometry( tup[ tup.size() - 1 ], scene, materials, node );
 	} else if( name == "trimesh" || name == "polymesh" ) { // 'polymesh' is for backwards compatibility
         processTrimesh( name, child, scene, materials, transform);
     } else {
@@ -298,7 +351,7 @@ static void processGeometry( string name, Obj *child, Scene *scene,
        	Material *mat;
         
         //if( hasField( child, "material" ) )
-        mat = getMaterial(getField( child, "material" ), materials );
+        mat = getMaterial(getField( child, "material" ), materials, scene );
         //else
         //    mat = new Material();
 
@@ -335,7 +388,7 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
     Material *mat;
     
     if( hasField( child, "material" ) )
-        mat = getMaterial( getField( child, "material" ), materials );
+        mat = getMaterial( getField( child, "material" ), materials, scene );
     else
         mat = new Material();
     
@@ -376,7 +429,7 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
     {
         const mytuple &mats = getField( child, "materials" )->getTuple();
         for( mytuple::const_iterator mi = mats.begin(); mi != mats.end(); ++mi )
-            tmesh->addMaterial( getMaterial( *mi, materials ) );
+            tmesh->addMaterial( getMaterial( *mi, materials, scene ) );
     }
     if( hasField( child, "normals" ) )
     {
@@ -384,6 +437,16 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
         for( mytuple::const_iterator ni = norms.begin(); ni != norms.end(); ++ni )
             tmesh->addNormal( tupleToVec( *ni ) );
     }
+    if( hasField( child, "texcoords" ) )
+    {
+        const mytuple &coords = getField( child, "texcoords" )->getTuple();
+        for( mytuple::const_iterator ti = coords.begin(); ti != coords.end(); ++ti )
+        {
+            const mytuple &uv = (*ti)->getTuple();
+            verifyTuple( uv, 2 );
+            tmesh->addTexCoord( uv[0]->getScalar(), uv[1]->getScalar() );
+        }
+    }
 
     char *error;
     if( error = tmesh->doubleCheck() )
@@ -392,7 +455,7 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
     scene->add(tmesh);
 }
 
-static Material *getMaterial( Obj *child, const mmap& bindings )
+static Material *getMaterial( Obj *child, const mmap& bindings, Scene *scene )
 {
 	string tfield = child->getTypeName();
 	if( tfield == "id" ) {
@@ -407,45 +470,78 @@ static Material *getMaterial( Obj *child, const mmap& bindings )
 		} 
 	} 
 	// Don't allow binding.
-	return processMaterial( child );
+	return processMaterial( child, scene );
+}
+
+// A material parameter is a color tuple, a scalar, or an image map:
+//
+//     diffuse = map( "wood.bmp" );
+//
+// Map file names are tried as given, then relative to the scene file.
+static MaterialParameter processParameter( Obj *child, Scene *scene )
+{
+	string tfield = child->getTypeName();
+	if( tfield == "scalar" ) {
+		return MaterialParameter( child->getScalar() );
+	} else if( tfield == "named" && child->getName() == "map" ) {
+		Obj *arg = child->getChild();
+		string filename;
+		if( arg->getTypeName() == "tuple" ) {
+			const mytuple& t = arg->getTuple();
+			verifyTuple( t, 1 );
+			filename = t[0]->getString();
+		} else {
+			filename = arg->getString();
+		}
+
+		TextureMap *tex = scene->getTexture( filename );
+		if( !tex && !scene->getDirectory().empty() )
+			tex = scene->getTexture( scene->getDirectory() + filename );
+		if( !tex )
+			throw ParseError( string( "Couldn't read texture map " ) + filename );
+		return MaterialParameter( tex );
+	}
+
+	return MaterialParameter( tupleToVec( child ) );
 }
 
-static Material *processMaterial(Obj *child, mmap *bindings)
+static Material *processMaterial(Obj *child, Scene *scene, mmap *bindings)
 // Generate a material from a parse sub-tree
 //
 // child   - root of parse tree
+// scene   - owner of any texture maps the material uses
 // mmap    - bindings of names to materials (if non-null)
 // defmat  - material to start with (if non-null)
 {
     Material *mat;
     mat = new Material();
-	vec3f specular = vec3f(0.0, 0.0, 0.0);
+	MaterialParameter specular;
     if( hasField( child, "emissive" ) ) {
-        mat->setEmissive(tupleToVec( getField( child, "emissive" )));
+        mat->setEmissive(processParameter( getField( child, "emissive" ), scene ));
     }
     if( hasField( child, "ambient" ) ) {
-		mat->setAmbient(tupleToVec(getField(child, "ambient")));
+		mat->setAmbient(processParameter(getField(child, "ambient"), scene));
     }
     if( hasField( child, "specular" ) ) {
-		specular = tupleToVec(getField(child, "specular"));
+		specular = processParameter(getField(child, "specular"), scene);
 		mat->setSpecular(specular);
     }
     if( hasField( child, "diffuse" ) ) {
-		mat->setDiffuse(tupleToVec(getField(child, "diffuse")));
+		mat->setDiffuse(processParameter(getField(child, "diffuse"), scene));
     }
     if( hasField( child, "reflective" ) ) {
-		mat->setReflective(tupleToVec(getField(child, "reflective")));
+		mat->setReflective(processParameter(getField(child, "reflective"), scene));
 	}
 	else mat->setReflective(specular);
 
     if( hasField( child, "transmissive" ) ) {
-		mat->setTransmissive(tupleToVec(getField(child, "transmissive")));
+		mat->setTransmissive(processParameter(getField(child, "transmissive"), scene));
     }
     if( hasField( child, "index" ) ) { // index of refraction
-		mat->setIndex(getField(child, "index")->getScalar());
+		mat->setIndex(processParameter(getField(child, "index"), scene));
     }
     if( hasField( child, "shininess" ) ) {
-        mat->setShininess(getField( child, "shininess" )->getScalar());
+        mat->setShininess(processParameter( getField( child, "shininess" ), scene ));
     }
 
     if( bindings != NULL ) {
@@ -470,6 +566,145 @@ static Material *processMaterial(Obj *child, mmap *bindings)
     return mat;
 }
 
+// A file named in the scene: as given if it exists there, otherwise
+// relative to the scene file.
+static string sceneFile( const Scene *scene, const string& filename )
+{
+	ifstream f( filename.c_str() );
+	if( f || scene->getDirectory().empty() )
+		return filename;
+	return scene->getDirectory() + filename;
+}
+
+// The background for rays that escape:
+//
+//     environment { map = "sky.hdr"; scale = 0.8; }
+//     environment { cube = ( "px.bmp", "nx.bmp", "py.bmp", "ny.bmp", "pz.bmp", "nz.bmp" ); }
+//
+// map is a latitude-longitude panorama; scale is a scalar or a color.
+static void processEnvironment( Obj *child, Scene *scene )
+{
+	EnvironmentMap *env = new EnvironmentMap;
+	bool ok;
+	string what;
+	if( hasField( child, "cube" ) ) {
+		const mytuple& faces = getField( child, "cube" )->getTuple();
+		verifyTuple( faces, 6 );
+		string filenames[6];
+		for( int k = 0; k < 6; ++k )
+			filenames[k] = sceneFile( scene, faces[k]->getString() );
+		what = "cube starting with " + filenames[0];
+		ok = env->loadCube( filenames );
+		for( int k = 0; ok && k < 6; ++k )
+			scene->addFile( filenames[k] );
+	} else {
+		what = getField( child, "map" )->getString();
+		string filename = sceneFile( scene, what );
+		ok = env->loadLatLong( filename );
+		if( ok )
+			scene->addFile( filename );
+	}
+	if( !ok ) {
+		delete env;
+		throw ParseError( string( "Couldn't read environment map " ) + what );
+	}
+
+	if( hasField( child, "scale" ) ) {
+		Obj *scale = getField( child, "scale" );
+		if( scale->getTypeName() == "scalar" ) {
+			double s = scale->getScalar();
+			env->setScale( vec3f( s, s, s ) );
+		} else {
+			env->setScale( tupleToVec( scale ) );
+		}
+	}
+
+	scene->setEnvironment( env );
+}
+
+// The scene's animation, made when the first keyframe is read.
+static Animation *sceneAnimation( Scene *scene )
+{
+	if( !scene->getAnimation() )
+		scene->setAnimation( new Animation );
+	return scene->getAnimation();
+}
+
+static double keyFrame( Obj *key )
+{
+	if( !hasField( key, "frame" ) )
+		throw ParseError( "Keyframe without a frame number" );
+	return getField( key, "frame" )->getScalar();
+}
+
+// A tuple field of a key, padded out to a vec4f.
+static vec4f keyValue( Obj *key, const string& name, size_t size )
+{
+	const mytuple& t = getField( key, name )->getTuple();
+	verifyTuple( t, size );
+	vec4f v;
+	for( size_t k = 0; k < size; ++k )
+		v[k] = t[k]->getScalar();
+	return v;
+}
+
+// The frames a sequence render covers when none are given on the
+// command line:
+//
+//     animation { frames = 120; }			// 0 to 119
+//     animation { first = 10; last = 50; }
+//
+// Without this block, it runs from the first key to the last.
+static void processAnimation( Obj *child, Scene *scene )
+{
+	double first = 0.0, last = 0.0, frames = 0.0;
+	if( maybeExtractField( child, "frames", frames ) ) {
+		first = 0.0;
+		last = frames - 1.0;
+	} else {
+		maybeExtractField( child, "first", first );
+		if( !maybeExtractField( child, "last", last ) )
+			throw ParseError( "animation needs frames, or first and last" );
+	}
+	sceneAnimation( scene )->setRange( (int)first, (int)last );
+}
+
+// Camera keys ride along with the camera block:
+//
+//     camera {
+//         position = (0,0,10); viewdir = (0,0,-1); updir = (0,1,0);
+//         keys = ( { frame = 0; position = (0,0,10); },
+//                  { frame = 99; position = (10,0,0); viewdir = (-1,0,0); fov = 40; } );
+//     }
+static void processCameraKeys( Obj *child, Scene *scene )
+{
+	vec3f viewdir( 0.0, 0.0, -1.0 );
+	vec3f updir( 0.0, 1.0, 0.0 );
+	if( hasField( child, "viewdir" ) && hasField( child, "updir" ) ) {
+		viewdir = tupleToVec( getField( child, "viewdir" ) );
+		updir = tupleToVec( getField( child, "updir" ) );
+	}
+
+	CameraAnimation *anim = new CameraAnimation( viewdir, updir );
+	sceneAnimation( scene )->setCamera( anim );
+
+	const mytuple& keys = getField( child, "keys" )->getTuple();
+	for( size_t k = 0; k < keys.size(); ++k ) {
+		Obj *key = keys[k];
+		double frame = keyFrame( key );
+		if( hasField( key, "position" ) )
+			anim->position.add( frame, keyValue( key, "position", 3 ) );
+		if( hasField( key, "viewdir" ) )
+			anim->viewdir.add( frame, keyValue( key, "viewdir", 3 ) );
+		if( hasField( key, "updir" ) )
+			anim->updir.add( frame, keyValue( key, "updir", 3 ) );
+		if( hasField( key, "fov" ) ) {
+			double fov = getField( key, "fov" )->getScalar();
+			anim->fov.add( frame, vec4f( fov, 0.0, 0.0, 0.0 ) );
+		}
+	}
+}
+
 static void
 processCamera( Obj *child, Scene *scene )
 {
@@ -495,6 +730,8 @@ processCamera( Obj *child, Scene *scene )
         scene->getCamera()->setLook( tupleToVec( getField( child, "viewdir" ) ).normalize(),
                                      tupleToVec( getField( child, "updir" ) ).normalize() );
     }
+    if( hasField( child, "keys" ) )
+        processCameraKeys( child, scene );
 }
 
 static void processObject( Obj *obj, Scene *scene, mmap& materials )
@@ -552,6 +789,42 @@ static void processObject( Obj *obj, Scene *scene, mmap& materials )
 			tupleToVec(getColorField(child)));
 		scene->add(pointLight);*/
 		
+	} else if( name == "rect_light" || name == "sphere_light" ) {
+		if( child == NULL ) {
+			throw ParseError( "No info for " + name );
+		}
+
+		double a0 = 1.0;
+		double a1 = 0.0;
+		double a2 = 0.0;
+		maybeExtractField( child, "constant_attenuation_coeff", a0 );
+		maybeExtractField( child, "linear_attenuation_coeff", a1 );
+		maybeExtractField( child, "quadratic_attenuation_coeff", a2 );
+
+		AreaLight *light;
+		if( name == "rect_light" ) {
+			light = new RectAreaLight( scene,
+				tupleToVec( getField( child, "position" ) ),
+				tupleToVec( getField( child, "edge1" ) ),
+				tupleToVec( getField( child, "edge2" ) ),
+				tupleToVec( getColorField( child ) ),
+				a0, a1, a2 );
+		} else {
+			light = new SphereAreaLight( scene,
+				tupleToVec( getField( child, "position" ) ),
+				getField( child, "radius" )->getScalar(),
+				tupleToVec( getColorField( child ) ),
+				a0, a1, a2 );
+		}
+
+		// sample budget; the adaptive test looks at the first few only
+		double samples = 16;
+		double adaptive = 4;
+		maybeExtractField( child, "samples", samples );
+		maybeExtractField( child, "adaptive_samples", adaptive );
+		light->setSamples( (int)samples, (int)adaptive );
+
+		scene->add( light );
 	} else if (name == "ambient_light"){
 		if (child == NULL) {
 			throw ParseError("No info for ambient_light");
@@ -567,14 +840,25 @@ static void processObject( Obj *obj, Scene *scene, mmap& materials )
 				name == "rotate" ||
 				name == "scale" ||
 				name == "transform" ||
+				name == "animate" ||
                 name == "trimesh" ||
                 name == "polymesh") { // polymesh is for backwards compatibility.
 		processGeometry( name, child, scene, materials, &scene->transformRoot);
 		//scene->add( geo );
 	} else if( name == "material" ) {
-		processMaterial( child, &materials );
+		processMaterial( child, scene, &materials );
 	} else if( name == "camera" ) {
 		processCamera( child, scene );
+	} else if( name == "animation" ) {
+		if( child == NULL ) {
+			throw ParseError( "No info for animation" );
+		}
+		processAnimation( child, scene );
+	} else if( name == "environment" ) {
+		if( child == NULL ) {
+			throw ParseError( "No info for environment" );
+		}
+		processEnvironment( child, scene );
 	} else {
 		throw ParseError( string( "Unrecognized object: " ) + name );
 	}
@@ -6,7 +6,11 @@
 
 #include "../scene/scene.h"
 
-Scene *readScene( const string& filename );
-Scene *readScene( istream& is );
+// A file that can't be read or parsed gives NULL, with the reason in
+// *error if that is given and on the console otherwise.
+Scene *readScene( const string& filename, string *error = NULL );
+// Files the scene names are also looked for in directory, which ends in
+// a slash if it isn't empty.
+Scene *readScene( istream& is, const string& directory = "" );
 
 #endif // __READ_H__
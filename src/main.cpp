@@ -13,7 +13,7 @@
 //  |
 //  +- RayTracer::traceSetup
 //  |
-//  +- RayTracer::traceLines
+//  +- RayTracer::traceImage
 //        |
 //        +- RayTracer::tracePixel
 //              |
@@ -34,11 +34,11 @@
 //                          +- Material::shade
 //
 // The loadScene and traceSetup methods load a file and set up all the internal
-// buffers necessary to render the scene.  The traceLines method begins the
-// process of actually rendering the image, one scanline at a time.  It does
-// this by calling tracePixel for each pixel in the image.  tracePixel is given
-// a coordinate pair which is converted into an (x,y) screen coordinate and
-// passed to trace.  The trace method calculates a ray from the camera position
+// buffers necessary to render the scene.  The traceImage method begins the
+// process of actually rendering the image, one tile at a time on each of
+// several threads.  It does this by calling tracePixel for each pixel in the
+// tile.  tracePixel is given a coordinate pair which is converted into an
+// (x,y) screen coordinate and passed to trace.  The trace method calculates a ray from the camera position
 // through the (x,y) coordinate and then calls traceRay to see if this ray
 // actually intersects any objects in the scene.  The intersect method in
 // Scene calls intersect on each object in the scene (part of your assignment
@@ -55,7 +55,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
 
 #include <FL/Fl.h>
 #include <FL/Fl_Window.H>
@@ -65,8 +74,18 @@
 
 #include "ui/TraceUI.h"
 #include "RayTracer.h"
+#include "CancelToken.h"
+
+#include "RenderStats.h"
+#include "PerfCounters.h"
+#include "RenderThread.h"
+#include "RenderServer.h"
+#include "SharedFrame.h"
 
 #include "fileio/bitmap.h"
+#include "fileio/imagewriter.h"
+#include "scene/texture.h"
+#include "scene/texturecache.h"
 
 // ***********************************************************
 // from getopt.cpp 
@@ -87,7 +106,37 @@ int recursion_depth = 0;
 int g_height;
 int g_width = 150;
 bool bReport = false;
+bool bStream = false;
+bool bConvertTexture = false;
+bool bWatch = false;
+bool bSequence = false;
+bool bFrameRange = false;
+int g_firstFrame = 0, g_lastFrame = 0;
+int g_frameJobs = 1;
+char *g_socket = NULL;
+bool bCrop = false, bTiles = false, bMerge = false;
+int g_crop[4];
+int g_firstTile = 0, g_lastTile = 0;
+double g_checkpoint = 0.0;
+bool bResume = false;
+double g_timeBudget = 0.0;
+double g_deadline = 0.0;
+bool bWavefront = false;
+RayTracer::TileOrder g_tileOrder = RayTracer::TILES_ROWS;
+bool bFocus = false;
+int g_focus[2];
+bool bPerf = false;
+char *g_perfJson = NULL;
+int g_sceneCache = RenderServer::DEFAULT_CACHE_SIZE;
+int g_threads = 0;
+int g_textureCacheMB = TextureCache::DEFAULT_BUDGET_MB;
+ToneMap g_toneMap;
 char *progname, *rayName, *imgName;
+char *g_background = NULL;
+
+// shared by every ray tracer of a command line run, for Ctrl-C and
+// --deadline
+CancelToken g_cancel;
 
 void usage()
 {
@@ -95,16 +144,118 @@ void usage()
 	fl_alert( "usage: %s [-r <#> -w <#> -t] [input.ray output.bmp]\n", progname );
 #else
 	fprintf( stderr, "usage: %s [options] [input.ray output.bmp]\n", progname );
+	fprintf( stderr, "       %s -S <socket> [options]\n", progname );
+	fprintf( stderr, "       %s -M output.bmp piece.part...\n", progname );
 	fprintf( stderr, "  -r <#>      set recurssion level (default %d)\n", recursion_depth );
 	fprintf( stderr, "  -w <#>      set output image width (default %d)\n", g_width );
 	fprintf( stderr, "  -t			report time statistics\n" );
+	fprintf( stderr, "  -n <#>      render threads (default: one per core)\n" );
+	fprintf( stderr, "  -s          write rows while rendering, holding only a few\n"
+					 "              bands of the image in memory (8-bit formats)\n" );
+	fprintf( stderr, "  -e <#>      exposure in stops (default %g)\n", g_toneMap.exposure );
+	fprintf( stderr, "  -g <#>      display gamma (default %g)\n", g_toneMap.gamma );
+	fprintf( stderr, "  -m          compress highlights instead of clipping them\n" );
+	fprintf( stderr, "  -c <#>      texture cache size in MB (default %d)\n", g_textureCacheMB );
+	fprintf( stderr, "  -x          convert input.bmp to a tiled texture output.tex\n" );
+	fprintf( stderr, "  -b <file>   lat-long background for rays that miss (.bmp, .pfm, .hdr)\n" );
+	fprintf( stderr, "  -W          keep watching input.ray, rendering again whenever it\n"
+					 "              changes (objects that only moved keep the BVH)\n" );
+	fprintf( stderr, "  -a          render the scene's animation; output.bmp is a pattern\n"
+					 "              where #### becomes the frame number (out.####.png)\n" );
+	fprintf( stderr, "  -f <#>[-<#>] frames to render (implies -a)\n" );
+	fprintf( stderr, "  -j <#>      frames rendered at once, sharing the threads\n"
+					 "              (default %d); for small frames\n", g_frameJobs );
+	fprintf( stderr, "  -R x0,y0,x1,y1 render only this window, in pixels from the top left\n"
+					 "              (x1, y1 excluded); the output is a piece for -M\n" );
+	fprintf( stderr, "  -T <#>[-<#>] render only these %d pixel tiles, numbered row by row\n"
+					 "              from the top left; the output is a piece for -M\n", (int)RayTracer::TILE_SIZE );
+	fprintf( stderr, "  -M          merge the pieces into output.bmp\n" );
+	fprintf( stderr, "  -k <#>      save finished tiles to output.bmp.ckpt every # seconds\n" );
+	fprintf( stderr, "  --resume    carry on from output.bmp.ckpt, tracing only the tiles\n"
+					 "              it is missing (not with -s)\n" );
+	fprintf( stderr, "  --wavefront trace secondary rays in sorted waves rather than one\n"
+					 "              path at a time\n" );
+	fprintf( stderr, "  --time-budget <#> render in passes for # seconds, noisiest pixels\n"
+					 "              first, and keep the best image so far (not with -T)\n" );
+	fprintf( stderr, "  --deadline <#> stop after # seconds, keeping the tiles done; Ctrl-C\n"
+					 "              stops the same way (a second one kills)\n" );
+	fprintf( stderr, "  --tile-order rows|spiral|cost  trace tiles row by row (default),\n"
+					 "              outwards from the middle, or the slowest first\n" );
+	fprintf( stderr, "  --focus x,y spiral outwards from this pixel, from the top left\n" );
+	fprintf( stderr, "  --perf[=file.json] count cycles, instructions, cache and branch\n"
+					 "              misses by phase and thread (Linux) and print them, and\n"
+					 "              write them to file.json (- for stdout)\n" );
+	fprintf( stderr, "  -S <socket> serve render jobs on a Unix domain socket (see RenderServer.h)\n" );
+	fprintf( stderr, "  -N <#>      scenes the server keeps loaded (default %d)\n", g_sceneCache );
+	fprintf( stderr, "  output.png, .ppm and .bmp are 8-bit, output.pfm and output.exr\n"
+					 "  keep the unclamped radiance; shm:<name> and output.fb are shared\n"
+					 "  memory another process can read tiles from as they finish\n"
+					 "  (see SharedFrame.h)\n" );
 #endif
 }
 
-bool processArgs(int argc, char **argv) {
+static bool tileOrderNamed(const char *name, RayTracer::TileOrder& order)
+{
+	if ( strcmp( name, "rows" ) == 0 )
+		order = RayTracer::TILES_ROWS;
+	else if ( strcmp( name, "spiral" ) == 0 )
+		order = RayTracer::TILES_SPIRAL;
+	else if ( strcmp( name, "cost" ) == 0 )
+		order = RayTracer::TILES_COST;
+	else
+		return false;
+	return true;
+}
+
+// Takes the long options out of argv and leaves argc counting what is left.
+bool processArgs(int& argc, char **argv) {
 	int i;
 
-    while ( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+	// getopt only knows single letters, so long options are taken out
+	// first
+	int kept = 1;
+	for ( i = 1; i < argc; ++i ) {
+		if ( strcmp( argv[i], "--resume" ) == 0 )
+			bResume = true;
+		else if ( strcmp( argv[i], "--wavefront" ) == 0 )
+			bWavefront = true;
+		else if ( strcmp( argv[i], "--time-budget" ) == 0 ) {
+			if ( ++i == argc || (g_timeBudget = atof( argv[i] )) <= 0.0 )
+				return false;
+		} else if ( strncmp( argv[i], "--time-budget=", 14 ) == 0 ) {
+			if ( (g_timeBudget = atof( argv[i] + 14 )) <= 0.0 )
+				return false;
+		} else if ( strcmp( argv[i], "--deadline" ) == 0 ) {
+			if ( ++i == argc || (g_deadline = atof( argv[i] )) <= 0.0 )
+				return false;
+		} else if ( strncmp( argv[i], "--deadline=", 11 ) == 0 ) {
+			if ( (g_deadline = atof( argv[i] + 11 )) <= 0.0 )
+				return false;
+		} else if ( strcmp( argv[i], "--tile-order" ) == 0 ) {
+			if ( ++i == argc || !tileOrderNamed( argv[i], g_tileOrder ) )
+				return false;
+		} else if ( strncmp( argv[i], "--tile-order=", 13 ) == 0 ) {
+			if ( !tileOrderNamed( argv[i] + 13, g_tileOrder ) )
+				return false;
+		} else if ( strcmp( argv[i], "--perf" ) == 0 )
+			bPerf = true;
+		else if ( strncmp( argv[i], "--perf=", 7 ) == 0 ) {
+			bPerf = true;
+			g_perfJson = argv[i] + 7;
+		} else if ( strcmp( argv[i], "--focus" ) == 0 ) {
+			if ( ++i == argc || sscanf( argv[i], "%d,%d", &g_focus[0], &g_focus[1] ) != 2 )
+				return false;
+			bFocus = true;
+		} else if ( strncmp( argv[i], "--focus=", 8 ) == 0 ) {
+			if ( sscanf( argv[i] + 8, "%d,%d", &g_focus[0], &g_focus[1] ) != 2 )
+				return false;
+			bFocus = true;
+		} else
+			argv[kept++] = argv[i];
+	}
+	argc = kept;
+
+    while ( (i = getopt( argc, argv, "tr:w:h:e:g:mn:sc:xb:Waf:j:S:N:R:T:Mk:" )) != EOF )
 	{
 		switch ( i )
 		{
@@ -124,11 +275,115 @@ bool processArgs(int argc, char **argv) {
 			g_height = atoi( optarg );
 			break;
 
+			case 'e':
+			g_toneMap.exposure = atof( optarg );
+			break;
+
+			case 'g':
+			g_toneMap.gamma = atof( optarg );
+			break;
+
+			case 'm':
+			g_toneMap.reinhard = true;
+			break;
+
+			case 'n':
+			g_threads = atoi( optarg );
+			break;
+
+			case 's':
+			bStream = true;
+			break;
+
+			case 'c':
+			g_textureCacheMB = atoi( optarg );
+			break;
+
+			case 'x':
+			bConvertTexture = true;
+			break;
+
+			case 'b':
+			g_background = optarg;
+			break;
+
+			case 'W':
+			bWatch = true;
+			break;
+
+			case 'a':
+			bSequence = true;
+			break;
+
+			case 'f':
+			{
+				bSequence = true;
+				bFrameRange = true;
+				g_firstFrame = g_lastFrame = atoi( optarg );
+				const char *dash = strchr( optarg + 1, '-' );
+				if ( dash )
+					g_lastFrame = atoi( dash + 1 );
+			}
+			break;
+
+			case 'j':
+			g_frameJobs = atoi( optarg );
+			break;
+
+			case 'S':
+			g_socket = optarg;
+			break;
+
+			case 'N':
+			g_sceneCache = atoi( optarg );
+			break;
+
+			case 'R':
+			bCrop = sscanf( optarg, "%d,%d,%d,%d", &g_crop[0], &g_crop[1], &g_crop[2], &g_crop[3] ) == 4;
+			if ( !bCrop )
+				return false;
+			break;
+
+			case 'T':
+			{
+				bTiles = true;
+				g_firstTile = g_lastTile = atoi( optarg );
+				const char *dash = strchr( optarg + 1, '-' );
+				if ( dash )
+					g_lastTile = atoi( dash + 1 );
+			}
+			break;
+
+			case 'M':
+			bMerge = true;
+			break;
+
+			case 'k':
+			g_checkpoint = atof( optarg );
+			if ( g_checkpoint <= 0.0 )
+				return false;
+			break;
+
 			default:
 			return false;
 		}
     }
 
+	// passes add samples anywhere in the window, not tile by tile
+	if ( g_timeBudget > 0.0 && bTiles )
+		return false;
+
+	// a focus is where a spiral starts
+	if ( bFocus ) {
+		if ( g_tileOrder == RayTracer::TILES_COST )
+			return false;
+		g_tileOrder = RayTracer::TILES_SPIRAL;
+	}
+
+	// the server gets its scenes from its clients
+	if ( g_socket )
+		return true;
+
     if ( optind >= argc-1 )
     {
 		fprintf( stderr, "no input and/or output name.\n" );
@@ -141,6 +396,358 @@ bool processArgs(int argc, char **argv) {
 	return true;
 }
 
+// Clear the last render's stop and start the clock on --deadline.  The
+// first Ctrl-C stops the render as the deadline would, so what is done is
+// still written; a second one kills.
+static void startRender()
+{
+	g_cancel.reset();
+	g_cancel.setDeadline(g_deadline);
+	g_cancel.cancelOnInterrupt();
+}
+
+// The tile order from the options; the image size has to be known.
+static void setTileOrder(RayTracer *rt)
+{
+	rt->setTileOrder(g_tileOrder);
+	if (bFocus)
+		rt->setTileFocus((g_focus[0] + 0.5) / g_width, (g_focus[1] + 0.5) / g_height);
+}
+
+// Render rt's scene into shared memory, or a mapped file, that another
+// process reads tiles from as they are finished.
+static bool renderShared(RayTracer *rt, char *fn, int nThreads, int firstThread)
+{
+	SharedFrame shared;
+	std::string error;
+	if (!shared.open(fn, g_width, g_height, error)) {
+		fprintf( stderr, "%s\n", error.c_str() );
+		return false;
+	}
+
+	rt->setBufferMemory(shared.pixels());
+	rt->setTileListener(&shared);
+	bool ok = rt->traceImage(nThreads, NULL, firstThread);
+	rt->setTileListener(NULL);
+	rt->setBufferMemory(NULL);
+	shared.finish(ok);
+	return ok;
+}
+
+// Render rt's scene and write it to fn.
+static bool renderImage(RayTracer *rt, char *fn, int nThreads, int firstThread = 0)
+{
+	if (SharedFrame::isSharedName(fn))
+		return renderShared(rt, fn, nThreads, firstThread);
+
+	ImageWriter *out = bStream ? ImageWriter::create(fn) : NULL;
+	bool ok;
+	if (out) {
+		// the image goes to disk tile band by tile band
+		ok = out->open(fn, g_width, g_height);
+		if (ok) {
+			ok = rt->traceImage(nThreads, out, firstThread);
+			if (!out->close())
+				ok = false;
+		}
+		delete out;
+	} else {
+		rt->traceImage(nThreads, NULL, firstThread);
+
+		// save image
+		ok = rt->saveImage(fn);
+	}
+
+	if (rt->isCancelled())
+		fprintf( stderr, "stopped before %s was finished\n", fn );
+	else if (!ok)
+		fprintf( stderr, "couldn't write %s\n", fn );
+	return ok && !rt->isCancelled();
+}
+
+static void reportTime(double t)
+{
+#ifdef WIN32
+	fl_message( "total time = %.3f seconds\n", t); 
+#else
+	fprintf( stderr, "total time = %.3f seconds\n", t); 
+#endif
+	RenderStats::total().print( stderr );
+}
+
+// The counters of --perf: a table, and JSON if a file was given.
+static void reportPerf()
+{
+	PerfCounters::print( stderr );
+	if (!g_perfJson)
+		return;
+	FILE *fp = strcmp(g_perfJson, "-") == 0 ? stdout : fopen(g_perfJson, "w");
+	if (!fp) {
+		fprintf( stderr, "couldn't write %s\n", g_perfJson );
+		return;
+	}
+	PerfCounters::writeJson(fp);
+	if (fp != stdout)
+		fclose(fp);
+}
+
+static time_t modificationTime(const char *fn);
+
+// What a checkpoint depends on besides the tile grid: a checkpoint from
+// another scene file, an edited one or other options isn't resumed.
+static std::string checkpointSettings()
+{
+	struct stat st;
+	if (stat(rayName, &st) != 0)
+		st.st_size = 0;
+	char text[1024];
+	sprintf(text, "%s %ld %ld size %dx%d depth %d", rayName, (long)modificationTime(rayName),
+		(long)st.st_size, g_width, g_height, recursion_depth);
+	std::string settings(text);
+	if (g_background)
+		settings += std::string(" background ") + g_background;
+	if (bCrop) {
+		sprintf(text, " crop %d,%d,%d,%d", g_crop[0], g_crop[1], g_crop[2], g_crop[3]);
+		settings += text;
+	}
+	if (bTiles) {
+		sprintf(text, " tiles %d-%d", g_firstTile, g_lastTile);
+		settings += text;
+	}
+	return settings;
+}
+
+// Set up checkpoints for an image rendered whole, and with --resume take
+// the tiles the last run finished.
+static void prepareCheckpoint()
+{
+	if ((!g_checkpoint && !bResume) || (bStream && !bCrop && !bTiles))
+		return;
+
+	std::string fn = std::string(imgName) + ".ckpt";
+	theRayTracer->setCheckpoint(fn, g_checkpoint ? g_checkpoint : 60.0, checkpointSettings());
+	if (!bResume)
+		return;
+
+	// only the first image of a run is resumed
+	bResume = false;
+	std::string error;
+	if (!theRayTracer->resume(error))
+		fprintf( stderr, "%s, rendering all of it\n", error.c_str() );
+}
+
+// Render the loaded scene to imgName, or the part of it asked for to a
+// piece for merging.  False if it couldn't be written or was stopped
+// short.
+static bool renderFrame()
+{
+	bool ok;
+	// wall clock time, the render threads overlap
+	std::chrono::steady_clock::time_point start, end;
+	RenderStats::reset();
+	start=std::chrono::steady_clock::now();
+	startRender();
+
+	if (g_timeBudget > 0.0) {
+		if (bCrop)
+			theRayTracer->setCrop(g_crop[0], g_height - g_crop[3], g_crop[2], g_height - g_crop[1]);
+		long samples;
+		int passes = theRayTracer->traceProgressive(g_threads, g_timeBudget, 0, &samples);
+		ok = bCrop ? theRayTracer->savePartial(imgName, rayName) : theRayTracer->saveImage(imgName);
+		if (!ok)
+			fprintf( stderr, "couldn't write %s\n", imgName );
+		if (bReport)
+			fprintf( stderr, "%d passes, %ld samples\n", passes, samples );
+	} else if (bCrop || bTiles) {
+		// rows are counted from the bottom in the ray tracer
+		if (bCrop)
+			theRayTracer->setCrop(g_crop[0], g_height - g_crop[3], g_crop[2], g_height - g_crop[1]);
+		if (bTiles)
+			theRayTracer->setTileRange(g_firstTile, g_lastTile);
+		prepareCheckpoint();
+		ok = theRayTracer->traceImage(g_threads);
+		if (!theRayTracer->savePartial(imgName, rayName)) {
+			fprintf( stderr, "couldn't write %s\n", imgName );
+			ok = false;
+		}
+	} else {
+		prepareCheckpoint();
+		ok = renderImage(theRayTracer, imgName, g_threads);
+	}
+
+	end=std::chrono::steady_clock::now();
+
+	if (bReport)
+		reportTime(std::chrono::duration<double>(end-start).count());
+	if (theRayTracer->isCancelled())
+		ok = false;
+	return ok;
+}
+
+// The output name for a frame: the last run of #s in the pattern replaced
+// by the frame number, zero padded to its length.  Without one, the
+// number goes in front of the extension.
+static std::string frameFileName(const char *pattern, int frame)
+{
+	std::string name(pattern);
+	std::string::size_type end = name.find_last_of('#');
+	std::string::size_type begin = end;
+	if (end == std::string::npos) {
+		std::string::size_type slash = name.find_last_of("/\\");
+		std::string::size_type dot = name.find_last_of('.');
+		if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+			dot = name.size();
+		name.insert(dot, ".####");
+		begin = dot + 1;
+		end = dot + 4;
+	} else {
+		while (begin > 0 && name[begin - 1] == '#')
+			--begin;
+	}
+
+	char number[32];
+	sprintf(number, "%0*d", (int)(end - begin + 1), frame);
+	return name.replace(begin, end - begin + 1, number);
+}
+
+// One job of a sequence render: frames from next until last.
+static void renderFrames(RayTracer *rt, int nThreads, int firstThread, int last,
+	std::atomic<int> *next, std::atomic<int> *failed)
+{
+	// a stopped sequence starts no more frames
+	for (int f; !rt->isCancelled() && (f = (*next)++) <= last; ) {
+		std::chrono::steady_clock::time_point t0, t1, t2;
+		t0=std::chrono::steady_clock::now();
+		rt->setFrame(f);
+		rt->traceSetup(g_width, g_height);
+		t1=std::chrono::steady_clock::now();
+
+		std::string name = frameFileName(imgName, f);
+		std::vector<char> fn(name.begin(), name.end());
+		fn.push_back('\0');
+		if (!renderImage(rt, &fn[0], nThreads, firstThread))
+			++*failed;
+		t2=std::chrono::steady_clock::now();
+
+		if (bReport)
+			fprintf( stderr, "frame %d: %s, pose and refit %.3f ms, render %.3f seconds\n",
+				f, name.c_str(), 1000.0 * std::chrono::duration<double>(t1-t0).count(),
+				std::chrono::duration<double>(t2-t1).count() );
+	}
+}
+
+// Render the frames one scene at a time per job, each job posing its own
+// copy of the scene and refitting its BVH between frames.  Jobs take the
+// next frame from a shared counter and split the threads between them.
+// False if a frame failed or the sequence was stopped.
+static bool renderSequence()
+{
+	int first, last;
+	if (!theRayTracer->frameRange(first, last) && !bFrameRange) {
+		fprintf( stderr, "%s has no animation\n", rayName );
+		return false;
+	}
+	if (bFrameRange) {
+		first = g_firstFrame;
+		last = g_lastFrame;
+	}
+
+	int frames = last - first + 1;
+	int threads = g_threads < MAX_RENDER_THREADS ? g_threads : MAX_RENDER_THREADS;
+	int jobs = g_frameJobs;
+	if (jobs > frames)
+		jobs = frames;
+	if (jobs > threads)
+		jobs = threads;
+	if (jobs < 1)
+		jobs = 1;
+	int threadsPerJob = threads / jobs;
+
+	// every job but the first parses the scene again
+	std::vector<RayTracer *> tracers(1, theRayTracer);
+	for (int k = 1; k < jobs; ++k) {
+		RayTracer *rt = new RayTracer();
+		if (g_background)
+			rt->loadBackground(g_background);
+		if (!rt->loadScene(rayName)) {
+			fprintf( stderr, "%s\n", rt->getLoadError().c_str() );
+			delete rt;
+			break;
+		}
+		rt->setToneMap(g_toneMap);
+		rt->setDepth(recursion_depth);
+		rt->setWavefront(bWavefront);
+		setTileOrder(rt);
+		rt->setCancelToken(&g_cancel);
+		tracers.push_back(rt);
+	}
+	jobs = (int)tracers.size();
+
+	std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+	RenderStats::reset();
+	// the deadline is for the whole sequence
+	startRender();
+
+	std::atomic<int> next(first);
+	std::atomic<int> failed(0);
+	std::vector<std::thread> workers;
+	for (int k = 0; k < jobs; ++k)
+		workers.push_back(std::thread(renderFrames, tracers[k], threadsPerJob, k * threadsPerJob,
+			last, &next, &failed));
+	for (int k = 0; k < jobs; ++k)
+		workers[k].join();
+
+	for (int k = 1; k < jobs; ++k)
+		delete tracers[k];
+
+	if (bReport) {
+		fprintf( stderr, "%d frames, %d failed, %d at a time\n", frames, (int)failed, jobs );
+		reportTime(std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count());
+	}
+	return failed == 0 && !g_cancel.stopped();
+}
+
+static time_t modificationTime(const char *fn)
+{
+	struct stat st;
+	if (stat(fn, &st) != 0)
+		return 0;
+	return st.st_mtime;
+}
+
+// Poll the scene file and render again each time it is saved.  Runs until
+// the process is killed.
+static void watchScene()
+{
+	time_t seen = modificationTime(rayName);
+	for (;;) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(250));
+		time_t now = modificationTime(rayName);
+		if (now == seen || now == 0)
+			continue;
+		seen = now;
+
+		std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+		Scene::Update u;
+		if (!theRayTracer->reloadScene(rayName, &u)) {
+			fprintf( stderr, "couldn't reload %s, keeping the last scene: %s\n",
+				rayName, theRayTracer->getLoadError().c_str() );
+			continue;
+		}
+		// only the ray setup depends on the camera, the buffers stay
+		theRayTracer->traceSetup(g_width, g_height);
+		double t=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+		fprintf( stderr, "reloaded %s in %.3f seconds: %d kept, %d moved, %d replaced, %s\n",
+			rayName, t, u.kept, u.moved, u.replaced, u.rebuilt ? "BVH rebuilt" : (u.moved ? "BVH refit" : "BVH kept") );
+
+		renderFrame();
+		if (PerfCounters::enabled()) {
+			reportPerf();
+			PerfCounters::reset();
+		}
+	}
+}
+
 // usage : ray [option] in.ray out.bmp
 // Simply keying in ray will invoke a graphics mode version.
 // Use "ray --help" to see the detailed usage.
@@ -159,39 +766,87 @@ int main(int argc, char **argv) {
 			exit(1);
 		}
 		
+		if (bConvertTexture) {
+			// input and output are texture maps, nothing is rendered
+			TextureMap tex;
+			if (!tex.load(rayName) || !tex.writeTiled(imgName)) {
+				fprintf( stderr, "couldn't convert %s to %s\n", rayName, imgName );
+				exit(1);
+			}
+			return 0;
+		}
+
+		if (bMerge) {
+			// output.bmp piece.part...
+			RayTracer merger;
+			std::string error;
+			long missing;
+			if (!merger.mergePartials(argc - optind - 1, argv + optind + 1, error, missing)) {
+				fprintf( stderr, "%s\n", error.c_str() );
+				exit(1);
+			}
+			if (missing)
+				fprintf( stderr, "%ld pixels weren't in any piece\n", missing );
+			if (!merger.saveImage(argv[optind])) {
+				fprintf( stderr, "couldn't write %s\n", argv[optind] );
+				exit(1);
+			}
+			return missing ? 1 : 0;
+		}
+
+		TextureCache::instance().setBudget((size_t)g_textureCacheMB << 20);
+
+		if (g_threads <= 0)
+			g_threads = std::thread::hardware_concurrency();
+
+		// on before the scene is read, so the parse is counted
+		if (bPerf) {
+			std::string error;
+			if (!PerfCounters::enable(error))
+				fprintf( stderr, "%s\n", error.c_str() );
+		}
+
+		if (g_socket) {
+			RenderServer server(g_threads, g_sceneCache);
+			server.setBackground(g_background);
+			bool ok = server.run(g_socket);
+			if (PerfCounters::enabled())
+				reportPerf();
+			return ok ? 0 : 1;
+		}
+
 		theRayTracer=new RayTracer();
-		theRayTracer->loadScene(rayName);
+		if (g_background && !theRayTracer->loadBackground(g_background)) {
+			fprintf( stderr, "couldn't read background %s\n", g_background );
+			exit(1);
+		}
+		if (!theRayTracer->loadScene(rayName))
+			fprintf( stderr, "%s\n", theRayTracer->getLoadError().c_str() );
 	
+		bool ok = false;
 		if (theRayTracer->sceneLoaded()) {
 			g_height = (int)(g_width / theRayTracer->aspectRatio() + 0.5);
 
 			theRayTracer->traceSetup(g_width, g_height);
-		
-			clock_t start, end;
-			start=clock();
-
-			theRayTracer->traceLines(0, g_height);
-		
-			end=clock();
+			theRayTracer->setToneMap(g_toneMap);
+			theRayTracer->setDepth(recursion_depth);
+			theRayTracer->setWavefront(bWavefront);
+			setTileOrder(theRayTracer);
+			theRayTracer->setCancelToken(&g_cancel);
 
-			// save image
-			unsigned char* buf;
-
-			theRayTracer->getBuffer(buf, g_width, g_height);
-			if (buf)
-				writeBMP(imgName, g_width, g_height, buf); 
-
-			if (bReport) {
-				double t=(double)(end-start)/CLOCKS_PER_SEC;
-#ifdef WIN32
-				fl_message( "total time = %.3f seconds\n", t); 
-#else
-				fprintf( stderr, "total time = %.3f seconds\n", t); 
-#endif
+			if (bSequence)
+				ok = renderSequence();
+			else
+				ok = renderFrame();
+			if (PerfCounters::enabled()) {
+				reportPerf();
+				PerfCounters::reset();
 			}
+			if (bWatch && !bSequence)
+				watchScene();
 		}
 
-		return 1;
+		return ok ? 0 : 1;
 	} else {
 		// graphics mode
 		traceUI=new TraceUI();
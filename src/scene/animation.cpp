@@ -0,0 +1,160 @@
+#include <cmath>
+
+#include "animation.h"
+#include "camera.h"
+#include "scene.h"
+
+void Track::add( double frame, const vec4f& value )
+{
+	Key k;
+	k.frame = frame;
+	k.value = value;
+
+	// keys usually come in order, so this is an append
+	std::vector<Key>::iterator pos = keys.end();
+	while( pos != keys.begin() && (pos - 1)->frame > frame )
+		--pos;
+	keys.insert( pos, k );
+}
+
+vec4f Track::at( double frame ) const
+{
+	if( frame <= keys.front().frame )
+		return keys.front().value;
+	if( frame >= keys.back().frame )
+		return keys.back().value;
+
+	size_t k = 1;
+	while( keys[k].frame < frame )
+		++k;
+
+	const Key& a = keys[k - 1];
+	const Key& b = keys[k];
+	double t = (frame - a.frame) / (b.frame - a.frame);
+	return a.value + t * (b.value - a.value);
+}
+
+static void grow( const Track& t, double& first, double& last )
+{
+	if( t.empty() )
+		return;
+	if( t.firstFrame() < first ) first = t.firstFrame();
+	if( t.lastFrame() > last ) last = t.lastFrame();
+}
+
+mat4f TransformAnimation::at( double frame ) const
+{
+	mat4f m;
+	if( !translate.empty() )
+		m = mat4f::translate( vec3f( translate.at( frame ) ) );
+	if( !rotate.empty() ) {
+		vec4f r = rotate.at( frame );
+		m = m * mat4f::rotate( vec3f( r ), r[3] );
+	}
+	if( !scale.empty() )
+		m = m * mat4f::scale( vec3f( scale.at( frame ) ) );
+	return m;
+}
+
+void TransformAnimation::apply( double frame ) const
+{
+	node->setLocal( at( frame ) );
+}
+
+void TransformAnimation::extent( double& first, double& last ) const
+{
+	grow( translate, first, last );
+	grow( rotate, first, last );
+	grow( scale, first, last );
+}
+
+CameraAnimation::CameraAnimation( const vec3f& v, const vec3f& u )
+	: baseViewdir( v ), baseUpdir( u )
+{
+}
+
+void CameraAnimation::apply( double frame, Camera& camera ) const
+{
+	if( !position.empty() )
+		camera.setEye( vec3f( position.at( frame ) ) );
+	if( !viewdir.empty() || !updir.empty() ) {
+		vec3f v = viewdir.empty() ? baseViewdir : vec3f( viewdir.at( frame ) );
+		vec3f u = updir.empty() ? baseUpdir : vec3f( updir.at( frame ) );
+		camera.setLook( v.normalize(), u.normalize() );
+	}
+	if( !fov.empty() )
+		camera.setFOV( fov.at( frame )[0] );
+}
+
+void CameraAnimation::extent( double& first, double& last ) const
+{
+	grow( position, first, last );
+	grow( viewdir, first, last );
+	grow( updir, first, last );
+	grow( fov, first, last );
+}
+
+Animation::Animation()
+	: camera( NULL ), hasRange( false ), first( 0 ), last( 0 )
+{
+}
+
+Animation::~Animation()
+{
+	for( size_t k = 0; k < transforms.size(); ++k )
+		delete transforms[k];
+	delete camera;
+}
+
+void Animation::setRange( int f, int l )
+{
+	hasRange = true;
+	first = f;
+	last = l;
+}
+
+void Animation::setCamera( CameraAnimation *c )
+{
+	delete camera;
+	camera = c;
+}
+
+void Animation::extent( double& f, double& l ) const
+{
+	f = 1.0e308;
+	l = -1.0e308;
+	for( size_t k = 0; k < transforms.size(); ++k )
+		transforms[k]->extent( f, l );
+	if( camera )
+		camera->extent( f, l );
+	if( f > l )
+		f = l = 0.0;
+}
+
+int Animation::firstFrame() const
+{
+	if( hasRange )
+		return first;
+	double f, l;
+	extent( f, l );
+	return (int)floor( f );
+}
+
+int Animation::lastFrame() const
+{
+	if( hasRange )
+		return last;
+	double f, l;
+	extent( f, l );
+	return (int)ceil( l );
+}
+
+void Animation::apply( double frame, Camera& cam ) const
+{
+	// a node passes its change on to everything below it, so the order
+	// doesn't matter
+	for( size_t k = 0; k < transforms.size(); ++k )
+		transforms[k]->apply( frame );
+	if( camera )
+		camera->apply( frame, cam );
+}
@@ -0,0 +1,113 @@
+#ifndef __ANIMATION_H__
+#define __ANIMATION_H__
+
+// Keyframed channels for rendering a sequence from one loaded scene.  A
+// channel is a list of (frame, value) keys, interpolated linearly and held
+// at its first and last values outside them.  Transforms get translate,
+// rotate (axis and angle, as in rotate()) and scale channels, composed as
+// translate * rotate * scale; the camera gets position, viewdir, updir and
+// fov.  Channels without keys keep the value the file gave the node.
+//
+// Setting a frame only changes transform matrices and the camera, so the
+// objects, their materials and the BVH's tree all stay; the scene refits
+// its boxes afterwards (see Scene::setFrame()).
+
+#include <vector>
+
+#include "../vecmath/vecmath.h"
+
+class Camera;
+class TransformNode;
+
+class Track
+{
+public:
+	Track() {}
+
+	void add( double frame, const vec4f& value );
+	bool empty() const { return keys.empty(); }
+	double firstFrame() const { return keys.front().frame; }
+	double lastFrame() const { return keys.back().frame; }
+
+	vec4f at( double frame ) const;
+
+private:
+	struct Key
+	{
+		double frame;
+		vec4f value;
+	};
+	std::vector<Key> keys;		// sorted by frame
+};
+
+class TransformAnimation
+{
+public:
+	TransformAnimation( TransformNode *n ) : node( n ) {}
+
+	Track translate;	// x, y, z
+	Track rotate;		// axis x, y, z and angle in radians
+	Track scale;		// x, y, z
+
+	mat4f at( double frame ) const;
+	void apply( double frame ) const;
+
+	bool empty() const { return translate.empty() && rotate.empty() && scale.empty(); }
+	void extent( double& first, double& last ) const;
+
+private:
+	TransformNode *node;
+};
+
+class CameraAnimation
+{
+public:
+	// setLook() needs both directions, so when only one of them has keys
+	// the other is taken from here, normally the camera block's own.
+	CameraAnimation( const vec3f& viewdir, const vec3f& updir );
+
+	Track position;
+	Track viewdir;
+	Track updir;
+	Track fov;			// degrees
+
+	void apply( double frame, Camera& camera ) const;
+
+	bool empty() const
+	{ return position.empty() && viewdir.empty() && updir.empty() && fov.empty(); }
+	void extent( double& first, double& last ) const;
+
+private:
+	vec3f baseViewdir, baseUpdir;
+};
+
+class Animation
+{
+public:
+	Animation();
+	~Animation();
+
+	// The frames to render; by default from the first key to the last.
+	void setRange( int first, int last );
+	int firstFrame() const;
+	int lastFrame() const;
+
+	void add( TransformAnimation *t ) { transforms.push_back( t ); }
+	void setCamera( CameraAnimation *c );
+
+	// Move every animated transform, and the camera, to the given frame.
+	void apply( double frame, Camera& camera ) const;
+
+private:
+	void extent( double& first, double& last ) const;
+
+	std::vector<TransformAnimation*> transforms;
+	CameraAnimation *camera;
+	bool hasRange;
+	int first, last;
+
+	Animation( const Animation& );
+	Animation& operator =( const Animation& );
+};
+
+#endif // __ANIMATION_H__
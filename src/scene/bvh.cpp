@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <climits>
+
+#include "bvh.h"
+
+// Sort key for splitting: twice the center of an object's box on one axis.
+struct CenterLess
+{
+	int axis;
+	bool operator ()( const Geometry *a, const Geometry *b ) const
+	{
+		const BoundingBox& ba = a->getBoundingBox();
+		const BoundingBox& bb = b->getBoundingBox();
+		return ba.min[axis] + ba.max[axis] < bb.min[axis] + bb.max[axis];
+	}
+};
+
+struct PrimCenterLess
+{
+	CenterLess less;
+	template <class P> bool operator ()( const P& a, const P& b ) const
+	{ return less( a.obj, b.obj ); }
+};
+
+void BVH::clear()
+{
+	nodes.clear();
+	prims.clear();
+}
+
+void BVH::build( const list<Geometry*>& objects )
+{
+	clear();
+	int order = 0;
+	for( list<Geometry*>::const_iterator j = objects.begin(); j != objects.end(); ++j ) {
+		Prim p;
+		p.obj = *j;
+		p.order = order++;
+		prims.push_back( p );
+	}
+
+	if( !prims.empty() ) {
+		nodes.reserve( 2 * prims.size() / MAX_LEAF_SIZE + 1 );
+		buildRange( 0, (int)prims.size() );
+	}
+}
+
+void BVH::boundRange( int begin, int end, BoundingBox& box ) const
+{
+	box = prims[begin].obj->getBoundingBox();
+	for( int k = begin + 1; k < end; ++k ) {
+		const BoundingBox& b = prims[k].obj->getBoundingBox();
+		box.min = minimum( box.min, b.min );
+		box.max = maximum( box.max, b.max );
+	}
+}
+
+// Split at the median along the axis where the object centers spread the
+// most.  Returns the index of the node made for [begin,end).
+int BVH::buildRange( int begin, int end )
+{
+	int index = (int)nodes.size();
+	nodes.push_back( Node() );
+	boundRange( begin, end, nodes[index].box );
+	nodes[index].count = 0;
+
+	vec3f lo, hi;
+	if( end - begin > MAX_LEAF_SIZE ) {
+		const BoundingBox& b = prims[begin].obj->getBoundingBox();
+		lo = hi = b.min + b.max;
+		for( int k = begin + 1; k < end; ++k ) {
+			const BoundingBox& bk = prims[k].obj->getBoundingBox();
+			lo = minimum( lo, bk.min + bk.max );
+			hi = maximum( hi, bk.max + bk.min );
+		}
+	}
+
+	vec3f spread = hi - lo;
+	int axis = 0;
+	if( spread[1] > spread[axis] ) axis = 1;
+	if( spread[2] > spread[axis] ) axis = 2;
+
+	// few objects, or all centered on the same point: a leaf
+	if( end - begin <= MAX_LEAF_SIZE || spread[axis] <= 0.0 ) {
+		nodes[index].first = begin;
+		nodes[index].count = end - begin;
+		return index;
+	}
+
+	int mid = (begin + end) / 2;
+	PrimCenterLess less;
+	less.less.axis = axis;
+	std::nth_element( prims.begin() + begin, prims.begin() + mid, prims.begin() + end, less );
+
+	buildRange( begin, mid );
+	int second = buildRange( mid, end );
+	nodes[index].second = second;
+	return index;
+}
+
+void BVH::refit()
+{
+	// children always come after their parent
+	for( int n = (int)nodes.size() - 1; n >= 0; --n ) {
+		Node& node = nodes[n];
+		if( node.count ) {
+			boundRange( node.first, node.first + node.count, node.box );
+		} else {
+			const BoundingBox& a = nodes[n + 1].box;
+			const BoundingBox& b = nodes[node.second].box;
+			node.box.min = minimum( a.min, b.min );
+			node.box.max = maximum( a.max, b.max );
+		}
+	}
+}
+
+// Slab test against a box grown by RAY_EPSILON, so objects lying in a face
+// of their box aren't missed.  An axis the ray is parallel to gives NaNs
+// or infinities; the comparisons are arranged so a NaN is ignored.
+static inline bool hitsBox( const BoundingBox& b, const vec3f& o, const double inv[3], double maxT )
+{
+	double tNear = -1.0e308, tFar = maxT;
+	for( int k = 0; k < 3; ++k ) {
+		double t1 = (b.min[k] - RAY_EPSILON - o[k]) * inv[k];
+		double t2 = (b.max[k] + RAY_EPSILON - o[k]) * inv[k];
+		if( t1 > t2 ) {
+			double t = t1;
+			t1 = t2;
+			t2 = t;
+		}
+		if( t1 > tNear ) tNear = t1;
+		if( t2 < tFar ) tFar = t2;
+	}
+	return tNear <= tFar && tFar >= 0.0;
+}
+
+bool BVH::intersect( const ray& r, isect& i, double maxT ) const
+{
+	if( nodes.empty() )
+		return false;
+
+	vec3f o = r.getPosition();
+	vec3f d = r.getDirection();
+	double inv[3] = { 1.0 / d[0], 1.0 / d[1], 1.0 / d[2] };
+
+	double best = maxT;
+	int bestOrder = INT_MAX;
+	bool have_one = false;
+	isect cur;
+
+	int stack[64];
+	int top = 0;
+	int n = 0;
+	for( ;; ) {
+		const Node& node = nodes[n];
+		if( hitsBox( node.box, o, inv, best ) ) {
+			if( !node.count ) {
+				stack[top++] = node.second;
+				++n;
+				continue;
+			}
+
+			for( int k = node.first; k < node.first + node.count; ++k ) {
+				const Prim& p = prims[k];
+				cur.setMaterial( NULL );
+				if( p.obj->intersect( r, cur )
+					&& (cur.t < best || (cur.t == best && p.order < bestOrder)) ) {
+					i = cur;
+					best = cur.t;
+					bestOrder = p.order;
+					have_one = true;
+				}
+			}
+		}
+
+		if( top == 0 )
+			break;
+		n = stack[--top];
+	}
+
+	return have_one;
+}
+
+bool BVH::occluded( const ray& r, double maxT ) const
+{
+	if( nodes.empty() )
+		return false;
+
+	vec3f o = r.getPosition();
+	vec3f d = r.getDirection();
+	double inv[3] = { 1.0 / d[0], 1.0 / d[1], 1.0 / d[2] };
+	isect cur;
+
+	int stack[64];
+	int top = 0;
+	int n = 0;
+	for( ;; ) {
+		const Node& node = nodes[n];
+		if( hitsBox( node.box, o, inv, maxT ) ) {
+			if( !node.count ) {
+				stack[top++] = node.second;
+				++n;
+				continue;
+			}
+
+			for( int k = node.first; k < node.first + node.count; ++k ) {
+				cur.setMaterial( NULL );
+				if( prims[k].obj->intersect( r, cur ) && cur.t < maxT )
+					return true;
+			}
+		}
+
+		if( top == 0 )
+			return false;
+		n = stack[--top];
+	}
+}
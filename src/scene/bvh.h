@@ -0,0 +1,61 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+
+// A bounding volume hierarchy over the scene's bounded objects, so a ray
+// only tests the objects whose boxes it passes through instead of every
+// one.  Nodes are stored depth first in one array: a node's first child
+// follows it directly and the second is at an index it records.
+//
+// When objects only move, refit() recomputes the boxes bottom up and
+// keeps the tree; that is much cheaper than building it again, and good
+// enough as long as things don't move far.
+
+#include <vector>
+
+#include "scene.h"
+
+class BVH
+{
+public:
+	BVH() {}
+
+	// Build over the objects in list order; ties between hits at the same
+	// distance go to the object that came first, as in a linear search.
+	void build( const list<Geometry*>& objects );
+	void clear();
+
+	// Recompute every box from the objects' current bounding boxes.
+	void refit();
+
+	bool empty() const { return nodes.empty(); }
+
+	// Closest hit closer than maxT, if any.
+	bool intersect( const ray& r, isect& i, double maxT = 1.0e308 ) const;
+	// Any hit closer than maxT; stops at the first one found.
+	bool occluded( const ray& r, double maxT = 1.0e308 ) const;
+
+	enum { MAX_LEAF_SIZE = 4 };
+
+private:
+	struct Node
+	{
+		BoundingBox box;
+		int first;		// leaf: first entry in prims
+		int count;		// leaf: number of prims; 0 for an inner node
+		int second;		// inner node: index of the second child
+	};
+
+	struct Prim
+	{
+		Geometry *obj;
+		int order;		// position in the scene's object list
+	};
+
+	int buildRange( int begin, int end );
+	void boundRange( int begin, int end, BoundingBox& box ) const;
+
+	std::vector<Node> nodes;
+	std::vector<Prim> prims;
+};
+
+#endif // __BVH_H__
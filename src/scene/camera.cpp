@@ -25,6 +25,25 @@ Camera::rayThrough( double x, double y, ray &r )
     r = ray( eye, dir.normalize(), r.type() );
 }
 
+void
+Camera::rayThrough( double x, double y, double dx, double dy, ray &r )
+// The same ray, plus how its direction changes when x moves by dx and y
+// by dy.  All rays start at the eye, so the origin doesn't change.
+{
+    x -= 0.5;
+    y -= 0.5;
+    vec3f dir = look + x * u + y * v;
+    double len = dir.length();
+    vec3f d = dir / len;
+
+    // derivative of dir/|dir|: the step minus its component along d
+    vec3f sx = (dx / len) * u;
+    vec3f sy = (dy / len) * v;
+    r = ray( eye, d, r.type() );
+    r.setDifferentials( vec3f( 0.0, 0.0, 0.0 ), sx - (sx * d) * d,
+                        vec3f( 0.0, 0.0, 0.0 ), sy - (sy * d) * d );
+}
+
 void
 Camera::setEye( const vec3f &eye )
 {
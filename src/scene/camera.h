@@ -8,6 +8,8 @@ class Camera
 public:
     Camera();
     void rayThrough( double x, double y, ray &r );
+    // ...with differentials for a step of (dx,dy) in window coordinates
+    void rayThrough( double x, double y, double dx, double dy, ray &r );
     void setEye( const vec3f &eye );
     void setLook( double, double, double, double );
     void setLook( const vec3f &viewDir, const vec3f &upDir );
@@ -15,6 +17,10 @@ public:
     void setAspectRatio( double );
 
     double getAspectRatio() { return aspectRatio; }
+
+    // True if both cameras send out the same primary rays.
+    bool sameRays( const Camera& other ) const
+    { return eye == other.eye && look == other.look && u == other.u && v == other.v; }
 private:
     mat3f m;                     // rotation matrix
     double normalizedHeight;    // dimensions of image place at unit dist from eye
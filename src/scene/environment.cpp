@@ -0,0 +1,187 @@
+#include <cmath>
+
+#include "environment.h"
+#include "texture.h"
+#include "ray.h"
+
+#define PI 3.14159265358979323846
+
+EnvironmentMap::EnvironmentMap()
+	: cube( false ), scale( 1.0, 1.0, 1.0 )
+{
+	for( int k = 0; k < 6; ++k )
+		maps[k] = NULL;
+}
+
+EnvironmentMap::~EnvironmentMap()
+{
+	clear();
+}
+
+void EnvironmentMap::clear()
+{
+	for( int k = 0; k < 6; ++k ) {
+		delete maps[k];
+		maps[k] = NULL;
+	}
+}
+
+bool EnvironmentMap::loadLatLong( const string& filename )
+{
+	TextureMap *map = new TextureMap;
+	if( !map->load( filename ) ) {
+		delete map;
+		return false;
+	}
+
+	// longitude goes all the way round, latitude stops at the poles
+	map->setClamp( false, true );
+	clear();
+	maps[0] = map;
+	cube = false;
+	return true;
+}
+
+bool EnvironmentMap::loadCube( const string filenames[6] )
+{
+	TextureMap *faces[6];
+	for( int k = 0; k < 6; ++k ) {
+		faces[k] = new TextureMap;
+		if( !faces[k]->load( filenames[k] ) ) {
+			for( int j = 0; j <= k; ++j )
+				delete faces[j];
+			return false;
+		}
+		faces[k]->setClamp( true, true );
+	}
+
+	clear();
+	for( int k = 0; k < 6; ++k )
+		maps[k] = faces[k];
+	cube = true;
+	return true;
+}
+
+// atan2 to about 1e-5 radians: a minimax polynomial on [0,1] and the
+// octant fixed up with selects, so a loop of these has no branches.
+static inline float fastAtan2( float y, float x )
+{
+	float ax = fabsf( x ), ay = fabsf( y );
+	float mx = ax > ay ? ax : ay;
+	float mn = ax > ay ? ay : ax;
+	float a = mn / (mx > 1e-30f ? mx : 1e-30f);
+	float s = a * a;
+	float r = ((-0.0464964749f * s + 0.15931422f) * s - 0.327622764f) * s * a + a;
+	r = ay > ax ? 1.57079637f - r : r;
+	r = x < 0.0f ? 3.14159274f - r : r;
+	return y < 0.0f ? -r : r;
+}
+
+void EnvironmentMap::latLongCoords( int n, const float *x, const float *y, const float *z,
+	float *u, float *v )
+{
+	for( int k = 0; k < n; ++k ) {
+		float rho = sqrtf( x[k] * x[k] + z[k] * z[k] );
+		u[k] = 0.5f + fastAtan2( x[k], -z[k] ) * (float)(0.5 / PI);
+		v[k] = 0.5f + fastAtan2( y[k], rho ) * (float)(1.0 / PI);
+	}
+}
+
+// How each cube face is laid out: the components of the direction along
+// its u and v axes, and along its outward normal (the major axis).
+struct FaceAxes
+{
+	int su, uSign;
+	int sv, vSign;
+	int ma, maSign;
+};
+
+static const FaceAxes s_faces[6] = {
+	{ 2,  1,  1,  1,  0,  1 },		// +x
+	{ 2, -1,  1,  1,  0, -1 },		// -x
+	{ 0,  1,  2,  1,  1,  1 },		// +y
+	{ 0,  1,  2, -1,  1, -1 },		// -y
+	{ 0, -1,  1,  1,  2,  1 },		// +z
+	{ 0,  1,  1,  1,  2, -1 },		// -z
+};
+
+void EnvironmentMap::cubeCoords( int n, const float *x, const float *y, const float *z,
+	int *face, float *u, float *v )
+{
+	for( int k = 0; k < n; ++k ) {
+		float ax = fabsf( x[k] ), ay = fabsf( y[k] ), az = fabsf( z[k] );
+		bool xMajor = ax >= ay && ax >= az;
+		bool yMajor = !xMajor && ay >= az;
+
+		float ma = xMajor ? ax : (yMajor ? ay : az);
+		float sc = xMajor ? (x[k] > 0.0f ? z[k] : -z[k])
+			: (yMajor ? x[k] : (z[k] > 0.0f ? -x[k] : x[k]));
+		float tc = yMajor ? (y[k] > 0.0f ? z[k] : -z[k]) : y[k];
+		face[k] = xMajor ? (x[k] > 0.0f ? 0 : 1)
+			: (yMajor ? (y[k] > 0.0f ? 2 : 3) : (z[k] > 0.0f ? 4 : 5));
+
+		float inv = 1.0f / (ma > 1e-30f ? ma : 1e-30f);
+		u[k] = 0.5f + 0.5f * sc * inv;
+		v[k] = 0.5f + 0.5f * tc * inv;
+	}
+}
+
+vec3f EnvironmentMap::latLongValue( const vec3f& d, const vec3f& dx, const vec3f& dy ) const
+{
+	float x = (float)d[0], y = (float)d[1], z = (float)d[2];
+	float u, v;
+	latLongCoords( 1, &x, &y, &z, &u, &v );
+
+	// derivatives of longitude atan2(x,-z) and latitude atan2(y,rho)
+	double rho2 = d[0] * d[0] + d[2] * d[2];
+	if( rho2 < 1e-12 )
+		rho2 = 1e-12;
+	double rho = sqrt( rho2 );
+	double len2 = rho2 + d[1] * d[1];
+
+	double dudx = (d[0] * dx[2] - d[2] * dx[0]) / rho2 / (2.0 * PI);
+	double dudy = (d[0] * dy[2] - d[2] * dy[0]) / rho2 / (2.0 * PI);
+	double drhodx = (d[0] * dx[0] + d[2] * dx[2]) / rho;
+	double drhody = (d[0] * dy[0] + d[2] * dy[2]) / rho;
+	double dvdx = (rho * dx[1] - d[1] * drhodx) / len2 / PI;
+	double dvdy = (rho * dy[1] - d[1] * drhody) / len2 / PI;
+
+	return maps[0]->sample( u, v, dudx, dvdx, dudy, dvdy );
+}
+
+vec3f EnvironmentMap::cubeValue( const vec3f& d, const vec3f& dx, const vec3f& dy ) const
+{
+	float x = (float)d[0], y = (float)d[1], z = (float)d[2];
+	int face;
+	float u, v;
+	cubeCoords( 1, &x, &y, &z, &face, &u, &v );
+
+	// u = (1 + sc/ma) / 2 differentiated along the pixel steps
+	const FaceAxes& f = s_faces[face];
+	double ma = f.maSign * d[f.ma];
+	double su = f.uSign * d[f.su] / ma, sv = f.vSign * d[f.sv] / ma;
+	double dmadx = f.maSign * dx[f.ma], dmady = f.maSign * dy[f.ma];
+	double dudx = 0.5 * (f.uSign * dx[f.su] - su * dmadx) / ma;
+	double dvdx = 0.5 * (f.vSign * dx[f.sv] - sv * dmadx) / ma;
+	double dudy = 0.5 * (f.uSign * dy[f.su] - su * dmady) / ma;
+	double dvdy = 0.5 * (f.vSign * dy[f.sv] - sv * dmady) / ma;
+
+	return maps[face]->sample( u, v, dudx, dvdx, dudy, dvdy );
+}
+
+vec3f EnvironmentMap::value( const ray& r ) const
+{
+	if( !maps[0] )
+		return vec3f( 0.0, 0.0, 0.0 );
+
+	// without differentials the footprint is a point: a bilinear lookup
+	vec3f dx, dy;
+	if( r.hasDifferentials() ) {
+		dx = r.dDdx();
+		dy = r.dDdy();
+	}
+
+	vec3f c = cube ? cubeValue( r.getDirection(), dx, dy )
+		: latLongValue( r.getDirection(), dx, dy );
+	return prod( c, scale );
+}
@@ -0,0 +1,62 @@
+#ifndef __ENVIRONMENT_H__
+#define __ENVIRONMENT_H__
+
+// What rays that leave the scene see: a latitude-longitude panorama or a
+// cube of six faces, each a TextureMap with its own mip pyramid.  Lookups
+// use the ray's direction differentials as the footprint, so a background
+// pixel or a reflection off a curved mirror is one filtered fetch instead
+// of needing supersampling to converge.
+//
+// The scene's y axis is up and -z is the middle of a lat-long map, which
+// is what the default camera looks at.
+
+#include <string>
+
+#include "../vecmath/vecmath.h"
+
+using std::string;
+
+class ray;
+class TextureMap;
+
+class EnvironmentMap
+{
+public:
+	EnvironmentMap();
+	~EnvironmentMap();
+
+	// Any format TextureMap::load() reads.  Cube faces are given in the
+	// order +x, -x, +y, -y, +z, -z, each as seen from inside with y up
+	// (+z up on the +y face, -z on the -y face), which is how they fold
+	// together from a horizontal cross around -z.
+	bool loadLatLong( const string& filename );
+	bool loadCube( const string filenames[6] );
+
+	// Multiplies every lookup, for maps that are too dark or too bright.
+	void setScale( const vec3f& s ) { scale = s; }
+
+	// Radiance arriving along the ray from infinitely far away.
+	vec3f value( const ray& r ) const;
+
+	// Direction to texture coordinates for n directions at once, stored as
+	// separate x, y, z arrays.  The loops are straight line code with
+	// selects instead of branches so the compiler can vectorize them.
+	static void latLongCoords( int n, const float *x, const float *y, const float *z,
+		float *u, float *v );
+	static void cubeCoords( int n, const float *x, const float *y, const float *z,
+		int *face, float *u, float *v );
+
+private:
+	vec3f latLongValue( const vec3f& d, const vec3f& dx, const vec3f& dy ) const;
+	vec3f cubeValue( const vec3f& d, const vec3f& dx, const vec3f& dy ) const;
+	void clear();
+
+	TextureMap *maps[6];		// maps[0] alone for a lat-long map
+	bool cube;
+	vec3f scale;
+
+	EnvironmentMap( const EnvironmentMap& );
+	EnvironmentMap& operator =( const EnvironmentMap& );
+};
+
+#endif // __ENVIRONMENT_H__
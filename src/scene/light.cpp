@@ -2,6 +2,35 @@
 #include <algorithm>
 
 #include "light.h"
+#include "../RenderStats.h"
+
+void Light::clearOccluderCache()
+{
+	for( int k = 0; k < MAX_RENDER_THREADS; ++k )
+		occluderCache[k].obj = NULL;
+}
+
+// Does the occluder this thread saw last block r before maxT?
+bool Light::cachedOccluderBlocks( const ray& r, double maxT ) const
+{
+	const SceneObject *obj = occluderCache[ renderThreadIndex() ].obj;
+	if( !obj )
+		return false;
+
+	isect i;
+	if( obj->intersect( r, i ) && i.t < maxT && i.getMaterial().kt(i).iszero() ) {
+		RenderStats::local().occluderCacheHits++;
+		return true;
+	}
+
+	RenderStats::local().occluderCacheMisses++;
+	return false;
+}
+
+void Light::cacheOccluder( const SceneObject *obj ) const
+{
+	occluderCache[ renderThreadIndex() ].obj = obj;
+}
 
 double DirectionalLight::distanceAttenuation( const vec3f& P ) const
 {
@@ -18,12 +47,16 @@ vec3f DirectionalLight::shadowAttenuation( const vec3f& P ) const
 	vec3f d = getDirection(P); // direction from the point to be shaded towards the light source
 	vec3f p = P + d * RAY_EPSILON; // point to be shaded
 	ray r = ray(p, d, ray::SHADOW); // from the point of intersection, look at the light
+
+	if (cachedOccluderBlocks(r, 1.0e308))
+		return vec3f(0, 0, 0);
 	
 	isect isecSR; // intersection of the shadow ray
 	vec3f colour = getColor(P); // colour of light source
 
 	while (scene->intersect(r, isecSR)) { // if the ray intersect with an object
 		if (isecSR.getMaterial().kt(isecSR).iszero()) { // if the material of the object is opaque
+			cacheOccluder(isecSR.obj);
 			return vec3f(0, 0, 0); // no shadow if opaque
 		}
 		else { // if transmissive
@@ -115,12 +148,16 @@ vec3f PointLight::shadowAttenuation(const vec3f& P) const
 	vec3f p = P + d * RAY_EPSILON; // point to be shaded
 	ray r = ray(p, d, ray::SHADOW); // from the point of intersection, look at the light
 
+	if (cachedOccluderBlocks(r, (position - p).length()))
+		return vec3f(0, 0, 0);
+
 	isect isecSR;
 	vec3f colour = getColor(P); // colour of light source
 
 	while (scene->intersect(r, isecSR)) // if the ray intersect with an object
 	{
 		if (isecSR.getMaterial().kt(isecSR).iszero()) { // if the material of the object is opaque
+			cacheOccluder(isecSR.obj);
 			return vec3f(0, 0, 0); // no shadow if opaque
 		}
 		else { // if transmissive
@@ -136,10 +173,138 @@ vec3f PointLight::shadowAttenuation(const vec3f& P) const
 				r = ray(p, d, ray::SHADOW);
 			}
 			else // if distanceSq >= lightDistance
-				return colour;
+				break;
 		}
 		
 	}
 
 	return colour;
 }
+
+// Radical inverse of i in the given base; the Halton sequence uses base 2
+// and 3 for its two coordinates.  Any prefix of it is well spread, which is
+// what lets the adaptive test look at only the first few samples.
+static double radicalInverse( int i, int base )
+{
+	double inv = 1.0 / base;
+	double f = inv;
+	double r = 0.0;
+	while( i > 0 ) {
+		r += f * (i % base);
+		i /= base;
+		f *= inv;
+	}
+	return r;
+}
+
+// Cheap deterministic value in [0,1) for a point, used to rotate the sample
+// pattern per shading point (Cranley-Patterson rotation).
+static double hashPoint( const vec3f& P, double salt )
+{
+	double h = sin( P[0] * 12.9898 + P[1] * 78.233 + P[2] * 37.719 + salt ) * 43758.5453;
+	return h - floor( h );
+}
+
+void AreaLight::setSamples( int samples, int adaptive )
+{
+	nSamples = samples < 1 ? 1 : samples;
+	nAdaptive = adaptive < 1 ? 1 : adaptive;
+	if( nAdaptive > nSamples )
+		nAdaptive = nSamples;
+}
+
+vec3f AreaLight::shadowAttenuation( const vec3f& P ) const
+{
+	RenderStats& stats = RenderStats::local();
+	stats.areaLightLookups++;
+
+	double du = hashPoint( P, 0.0 );
+	double dv = hashPoint( P, 1.0 );
+
+	vec3f sum;
+	int taken = 0;
+	int lit = 0;
+	int blocked = 0;
+
+	for( int k = 0; k < nSamples; ++k ) {
+		if( k == nAdaptive && (lit == k || blocked == k) ) {
+			// not in a penumbra, the rest would agree
+			stats.areaLightEarlyOuts++;
+			break;
+		}
+
+		double s = radicalInverse( k + 1, 2 ) + du;
+		double t = radicalInverse( k + 1, 3 ) + dv;
+		if( s >= 1.0 ) s -= 1.0;
+		if( t >= 1.0 ) t -= 1.0;
+
+		vec3f vis = visibility( P, samplePoint( P, s, t ) );
+		if( vis.iszero() )
+			blocked++;
+		else if( vis == vec3f( 1.0, 1.0, 1.0 ) )
+			lit++;
+
+		sum += vis;
+		taken++;
+	}
+
+	stats.areaLightSamples += taken;
+
+	return prod( color, sum / taken );
+}
+
+vec3f AreaLight::visibility( const vec3f& P, const vec3f& Q ) const
+{
+	vec3f d = Q - P;
+	double dist = d.length();
+	if( dist < RAY_EPSILON )
+		return vec3f( 1.0, 1.0, 1.0 );
+	d /= dist;
+
+	vec3f p = P + d * RAY_EPSILON;
+	ray r( p, d, ray::SHADOW );
+	double maxT = dist - RAY_EPSILON;
+
+	if( cachedOccluderBlocks( r, maxT ) )
+		return vec3f( 0.0, 0.0, 0.0 );
+
+	vec3f trans( 1.0, 1.0, 1.0 );
+	isect i;
+	while( scene->intersect( r, i ) && i.t < maxT ) {
+		if( i.getMaterial().kt(i).iszero() ) {
+			cacheOccluder( i.obj );
+			return vec3f( 0.0, 0.0, 0.0 );
+		}
+
+		trans = prod( trans, i.getMaterial().kt(i) );
+		p = r.at( i.t ) + d * RAY_EPSILON;
+		maxT -= i.t + RAY_EPSILON;
+		r = ray( p, d, ray::SHADOW );
+	}
+
+	return trans;
+}
+
+vec3f RectAreaLight::samplePoint( const vec3f&, double s, double t ) const
+{
+	return position + (s - 0.5) * u + (t - 0.5) * v;
+}
+
+vec3f SphereAreaLight::samplePoint( const vec3f& P, double s, double t ) const
+{
+	// orthonormal basis of the plane facing P
+	vec3f w = P - position;
+	double len = w.length();
+	if( len < RAY_EPSILON )
+		return position;
+	w /= len;
+
+	vec3f a = fabs( w[0] ) > 0.9 ? vec3f( 0.0, 1.0, 0.0 ) : vec3f( 1.0, 0.0, 0.0 );
+	vec3f b1 = w.cross( a ).normalize();
+	vec3f b2 = w.cross( b1 );
+
+	// uniform over the disc
+	double rad = radius * sqrt( s );
+	double phi = 2.0 * 3.14159265358979323846 * t;
+	return position + rad * (cos( phi ) * b1 + sin( phi ) * b2);
+}
@@ -2,6 +2,7 @@
 #define __LIGHT_H__
 
 #include "scene.h"
+#include "../RenderThread.h"
 //#include "../global.h"
 //#include "../ui/TraceUI.h"
 class Light
@@ -13,11 +14,31 @@ public:
 	virtual vec3f getColor( const vec3f& P ) const = 0;
 	virtual vec3f getDirection( const vec3f& P ) const = 0;
 
+	// Forget every cached occluder, e.g. when scene objects go away.
+	void clearOccluderCache();
+
 protected:
 	Light( Scene *scene, const vec3f& col )
-		: SceneElement( scene ), color( col ) {}
+		: SceneElement( scene ), color( col ) { clearOccluderCache(); }
+
+	// Neighbouring shading points are usually blocked by the same object,
+	// so each render thread remembers the last opaque primitive that
+	// stopped one of its shadow rays and tests it before the full scene.
+	// Lit points between shadowed ones keep it; it is only replaced when
+	// another object turns out to block a ray.
+	bool cachedOccluderBlocks( const ray& r, double maxT ) const;
+	void cacheOccluder( const SceneObject *obj ) const;
 
 	vec3f 		color;
+
+private:
+	struct OccluderCacheEntry
+	{
+		const SceneObject *obj;
+		char pad[ CACHE_LINE_SIZE - sizeof(const SceneObject *) ];
+	};
+
+	mutable OccluderCacheEntry occluderCache[ MAX_RENDER_THREADS ];
 };
 
 class DirectionalLight
@@ -61,4 +82,66 @@ protected:
 	double quadratic_atten_coeff;
 };
 
+// An area light is shaded like a point light at its center, but its shadow
+// attenuation is the average visibility of up to nSamples points spread over
+// its surface (a Halton sequence, rotated per shading point so neighbouring
+// pixels don't band).  If the first nAdaptive samples are all lit or all
+// blocked the point is taken to be outside the penumbra and the remaining
+// samples are skipped.
+class AreaLight
+	: public PointLight
+{
+public:
+	AreaLight( Scene *scene, const vec3f& pos, const vec3f& color,
+		double a0 = 1.0, double a1 = 0.0, double a2 = 0.0 )
+		: PointLight( scene, pos, color, a0, a1, a2 ),
+		  nSamples( 16 ), nAdaptive( 4 ) {}
+	virtual vec3f shadowAttenuation(const vec3f& P) const;
+
+	void setSamples( int samples, int adaptive );
+
+protected:
+	// Point on the light for sample coordinates (s,t) in [0,1)^2, as seen
+	// from P.
+	virtual vec3f samplePoint( const vec3f& P, double s, double t ) const = 0;
+
+	// Light transmitted from the light point Q to P: zero if something
+	// opaque is in the way, the product of the kt's of whatever is.
+	vec3f visibility( const vec3f& P, const vec3f& Q ) const;
+
+	int nSamples;
+	int nAdaptive;
+};
+
+// A parallelogram centered at pos and spanned by the two edge vectors.
+class RectAreaLight
+	: public AreaLight
+{
+public:
+	RectAreaLight( Scene *scene, const vec3f& pos, const vec3f& edge1, const vec3f& edge2,
+		const vec3f& color, double a0 = 1.0, double a1 = 0.0, double a2 = 0.0 )
+		: AreaLight( scene, pos, color, a0, a1, a2 ), u( edge1 ), v( edge2 ) {}
+
+protected:
+	virtual vec3f samplePoint( const vec3f& P, double s, double t ) const;
+
+	vec3f u, v;
+};
+
+// A sphere.  Samples are taken on the disc it projects to as seen from
+// the shading point.
+class SphereAreaLight
+	: public AreaLight
+{
+public:
+	SphereAreaLight( Scene *scene, const vec3f& pos, double r,
+		const vec3f& color, double a0 = 1.0, double a1 = 0.0, double a2 = 0.0 )
+		: AreaLight( scene, pos, color, a0, a1, a2 ), radius( r ) {}
+
+protected:
+	virtual vec3f samplePoint( const vec3f& P, double s, double t ) const;
+
+	double radius;
+};
+
 #endif // __LIGHT_H__
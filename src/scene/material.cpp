@@ -1,83 +1,146 @@
+#include <vector>
+#include <algorithm>
+
 #include "ray.h"
 #include "material.h"
 #include "light.h"
+#include "texture.h"
+#include "../RenderStats.h"
+
+// Lights handled without touching the heap; scenes with more lights than
+// this fall back to a vector.
+static const int MAX_LOCAL_LIGHTS = 16;
+
+struct LightTerm
+{
+	Light *light;
+	int lightIndex;
+	vec3f brdf;				// attenuated diffuse + specular factor
+	vec3f unshadowed;		// brdf times the light color
+	double estimate;		// largest channel reaching the pixel
+	bool negligible;
+};
+
+static bool brighterTerm( const LightTerm& a, const LightTerm& b )
+{
+	return a.estimate > b.estimate;
+}
 
 // Apply the phong model to this point on the surface of the object, returning
 // the color of that point.
-vec3f Material::shade( Scene *scene, const ray& r, const isect& i ) const
+//
+// weight is the product of the reflection/transmission coefficients along the
+// path from the eye to this point, i.e. how much of the returned color will
+// actually reach the pixel.  It is used to avoid tracing shadow rays that
+// cannot change the final 8-bit value; skipBudget, from the ray tracer, is
+// how much radiance that is at this bounce.
+vec3f Material::shade( Scene *scene, const ray& r, const isect& i, const vec3f& weight,
+	double skipBudget, std::vector<ShadowQuery> *deferred ) const
 {
-	// YOUR CODE HERE
+	// the diffuse and ambient terms are multiplied by (1-kt) as advised by the doc
+	vec3f transparency = vec3f(1, 1, 1) - kt(i);
+	vec3f Iphong = ke(i) + prod(transparency, prod(ka(i), scene->getIa())); // first 2 terms of the formula
 
-	// For now, this method just returns the diffuse color of the object.
-	// This gives a single matte color for every distinct surface in the
-	// scene, and that's it.  Simple, but enough to get you started.
-	// (It's also inconsistent with the phong model...)
+	RenderStats& stats = RenderStats::local();
+	int nLights = scene->numLights();
 
-	// Your mission is to fill in this method with the rest of the phong
-	// shading model, including the contributions of all the light sources.
-    // You will need to call both distanceAttenuation() and shadowAttenuation()
-    // somewhere in your code in order to compute shadows and light falloff.
+	vec3f diffuseK = prod(transparency, kd(i));
+	vec3f specularK = ks(i);
+	if (nLights == 0 || (diffuseK.iszero() && specularK.iszero())) {
+		stats.shadowSkippedBackfacing += nLights;
+		return Iphong;
+	}
 
-	// the diffuse and ambient terms are multiplied by (1-kt) as advised by the doc
-	vec3f Iphong = ke(i) + prod(vec3f(1, 1, 1) - kt(i), prod(ka(i), scene->getIa())); // first 2 terms of the formula
 	vec3f P = r.at(i.t); // point of intersection
+	vec3f V = -r.getDirection();
+	double shininessExp = shininess(i) * 128.0;
 
+	// First pass: the unshadowed contribution of every light.  Lights behind
+	// the surface contribute nothing and never get a shadow ray.
+	LightTerm localTerms[MAX_LOCAL_LIGHTS];
+	vector<LightTerm> heapTerms;
+	LightTerm *terms = localTerms;
+	if (nLights > MAX_LOCAL_LIGHTS) {
+		heapTerms.resize(nLights);
+		terms = &heapTerms[0];
+	}
+
+	int nTerms = 0;
+	int lightIndex = -1;
 	for (list<Light*>::const_iterator j = scene->beginLights(); j != scene->endLights(); j++) {
-		vec3f attenuation = (*j)->distanceAttenuation(P) * (*j)->shadowAttenuation(P);
-		
+		++lightIndex;
 		vec3f L = (*j)->getDirection(P); // light direction
-		vec3f diffuse = prod(vec3f(1, 1, 1) - kt(i), kd(i) * maximum(i.N * L, 0));
+		double NdotL = i.N * L;
+		if (NdotL <= 0.0) {
+			stats.shadowSkippedBackfacing++;
+			continue;
+		}
+
+		vec3f diffuse = diffuseK * NdotL;
 
-		vec3f R = (2 * (i.N * L) * i.N) - L; // reflection
+		vec3f R = (2 * NdotL * i.N) - L; // reflection
 		R = R.normalize();
-		vec3f specular = ks(i) * (pow(maximum(R * (-r.getDirection()), 0), shininess(i) * 128.0));
+		vec3f specular = specularK * pow(maximum(R * V, 0), shininessExp);
 
-		Iphong += prod(attenuation, diffuse + specular);
+		vec3f brdf = (*j)->distanceAttenuation(P) * (diffuse + specular);
+		vec3f unshadowed = prod((*j)->getColor(P), brdf);
+		if (unshadowed.iszero()) {
+			stats.shadowSkippedBackfacing++;
+			continue;
+		}
+
+		LightTerm& t = terms[nTerms++];
+		t.light = *j;
+		t.lightIndex = lightIndex;
+		t.brdf = brdf;
+		t.unshadowed = unshadowed;
+		vec3f reaching = prod(weight, unshadowed);
+		t.estimate = maximum(reaching[0], maximum(reaching[1], reaching[2]));
+		t.negligible = false;
 	}
 
-	Iphong = Iphong.clamp();
+	// Brightest lights first, so the dimmest ones are at the end.
+	sort(terms, terms + nTerms, brighterTerm);
 
-	return Iphong;
+	// The dimmest lights whose combined contribution stays within the
+	// budget are assumed unoccluded.
+	double skipped = 0.0;
+	for (int k = nTerms - 1; k >= 0; --k) {
+		if (skipped + terms[k].estimate >= skipBudget)
+			break;
+		skipped += terms[k].estimate;
+		terms[k].negligible = true;
+	}
+
+	// Second pass: shadow rays, only where they can make a difference.
+	for (int k = 0; k < nTerms; ++k) {
+		if (terms[k].negligible) {
+			stats.shadowSkippedNegligible++;
+			Iphong += terms[k].unshadowed;
+			continue;
+		}
 
-	//vec3f Qpoint = r.at(i.t);
-	//vec3f intensity = ke(i) + prod(ka(i), scene->ambient());
-
-	//for (vector<Light*>::const_iterator litr = scene->beginLights(); litr != scene->endLights(); ++litr)
-	//{
-	//	if (kd(i).iszero() && ks(i).iszero())
-	//	{
-	//		continue;
-	//	}
-	//	Light* pLight = *litr;
-	//	// Diffuse Term
-	//	vec3f directionToLight = pLight->getDirection(Qpoint);
-	//	directionToLight.normalize();
-	//	vec3f lightIntensity = pLight->distanceAttenuation(Qpoint) * pLight->shadowAttenuation(r, Qpoint);
-	//	if (!kd(i).iszero())
-	//	{
-	//		intensity = intensity + prod(kd(i), lightIntensity) * max((i.N * directionToLight), 0.0);
-	//	}
-	//	// Specular term
-	//	if (!ks(i).iszero())
-	//	{
-	//		vec3f viewingDirection = scene->getCamera().getEye() - Qpoint;
-	//		viewingDirection.normalize();
-	//		vec3f cosVector = i.N * (directionToLight * i.N);
-	//		vec3f sinVector = cosVector - directionToLight;
-	//		vec3f reflectedDirection = cosVector + sinVector;
-	//		reflectedDirection.normalize();
-	//		intensity = intensity + prod(ks(i), lightIntensity) * pow(max(reflectedDirection*viewingDirection, 0.0), shininess(i));
-	//	}
-	//}
-	//return intensity;
+		stats.shadowRays++;
+		if (deferred) {
+			ShadowQuery q = { terms[k].light, terms[k].lightIndex, P, terms[k].brdf };
+			deferred->push_back(q);
+		} else
+			Iphong += prod(terms[k].light->shadowAttenuation(P), terms[k].brdf);
+	}
+
+	// unclamped: the tone map decides what is too bright
+	return Iphong;
 }
 
 vec3f MaterialParameter::value(const isect& is) const
 {
+	if (_textureMap)
+		return prod(_value, _textureMap->value(is));
 	return _value;
 }
 
 double MaterialParameter::intensityValue(const isect& is) const
 {
-	return (0.299 * _value[0]) + (0.587 * _value[1]) + (0.114 * _value[2]);
+	vec3f v = value(is);
+	return (0.299 * v[0]) + (0.587 * v[1]) + (0.114 * v[2]);
 }
@@ -9,13 +9,26 @@
 
 #include "../vecmath/vecmath.h"
 #include <string>
+#include <vector>
 
 class Scene;
 class ray;
 class isect;
+class Light;
+class TextureMap;
 
 using std::string;
 
+// A shadow ray shade() leaves for its caller to trace: the light's term
+// at P is brdf times what the light's shadowAttenuation( P ) lets through.
+struct ShadowQuery
+{
+	Light *light;
+	int lightIndex;		// the light's place in the scene's list
+	vec3f P;
+	vec3f brdf;
+};
+
 /*
 MaterialParameter is a helper class for a material;
 it stores either a constant value (in a 3-vector)
@@ -34,15 +47,20 @@ class MaterialParameter
 {
 public:
 	explicit MaterialParameter(const vec3f& par)
-		: _value(par)
+		: _value(par), _textureMap(0)
 	{ }
 
 	explicit MaterialParameter(const double par)
-		: _value(par, par, par)
+		: _value(par, par, par), _textureMap(0)
+	{ }
+
+	// The map is owned by the scene, see Scene::getTexture().
+	explicit MaterialParameter(TextureMap *tex)
+		: _value(1.0, 1.0, 1.0), _textureMap(tex)
 	{ }
 
 	MaterialParameter()
-		: _value(0.0, 0.0, 0.0)
+		: _value(0.0, 0.0, 0.0), _textureMap(0)
 	{ }
 
 	MaterialParameter& operator*=(const MaterialParameter& rhs)
@@ -70,6 +88,8 @@ public:
 	MaterialParameter& operator+=(const MaterialParameter& rhs)
 	{
 		_value += rhs._value;
+		if (!_textureMap)
+			_textureMap = rhs._textureMap;
 		return *this;
 	}
 
@@ -85,7 +105,8 @@ public:
 		_value[2] = rhs;
 	}
 
-	bool isZero() { return _value.iszero(); }
+	bool isZero() { return !_textureMap && _value.iszero(); }
+	bool mapped() const { return _textureMap != 0; }
 
 	vec3f& operator+=(const vec3f& rhs)
 	{
@@ -98,6 +119,7 @@ public:
 
 private:
 	vec3f _value;
+	TextureMap *_textureMap;
 };
 
 class Material
@@ -123,7 +145,14 @@ public:
 		setBools();
 	}
 
-	virtual vec3f shade(Scene *scene, const ray& r, const isect& i) const;
+	// Lights whose shadow rays together could change the radiance reaching
+	// the pixel by less than skipBudget are taken as unoccluded; 0 traces
+	// every one.  With deferred, the shadow rays aren't traced: the lights
+	// they are for are left out of the result and their queries appended
+	// instead.
+	virtual vec3f shade(Scene *scene, const ray& r, const isect& i,
+		const vec3f& weight = vec3f(1.0, 1.0, 1.0), double skipBudget = 0.0,
+		std::vector<ShadowQuery> *deferred = NULL) const;
 
 
 
@@ -1,3 +1,5 @@
+#include <cmath>
+
 #include "ray.h"
 #include "material.h"
 #include "scene.h"
@@ -7,3 +9,57 @@ isect::getMaterial() const
 {
     return material ? *material : obj->getMaterial();
 }
+
+bool
+ray::footprintAt( double tt, const vec3f& N, vec3f& dPdx, vec3f& dPdy ) const
+{
+    if( !differentials )
+        return false;
+
+    // Move the hit point along with the ray and keep it on the tangent
+    // plane (Igehy, "Tracing Ray Differentials").
+    double dn = d * N;
+    if( fabs( dn ) < NORMAL_EPSILON ) {
+        dPdx = dPdy = vec3f( 0.0, 0.0, 0.0 );
+        return false;
+    }
+
+    vec3f ex = dpdx + tt * dddx;
+    vec3f ey = dpdy + tt * dddy;
+    dPdx = ex - ((ex * N) / dn) * d;
+    dPdy = ey - ((ey * N) / dn) * d;
+    return true;
+}
+
+double
+isect::footprintWidth() const
+{
+    double x = dPdx.length();
+    double y = dPdy.length();
+    return x > y ? x : y;
+}
+
+void
+isect::setFootprint( const vec3f& dpdx, const vec3f& dpdy )
+{
+    dPdx = dpdx;
+    dPdy = dpdy;
+
+    // least squares solution of dPdx = dudx * dPdu + dvdx * dPdv (and the
+    // same for y), the offsets need not lie exactly in the tangent plane
+    double a = dPdu * dPdu;
+    double b = dPdu * dPdv;
+    double c = dPdv * dPdv;
+    double det = a * c - b * b;
+    if( fabs( det ) < 1e-20 ) {
+        dudx = dvdx = dudy = dvdy = 0.0;
+        return;
+    }
+
+    double ux = dPdu * dPdx, vx = dPdv * dPdx;
+    double uy = dPdu * dPdy, vy = dPdv * dPdy;
+    dudx = (c * ux - b * vx) / det;
+    dvdx = (a * vx - b * ux) / det;
+    dudy = (c * uy - b * vy) / det;
+    dvdy = (a * vy - b * uy) / det;
+}
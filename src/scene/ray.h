@@ -26,15 +26,22 @@ public:
 		SHADOW
 	};
 	ray(const vec3f &pp, const vec3f &dd, RayType tt = VISIBILITY)
-		: p( pp ), d( dd ), t( tt ) {}
+		: p( pp ), d( dd ), t( tt ), differentials( false ) {}
 	ray( const vec3f& pp, const vec3f& dd )
-		: p( pp ), d( dd ) {}
+		: p( pp ), d( dd ), differentials( false ) {}
 	ray( const ray& other ) 
-		: p( other.p ), d( other.d ) {}
+		: p( other.p ), d( other.d ), t( other.t ), differentials( other.differentials ),
+		  dpdx( other.dpdx ), dddx( other.dddx ), dpdy( other.dpdy ), dddy( other.dddy ) {}
 	~ray() {}
 
 	ray& operator =( const ray& other ) 
-	{ p = other.p; d = other.d; return *this; }
+	{
+		p = other.p; d = other.d; t = other.t;
+		differentials = other.differentials;
+		dpdx = other.dpdx; dddx = other.dddx;
+		dpdy = other.dpdy; dddy = other.dddy;
+		return *this;
+	}
 
 	vec3f at( double t ) const
 	{ return p + (t*d); }
@@ -43,17 +50,41 @@ public:
 	vec3f getDirection() const { return d; }
 	RayType type() const { return t; }
 
+	// Ray differentials: how origin and direction change from one pixel
+	// (or sample) to the next in x and in y.
+	void setDifferentials( const vec3f& dPdx, const vec3f& dDdx,
+		const vec3f& dPdy, const vec3f& dDdy )
+	{
+		differentials = true;
+		dpdx = dPdx; dddx = dDdx;
+		dpdy = dPdy; dddy = dDdy;
+	}
+	bool hasDifferentials() const { return differentials; }
+	vec3f dPdx() const { return dpdx; }
+	vec3f dDdx() const { return dddx; }
+	vec3f dPdy() const { return dpdy; }
+	vec3f dDdy() const { return dddy; }
+
+	// Offsets of the hit point at distance t on a surface with normal N
+	// between neighbouring pixels.  False if the ray has no differentials.
+	bool footprintAt( double t, const vec3f& N, vec3f& dPdx, vec3f& dPdy ) const;
+
 protected:
 	vec3f p;
 	vec3f d;
 	RayType t;
+
+	bool differentials;
+	vec3f dpdx, dddx;
+	vec3f dpdy, dddy;
 };
 
 class isect
 {
 public:
     isect()
-        : obj( NULL ), t( 0.0 ), N(), material(0) {}
+        : obj( NULL ), t( 0.0 ), N(), material(0),
+          u( 0.0 ), v( 0.0 ), dudx( 0.0 ), dvdx( 0.0 ), dudy( 0.0 ), dvdy( 0.0 ) {}
 
     ~isect()
     {
@@ -64,6 +95,26 @@ public:
     void setT( double tt ) { t = tt; }
     void setN( const vec3f& n ) { N = n; }
     void setMaterial( Material *m ) { delete material; material = m; }
+
+    // Surface parametrization at the hit, set by the primitive in its
+    // local space: texture coordinates and the partial derivatives of the
+    // position and (for curved surfaces) the normal along them.
+    void setUV( double uu, double vv, const vec3f& dpdu, const vec3f& dpdv,
+        const vec3f& dndu = vec3f(), const vec3f& dndv = vec3f() )
+    { u = uu; v = vv; dPdu = dpdu; dPdv = dpdv; dNdu = dndu; dNdv = dndv; }
+
+    // Record how the hit point moves between neighbouring pixels and work
+    // out the texture space footprint (dudx...) that filtered lookups use.
+    void setFootprint( const vec3f& dpdx, const vec3f& dpdy );
+
+    // Change of the normal from one pixel to the next, for bending ray
+    // differentials at curved mirrors and lenses.
+    vec3f dNdx() const { return dudx * dNdu + dvdx * dNdv; }
+    vec3f dNdy() const { return dudy * dNdu + dvdy * dNdv; }
+
+    // Rough width of the pixel footprint on the surface, in world units;
+    // zero if unknown.
+    double footprintWidth() const;
         
     isect& operator =( const isect& other )
     {
@@ -72,6 +123,18 @@ public:
             obj = other.obj;
             t = other.t;
             N = other.N;
+            u = other.u;
+            v = other.v;
+            dPdu = other.dPdu;
+            dPdv = other.dPdv;
+            dNdu = other.dNdu;
+            dNdv = other.dNdv;
+            dPdx = other.dPdx;
+            dPdy = other.dPdy;
+            dudx = other.dudx;
+            dvdx = other.dvdx;
+            dudy = other.dudy;
+            dvdy = other.dvdy;
 //            material = other.material ? new Material( *(other.material) ) : 0;
 			if( other.material )
             {
@@ -96,6 +159,13 @@ public:
                                 // (as opposed to one in its associated object)
                                 // as in the case where the material was interpolated
 
+    double u, v;                // texture coordinates
+    vec3f dPdu, dPdv;           // and the surface tangents along them
+    vec3f dNdu, dNdv;           // normal change along them, zero if flat
+    vec3f dPdx, dPdy;           // world space step of one pixel
+    double dudx, dvdx;          // texture space step of one pixel in x
+    double dudy, dvdy;          // ...and in y; all zero if unknown
+
     const Material &getMaterial() const;
     // Other info here.
 	enum INTERSECT_SURFACE state;
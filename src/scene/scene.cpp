@@ -1,9 +1,14 @@
 #include <cmath>
+#include <atomic>
+#include <typeinfo>
+#include <vector>
 
 #include "scene.h"
 #include "light.h"
-#include "../ui/TraceUI.h"
-extern TraceUI* traceUI;
+#include "texture.h"
+#include "environment.h"
+#include "bvh.h"
+#include "animation.h"
 
 void BoundingBox::operator=(const BoundingBox& target)
 {
@@ -86,7 +91,13 @@ bool Geometry::intersect(const ray&r, isect&i) const
 
 	if (intersectLocal(localRay, i)) {
         // Transform the intersection point & normal returned back into global space.
+		if (!i.dNdu.iszero() || !i.dNdv.iszero()) {
+			i.dNdu = transform->localToGlobalCoordsNormalDerivative(i.N, i.dNdu);
+			i.dNdv = transform->localToGlobalCoordsNormalDerivative(i.N, i.dNdv);
+		}
 		i.N = transform->localToGlobalCoordsNormal(i.N);
+		i.dPdu = transform->localToGlobalCoordsVector(i.dPdu);
+		i.dPdv = transform->localToGlobalCoordsVector(i.dPdv);
 		i.t /= length;
 
 		return true;
@@ -120,21 +131,75 @@ Scene::~Scene()
     giter g;
     liter l;
     
+	// boundedobjects and nonboundedobjects are subsets of objects
 	for( g = objects.begin(); g != objects.end(); ++g ) {
 		delete (*g);
 	}
 
-	for( g = boundedobjects.begin(); g != boundedobjects.end(); ++g ) {
-		delete (*g);
+	for( l = lights.begin(); l != lights.end(); ++l ) {
+		delete (*l);
 	}
 
-	for( g = nonboundedobjects.begin(); g != boundedobjects.end(); ++g ) {
-		delete (*g);
+	map<string, TextureMap*>::iterator t;
+	for( t = textures.begin(); t != textures.end(); ++t ) {
+		delete t->second;
 	}
 
-	for( l = lights.begin(); l != lights.end(); ++l ) {
-		delete (*l);
+	delete environment;
+	delete animation;
+	delete bvh;
+}
+
+void Scene::geometryChanged()
+{
+	static std::atomic<unsigned long> s_lastVersion( 0 );
+	version = ++s_lastVersion;
+}
+
+void Scene::setEnvironment( EnvironmentMap *env )
+{
+	delete environment;
+	environment = env;
+}
+
+void Scene::setAnimation( Animation *a )
+{
+	delete animation;
+	animation = a;
+}
+
+void Scene::setFrame( double frame )
+{
+	if( !animation )
+		return;
+	animation->apply( frame, camera );
+	refit();
+}
+
+void Scene::refit()
+{
+	for( giter g = objects.begin(); g != objects.end(); ++g )
+		(*g)->ComputeBoundingBox();
+	fitBounds();
+	if( bvh )
+		bvh->refit();
+	geometryChanged();
+}
+
+TextureMap *Scene::getTexture( const string& filename )
+{
+	map<string, TextureMap*>::iterator t = textures.find( filename );
+	if( t != textures.end() )
+		return t->second;
+
+	TextureMap *tex = new TextureMap;
+	if( !tex->load( filename ) ) {
+		delete tex;
+		return NULL;
 	}
+	textures[ filename ] = tex;
+	files.push_back( filename );
+	return tex;
 }
 
 // Get any intersection with an object.  Return information about the 
@@ -157,45 +222,159 @@ bool Scene::intersect( const ray& r, isect& i ) const
 		}
 	}
 
-	// try the bounded objects
-	for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
-		if( (*j)->intersect( r, cur ) ) {
-			if( !have_one || (cur.t < i.t) ) {
-				i = cur;
-				have_one = true;
-			}
+	// the bounded objects are only tested if the ray passes their boxes;
+	// a tie still goes to the unbounded object found first
+	if( bvh && bvh->intersect( r, cur, have_one ? i.t : 1.0e308 ) ) {
+		if( !have_one || (cur.t < i.t) ) {
+			i = cur;
+			have_one = true;
 		}
 	}
 
-
 	return have_one;
 }
 
+bool Scene::occluded( const ray& r, double maxT ) const
+{
+	isect cur;
+	for( cgiter j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j ) {
+		cur.setMaterial( NULL );
+		if( (*j)->intersect( r, cur ) && cur.t < maxT )
+			return true;
+	}
+	return bvh && bvh->occluded( r, maxT );
+}
+
 void Scene::initScene()
 {
-	bool first_boundedobject = true;
-	BoundingBox b;
-	
 	typedef list<Geometry*>::const_iterator iter;
+	boundedobjects.clear();
+	nonboundedobjects.clear();
+
 	// split the objects into two categories: bounded and non-bounded
+	int index = 0;
 	for( iter j = objects.begin(); j != objects.end(); ++j ) {
+		(*j)->setIndex( index++ );
 		if( (*j)->hasBoundingBoxCapability() )
-		{
 			boundedobjects.push_back(*j);
+		else
+			nonboundedobjects.push_back(*j);
+	}
+	fitBounds();
 
-			// widen the scene's bounding box, if necessary
-			if (first_boundedobject) {
-				sceneBounds = (*j)->getBoundingBox();
-				first_boundedobject = false;
-			}
-			else
-			{
-				b = (*j)->getBoundingBox();
-				sceneBounds.max = maximum(sceneBounds.max, b.max);
-				sceneBounds.min = minimum(sceneBounds.min, b.min);
-			}
+	if( !bvh )
+		bvh = new BVH;
+	bvh->build( boundedobjects );
+}
+
+void Scene::fitBounds()
+{
+	bool first_boundedobject = true;
+	BoundingBox b;
+
+	for( cgiter j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
+		// widen the scene's bounding box, if necessary
+		if (first_boundedobject) {
+			sceneBounds = (*j)->getBoundingBox();
+			first_boundedobject = false;
 		}
 		else
-			nonboundedobjects.push_back(*j);
+		{
+			b = (*j)->getBoundingBox();
+			sceneBounds.max = maximum(sceneBounds.max, b.max);
+			sceneBounds.min = minimum(sceneBounds.min, b.min);
+		}
+	}
+}
+
+Scene::Update Scene::update( Scene *fresh )
+{
+	Update u = { 0, 0, 0, false };
+
+	// cheap enough to take as they are; lights bring empty occluder caches
+	lights.swap( fresh->lights );
+	for( liter l = lights.begin(); l != lights.end(); ++l )
+		(*l)->setScene( this );
+	textures.swap( fresh->textures );
+	files.swap( fresh->files );
+	std::swap( environment, fresh->environment );
+	std::swap( animation, fresh->animation );
+	camera = fresh->camera;
+	Ia = fresh->Ia;
+
+	// every object kept is pointed at its node in the new tree
+	transformRoot.swapChildren( fresh->transformRoot );
+
+	if( objects.size() != fresh->objects.size() ) {
+		// can't pair them up, take everything
+		objects.swap( fresh->objects );
+		for( giter g = objects.begin(); g != objects.end(); ++g )
+			(*g)->setScene( this );
+		u.replaced = (int)objects.size();
+		u.rebuilt = true;
+		initScene();
+		geometryChanged();
+		return u;
+	}
+
+	vector<Geometry*> olds( objects.begin(), objects.end() );
+	vector<Geometry*> news( fresh->objects.begin(), fresh->objects.end() );
+	size_t n = olds.size();
+
+	// objects that own their shape first, then the ones that borrow it
+	vector<char> same( n, 0 );
+	map<const Geometry*, const Geometry*> keptOwners;
+	for( size_t k = 0; k < n; ++k ) {
+		if( olds[k]->shapeOwner() )
+			continue;
+		same[k] = typeid( *olds[k] ) == typeid( *news[k] ) && olds[k]->sameShape( *news[k] );
+		if( same[k] )
+			keptOwners[ olds[k] ] = news[k];
+	}
+	for( size_t k = 0; k < n; ++k ) {
+		if( !olds[k]->shapeOwner() )
+			continue;
+		map<const Geometry*, const Geometry*>::const_iterator o = keptOwners.find( olds[k]->shapeOwner() );
+		same[k] = o != keptOwners.end() && o->second == news[k]->shapeOwner()
+			&& typeid( *olds[k] ) == typeid( *news[k] ) && olds[k]->sameShape( *news[k] );
+	}
+
+	for( size_t k = 0; k < n; ++k ) {
+		if( !same[k] ) {
+			std::swap( olds[k], news[k] );
+			olds[k]->setScene( this );
+			news[k]->setScene( fresh );
+			++u.replaced;
+			continue;
+		}
+
+		MaterialSceneObject *m = dynamic_cast<MaterialSceneObject *>( olds[k] );
+		MaterialSceneObject *fm = dynamic_cast<MaterialSceneObject *>( news[k] );
+		if( m && fm )
+			m->swapMaterial( *fm );
+
+		TransformNode *t = news[k]->getTransform();
+		bool moved = !(olds[k]->getTransform()->getXform() == t->getXform());
+		olds[k]->setTransform( t );
+		if( moved ) {
+			olds[k]->ComputeBoundingBox();
+			++u.moved;
+		} else {
+			++u.kept;
+		}
+	}
+
+	objects.assign( olds.begin(), olds.end() );
+	fresh->objects.assign( news.begin(), news.end() );
+
+	if( u.replaced ) {
+		u.rebuilt = true;
+		initScene();
+	} else if( u.moved ) {
+		fitBounds();
+		bvh->refit();
 	}
+	if( u.replaced || u.moved )
+		geometryChanged();
+	return u;
 }
@@ -8,6 +8,9 @@
 #define __SCENE_H__
 
 #include <list>
+#include <map>
+#include <string>
+#include <vector>
 #include <algorithm>
 
 using namespace std;
@@ -19,6 +22,10 @@ using namespace std;
 
 class Light;
 class Scene;
+class TextureMap;
+class EnvironmentMap;
+class BVH;
+class Animation;
 
 class SceneElement
 {
@@ -26,6 +33,7 @@ public:
 	virtual ~SceneElement() {}
 
 	Scene *getScene() const { return scene; }
+	void setScene( Scene *s ) { scene = s; }
 
 protected:
 	SceneElement( Scene *s )
@@ -59,6 +67,7 @@ class TransformNode
 protected:
 
     // information about this node's transformation
+    mat4f    local;		// relative to the parent
     mat4f    xform;
 	mat4f    inverse;
 	mat3f    normi;
@@ -71,6 +80,28 @@ public:
    	typedef list<TransformNode*>::iterator          child_iter;
 	typedef list<TransformNode*>::const_iterator    child_citer;
 
+    const mat4f& getXform() const { return xform; }
+
+    // Trade subtrees with another node; used to adopt the transforms of a
+    // freshly parsed scene.
+    void swapChildren( TransformNode& other )
+    {
+        children.swap( other.children );
+        for( child_iter c = children.begin(); c != children.end(); ++c )
+            (*c)->parent = this;
+        for( child_iter c = other.children.begin(); c != other.children.end(); ++c )
+            (*c)->parent = &other;
+    }
+
+    // Change this node's transformation relative to its parent, for
+    // animation; every node below it follows.  The objects using these
+    // nodes need their bounding boxes recomputed afterwards.
+    void setLocal( const mat4f& m )
+    {
+        local = m;
+        update();
+    }
+
     ~TransformNode()
     {
         for(child_iter c = children.begin(); c != children.end(); ++c )
@@ -105,6 +136,18 @@ public:
         return (normi * v).normalize();
     }
 
+    // directions and tangents: no translation, no renormalization
+    vec3f localToGlobalCoordsVector(const vec3f &v)
+    {
+        return xform.upper33() * v;
+    }
+
+    // change dN of the local normal N, as seen on the global normal
+    vec3f localToGlobalCoordsNormalDerivative(const vec3f &N, const vec3f &dN)
+    {
+        return (normi * dN) / (normi * N).length();
+    }
+
 protected:
     // protected so that users can't directly construct one of these...
     // force them to use the createChild() method.  Note that they CAN
@@ -113,14 +156,28 @@ protected:
         : children()
     {
         this->parent = parent;
+        this->local = xform;
+        compose();
+    }
+
+private:
+    void compose()
+    {
         if (parent == NULL)
-            this->xform = xform;
+            this->xform = local;
         else
-            this->xform = parent->xform * xform;
+            this->xform = parent->xform * local;
         
         inverse = this->xform.inverse();
         normi = this->xform.upper33().inverse().transpose();
     }
+
+    void update()
+    {
+        compose();
+        for(child_iter c = children.begin(); c != children.end(); ++c )
+            (*c)->update();
+    }
 };
 
 class TransformRoot : public TransformNode
@@ -193,13 +250,29 @@ public:
     virtual BoundingBox ComputeLocalBoundingBox() { return BoundingBox(); }
 
     void setTransform(TransformNode *transform) { this->transform = transform; };
+    TransformNode *getTransform() const { return transform; }
+
+    // For reloading: does other, an object of the same class, have the
+    // same shape in local space?  The transform and material are compared
+    // separately, so only parameters of the class itself matter here.
+    virtual bool sameShape( const Geometry& ) const { return true; }
+
+    // Objects whose shape lives in another object (the faces of a mesh)
+    // return that object; they are only kept if it is.
+    virtual const Geometry *shapeOwner() const { return NULL; }
+
+    // Position in the scene's object list, the order of the file; set by
+    // Scene::initScene() and Scene::update(), -1 before that.
+    int getIndex() const { return index; }
+    void setIndex( int i ) { index = i; }
     
 	Geometry( Scene *scene ) 
-		: SceneElement( scene ) {}
+		: SceneElement( scene ), index( -1 ) {}
 
 protected:
 	BoundingBox bounds;
     TransformNode *transform;
+	int index;
 };
 
 // A SceneObject is a real actual thing that we want to model in the 
@@ -228,6 +301,7 @@ public:
 
 	virtual const Material& getMaterial() const { return *material; }
 	virtual void setMaterial( Material *m )	{ material = m; }
+	void swapMaterial( MaterialSceneObject& other ) { std::swap( material, other.material ); }
 
 protected:
 	MaterialSceneObject( Scene *scene, Material *mat ) 
@@ -250,14 +324,51 @@ public:
     TransformRoot transformRoot;
 
 public:
-	Scene() : transformRoot(), objects(), lights() {}
+	Scene() : transformRoot(), objects(), lights(), environment( NULL ), animation( NULL ), bvh( NULL )
+	{ geometryChanged(); }
 	virtual ~Scene();
 	bool intersect(const ray& r, isect& i) const;
+	// Is anything hit closer than maxT?  Cheaper than intersect(), which
+	// has to find the closest hit.
+	bool occluded(const ray& r, double maxT = 1.0e308) const;
+
+	// Sort the objects into bounded and unbounded ones and build the BVH
+	// over the bounded ones.  Call again after adding objects.
 	void initScene();
 
+	// Bring this scene up to date with a new parse of its file.  Lights,
+	// textures, the environment, camera and ambient light are taken from
+	// fresh.  Objects are matched up in file order: ones whose shape is
+	// unchanged stay (taking the new material and transform), others are
+	// swapped for the new ones.  If only transforms changed the BVH is
+	// refitted, otherwise it is rebuilt.  Afterwards fresh holds what was
+	// left over and should be deleted; it must not have been initScene()d.
+	struct Update
+	{
+		int kept;		// unchanged apart from materials
+		int moved;		// same shape, new transform
+		int replaced;	// taken from the new parse
+		bool rebuilt;	// BVH built again rather than refitted
+	};
+	Update update( Scene *fresh );
+
+	// Objects' transforms changed but nothing was added or removed:
+	// recompute their bounding boxes and refit the BVH to them.
+	void refit();
+
+	// Keyframed transforms and camera; NULL if the file has none.  The
+	// scene takes ownership.
+	void setAnimation( Animation *a );
+	const Animation *getAnimation() const { return animation; }
+	Animation *getAnimation() { return animation; }
+
+	// Pose the animated transforms and camera for a frame and refit.
+	void setFrame( double frame );
+
 	void add( Geometry* obj ) {
 		obj->ComputeBoundingBox();
 		objects.push_back( obj );
+		geometryChanged();
 	}
 
 	void add( Light* light ) { 
@@ -271,14 +382,54 @@ public:
 
 	list<Light*>::const_iterator beginLights() const { return lights.begin(); }
 	list<Light*>::const_iterator endLights() const { return lights.end(); }
+	int numLights() const { return (int)lights.size(); }
+	cgiter beginObjects() const { return objects.begin(); }
+	cgiter endObjects() const { return objects.end(); }
 	Camera *getCamera() { return &camera; }
+
+	// Image maps are shared by every material that names the same file
+	// and live as long as the scene.  NULL if the file can't be loaded.
+	TextureMap *getTexture( const string& filename );
+
+	// Where the scene file lives, with a trailing slash, or empty.  Files
+	// the scene names that aren't found as given are looked for here.
+	void setDirectory( const string& dir ) { directory = dir; }
+	const string& getDirectory() const { return directory; }
+
+	// The image files the scene was made from besides the scene file:
+	// texture and environment maps, as they were opened.
+	void addFile( const string& filename ) { files.push_back( filename ); }
+	const vector<string>& getFiles() const { return files; }
+
+	// Anything that caches what rays hit (the relighting G-buffer) checks
+	// this.  Call geometryChanged() after moving or editing objects; the
+	// version is unique across scenes, too.
+	unsigned long geometryVersion() const { return version; }
+	void geometryChanged();
+
+	// What rays that miss everything see; NULL for black.  The scene
+	// takes ownership.
+	void setEnvironment( EnvironmentMap *env );
+	const EnvironmentMap *getEnvironment() const { return environment; }
+
 	vec3f getIa() { return Ia; }
+
+	// Encloses every bounded object as of the last initScene(), refit()
+	// or update().
+	const BoundingBox& getBounds() const { return sceneBounds; }
 	
 private:
     list<Geometry*> objects;
 	list<Geometry*> nonboundedobjects;
 	list<Geometry*> boundedobjects;
     list<Light*> lights;
+    map<string, TextureMap*> textures;
+	string directory;
+	vector<string> files;
+	EnvironmentMap *environment;
+	Animation *animation;
+	unsigned long version;
+	BVH *bvh;			// over boundedobjects, made by initScene()
     Camera camera;
 	vec3f Ia;
 	
@@ -286,6 +437,9 @@ private:
 	// must fall within this bounding box.  Objects that don't have hasBoundingBoxCapability()
 	// are exempt from this requirement.
 	BoundingBox sceneBounds;
+
+	// Recompute sceneBounds from the boxes of boundedobjects.
+	void fitBounds();
 };
 
 #endif // __SCENE_H__
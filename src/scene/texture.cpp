@@ -0,0 +1,253 @@
+#include <cmath>
+#include <ctype.h>
+
+#include "texture.h"
+#include "texturecache.h"
+#include "ray.h"
+#include "../fileio/bitmap.h"
+#include "../fileio/hdrimage.h"
+
+TextureMap::TextureMap()
+	: tiled( NULL ), clampU( false ), clampV( false )
+{
+}
+
+TextureMap::~TextureMap()
+{
+	delete tiled;
+}
+
+static bool hasExtension( const string& filename, const char *ext )
+{
+	size_t n = filename.size();
+	if( n < 4 || filename[n-4] != '.' )
+		return false;
+	for( int k = 0; k < 3; ++k )
+		if( tolower( filename[n-3+k] ) != ext[k] )
+			return false;
+	return true;
+}
+
+bool TextureMap::load( const string& filename )
+{
+	if( hasExtension( filename, "tex" ) ) {
+		TiledTexture *t = new TiledTexture;
+		if( !t->open( filename ) ) {
+			delete t;
+			return false;
+		}
+
+		delete tiled;
+		tiled = t;
+		levels.resize( t->numLevels() );
+		for( int l = 0; l < t->numLevels(); ++l ) {
+			levels[l].width = t->levelWidth( l );
+			levels[l].height = t->levelHeight( l );
+			levels[l].texels.clear();
+		}
+		return true;
+	}
+
+	// float maps keep their radiance; BMPs are scaled to [0,1]
+	int width, height;
+	char *name = const_cast<char *>( filename.c_str() );
+	float *hdr = NULL;
+	unsigned char *data = NULL;
+	if( hasExtension( filename, "pfm" ) )
+		hdr = readPFM( name, width, height );
+	else if( hasExtension( filename, "hdr" ) || hasExtension( filename, "pic" ) )
+		hdr = readHDR( name, width, height );
+	else
+		data = readBMP( name, width, height );
+	if( !hdr && !data )
+		return false;
+
+	levels.clear();
+	levels.push_back( Level() );
+	Level& base = levels.back();
+	base.width = width;
+	base.height = height;
+	base.texels.resize( width * height * 3 );
+	for( int k = 0; k < width * height * 3; ++k )
+		base.texels[k] = hdr ? hdr[k] : data[k] / 255.0f;
+	delete [] hdr;
+	delete [] data;
+
+	// 2x2 box filtered levels down to a single texel; odd sizes round
+	// down and the last row or column is folded into its neighbour.
+	while( levels.back().width > 1 || levels.back().height > 1 ) {
+		const Level& src = levels.back();
+		Level dst;
+		dst.width = src.width > 1 ? src.width / 2 : 1;
+		dst.height = src.height > 1 ? src.height / 2 : 1;
+		dst.texels.resize( dst.width * dst.height * 3 );
+
+		for( int y = 0; y < dst.height; ++y ) {
+			int y0 = y * src.height / dst.height;
+			int y1 = (y + 1) * src.height / dst.height;
+			for( int x = 0; x < dst.width; ++x ) {
+				int x0 = x * src.width / dst.width;
+				int x1 = (x + 1) * src.width / dst.width;
+
+				float sum[3] = { 0.0f, 0.0f, 0.0f };
+				for( int sy = y0; sy < y1; ++sy )
+					for( int sx = x0; sx < x1; ++sx )
+						for( int c = 0; c < 3; ++c )
+							sum[c] += src.texels[(sx + sy * src.width) * 3 + c];
+
+				float n = (float)((x1 - x0) * (y1 - y0));
+				for( int c = 0; c < 3; ++c )
+					dst.texels[(x + y * dst.width) * 3 + c] = sum[c] / n;
+			}
+		}
+		levels.push_back( dst );
+	}
+
+	return true;
+}
+
+bool TextureMap::writeTiled( const string& filename ) const
+{
+	if( tiled || levels.empty() )
+		return false;
+
+	std::vector<int> widths, heights;
+	std::vector<const float *> texels;
+	for( size_t l = 0; l < levels.size(); ++l ) {
+		widths.push_back( levels[l].width );
+		heights.push_back( levels[l].height );
+		texels.push_back( &levels[l].texels[0] );
+	}
+	return TiledTexture::write( filename, (int)levels.size(), &widths[0], &heights[0], &texels[0] );
+}
+
+static inline int wrap( int k, int n )
+{
+	k %= n;
+	return k < 0 ? k + n : k;
+}
+
+static inline int clamp( int k, int n )
+{
+	return k < 0 ? 0 : (k >= n ? n - 1 : k);
+}
+
+void TextureMap::texel( int l, int x, int y, float *rgb ) const
+{
+	if( tiled ) {
+		tiled->texel( l, x, y, rgb );
+		return;
+	}
+
+	const float *p = &levels[l].texels[(x + y * levels[l].width) * 3];
+	rgb[0] = p[0];
+	rgb[1] = p[1];
+	rgb[2] = p[2];
+}
+
+vec3f TextureMap::bilinear( int level, double u, double v ) const
+{
+	const Level& l = levels[level];
+	double x = u * l.width - 0.5;
+	double y = v * l.height - 0.5;
+	double fx = floor( x );
+	double fy = floor( y );
+	double ax = x - fx;
+	double ay = y - fy;
+
+	int x0, x1, y0, y1;
+	if( clampU ) {
+		x0 = clamp( (int)fx, l.width );
+		x1 = clamp( (int)fx + 1, l.width );
+	} else {
+		x0 = wrap( (int)fx, l.width );
+		x1 = x0 + 1 < l.width ? x0 + 1 : 0;
+	}
+	if( clampV ) {
+		y0 = clamp( (int)fy, l.height );
+		y1 = clamp( (int)fy + 1, l.height );
+	} else {
+		y0 = wrap( (int)fy, l.height );
+		y1 = y0 + 1 < l.height ? y0 + 1 : 0;
+	}
+
+	float t00[3], t10[3], t01[3], t11[3];
+	texel( level, x0, y0, t00 );
+	texel( level, x1, y0, t10 );
+	texel( level, x0, y1, t01 );
+	texel( level, x1, y1, t11 );
+
+	vec3f result;
+	for( int c = 0; c < 3; ++c ) {
+		double bottom = t00[c] + ax * (t10[c] - t00[c]);
+		double top = t01[c] + ax * (t11[c] - t01[c]);
+		result[c] = bottom + ay * (top - bottom);
+	}
+	return result;
+}
+
+vec3f TextureMap::trilinear( double u, double v, double lod ) const
+{
+	int last = (int)levels.size() - 1;
+	if( lod <= 0.0 )
+		return bilinear( 0, u, v );
+	if( lod >= last )
+		return bilinear( last, u, v );
+
+	int l = (int)lod;
+	double f = lod - l;
+	vec3f a = bilinear( l, u, v );
+	vec3f b = bilinear( l + 1, u, v );
+	return a + f * (b - a);
+}
+
+vec3f TextureMap::value( const isect& i ) const
+{
+	return sample( i.u, i.v, i.dudx, i.dvdx, i.dudy, i.dvdy );
+}
+
+vec3f TextureMap::sample( double u, double v, double dudx, double dvdx,
+	double dudy, double dvdy ) const
+{
+	if( levels.empty() )
+		return vec3f( 0.0, 0.0, 0.0 );
+
+	// the two footprint axes, measured in texels of the full image
+	double w = levels[0].width;
+	double h = levels[0].height;
+	double ax = dudx * w, ay = dvdx * h;
+	double bx = dudy * w, by = dvdy * h;
+	double la = sqrt( ax * ax + ay * ay );
+	double lb = sqrt( bx * bx + by * by );
+
+	double major = la, minor = lb;
+	double mu = dudx, mv = dvdx;
+	if( lb > la ) {
+		major = lb;
+		minor = la;
+		mu = dudy;
+		mv = dvdy;
+	}
+
+	if( major <= 1.0 )
+		return bilinear( 0, u, v );
+
+	// Probe along the major axis often enough that each probe only has to
+	// cover the minor axis, at the level where that is about one texel.
+	int n = 1;
+	if( minor * MAX_ANISOTROPY < major )
+		n = MAX_ANISOTROPY;
+	else if( minor > 0.0 )
+		n = (int)ceil( major / minor );
+	double lod = log( major / n ) / log( 2.0 );
+
+	if( n == 1 )
+		return trilinear( u, v, lod );
+
+	vec3f sum;
+	for( int k = 0; k < n; ++k ) {
+		double s = (k + 0.5) / n - 0.5;
+		sum += trilinear( u + s * mu, v + s * mv, lod );
+	}
+	return sum / n;
+}
@@ -0,0 +1,77 @@
+#ifndef __TEXTURE_H__
+#define __TEXTURE_H__
+
+// An image mapped onto surfaces through the (u,v) coordinates that the
+// primitives put into isect.  The mip pyramid is built once at load time;
+// lookups pick the level from the pixel footprint in texture space (also
+// in isect), so distant or grazing surfaces read a few prefiltered texels
+// instead of aliasing through the full resolution image.
+//
+// Maps converted to the tiled .tex format (see texturecache.h) stay on disk
+// and are paged in through the TextureCache a tile at a time.
+
+#include <string>
+#include <vector>
+
+#include "../vecmath/vecmath.h"
+
+using std::string;
+
+class isect;
+class TiledTexture;
+
+class TextureMap
+{
+public:
+	TextureMap();
+	~TextureMap();
+
+	// Load a 24-bit BMP, or a .pfm or Radiance .hdr map, and build its mip
+	// pyramid, or open a tiled .tex file.  Returns false if the file
+	// couldn't be read.
+	bool load( const string& filename );
+
+	// Save a loaded BMP with its pyramid as a tiled .tex file.
+	bool writeTiled( const string& filename ) const;
+
+	int getWidth() const { return levels.empty() ? 0 : levels[0].width; }
+	int getHeight() const { return levels.empty() ? 0 : levels[0].height; }
+	int numLevels() const { return (int)levels.size(); }
+
+	// Filtered value at the intersection.  With no footprint (all
+	// derivatives zero) this is a bilinear lookup in the full image.
+	vec3f value( const isect& i ) const;
+
+	// The lookup itself: (u,v) repeats outside [0,1), (dudx,dvdx) and
+	// (dudy,dvdy) are the texture space steps of one pixel.
+	vec3f sample( double u, double v, double dudx, double dvdx,
+		double dudy, double dvdy ) const;
+
+	// Lookups repeat the image by default; a clamped axis stretches its
+	// edge texels instead (cube faces, the poles of a lat-long map).
+	void setClamp( bool u, bool v ) { clampU = u; clampV = v; }
+
+	// Footprints longer than this many times their width are blurred
+	// rather than probed more often.
+	enum { MAX_ANISOTROPY = 8 };
+
+private:
+	struct Level
+	{
+		int width, height;
+		std::vector<float> texels;	// RGB, bottom row first; empty if tiled
+	};
+
+	void texel( int l, int x, int y, float *rgb ) const;
+	vec3f bilinear( int l, double u, double v ) const;
+	vec3f trilinear( double u, double v, double lod ) const;
+
+	std::vector<Level> levels;		// levels[0] is the full image
+	TiledTexture *tiled;			// non-NULL for out-of-core maps
+	bool clampU, clampV;
+
+	TextureMap( const TextureMap& );
+	TextureMap& operator =( const TextureMap& );
+};
+
+#endif // __TEXTURE_H__
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "texturecache.h"
+#include "../RenderThread.h"
+#include "../RenderStats.h"
+
+static const char TEX_MAGIC[4] = { 'R', 'T', 'T', 'X' };
+static const int TEX_VERSION = 1;
+static const int TILE_BYTES = TiledTexture::TILE_SIZE * TiledTexture::TILE_SIZE * 3;
+
+static int s_nextTextureId = 1;
+static std::mutex s_idLock;
+
+TiledTexture::TiledTexture()
+	: fd( -1 )
+{
+	std::lock_guard<std::mutex> guard( s_idLock );
+	id = s_nextTextureId++;
+}
+
+TiledTexture::~TiledTexture()
+{
+	TextureCache::instance().forget( this );
+#ifdef _WIN32
+	if( fd >= 0 )
+		_close( fd );
+#else
+	if( fd >= 0 )
+		close( fd );
+#endif
+}
+
+bool TiledTexture::open( const string& filename )
+{
+	FILE *fp = fopen( filename.c_str(), "rb" );
+	if( !fp )
+		return false;
+
+	char magic[4];
+	int header[3];
+	bool ok = fread( magic, 4, 1, fp ) == 1 && memcmp( magic, TEX_MAGIC, 4 ) == 0
+		&& fread( header, sizeof(int), 3, fp ) == 3
+		&& header[0] == TEX_VERSION && header[1] == TILE_SIZE && header[2] > 0;
+
+	int tiles = 0;
+	if( ok ) {
+		levels.resize( header[2] );
+		for( size_t l = 0; ok && l < levels.size(); ++l ) {
+			int size[2];
+			ok = fread( size, sizeof(int), 2, fp ) == 2 && size[0] > 0 && size[1] > 0;
+			if( ok ) {
+				levels[l].width = size[0];
+				levels[l].height = size[1];
+				levels[l].tilesAcross = (size[0] + TILE_SIZE - 1) / TILE_SIZE;
+				levels[l].firstTile = tiles;
+				tiles += levels[l].tilesAcross * ((size[1] + TILE_SIZE - 1) / TILE_SIZE);
+			}
+		}
+	}
+	if( ok ) {
+		offsets.resize( tiles );
+		ok = fread( &offsets[0], sizeof(long long), tiles, fp ) == (size_t)tiles;
+	}
+	fclose( fp );
+
+	if( !ok ) {
+		levels.clear();
+		offsets.clear();
+		return false;
+	}
+
+#ifdef _WIN32
+	fd = _open( filename.c_str(), _O_RDONLY | _O_BINARY );
+#else
+	fd = ::open( filename.c_str(), O_RDONLY );
+#endif
+	return fd >= 0;
+}
+
+bool TiledTexture::readTile( int t, unsigned char *data ) const
+{
+#ifdef _WIN32
+	std::lock_guard<std::mutex> guard( fileLock );
+	if( _lseeki64( fd, offsets[t], SEEK_SET ) < 0 )
+		return false;
+	return _read( fd, data, TILE_BYTES ) == TILE_BYTES;
+#else
+	size_t done = 0;
+	while( done < (size_t)TILE_BYTES ) {
+		ssize_t n = pread( fd, data + done, TILE_BYTES - done, (off_t)(offsets[t] + done) );
+		if( n <= 0 )
+			return false;
+		done += n;
+	}
+	return true;
+#endif
+}
+
+void TiledTexture::texel( int l, int x, int y, float *rgb ) const
+{
+	const Level& level = levels[l];
+	int t = level.firstTile + (y / TILE_SIZE) * level.tilesAcross + x / TILE_SIZE;
+	const unsigned char *p = TextureCache::instance().tile( this, t )
+		+ ((x % TILE_SIZE) + (y % TILE_SIZE) * TILE_SIZE) * 3;
+
+	rgb[0] = p[0] * (1.0f / 255.0f);
+	rgb[1] = p[1] * (1.0f / 255.0f);
+	rgb[2] = p[2] * (1.0f / 255.0f);
+}
+
+bool TiledTexture::write( const string& filename, int numLevels,
+	const int *widths, const int *heights, const float *const *texels )
+{
+	FILE *fp = fopen( filename.c_str(), "wb" );
+	if( !fp )
+		return false;
+
+	int header[3] = { TEX_VERSION, TILE_SIZE, numLevels };
+	fwrite( TEX_MAGIC, 4, 1, fp );
+	fwrite( header, sizeof(int), 3, fp );
+
+	int tiles = 0;
+	for( int l = 0; l < numLevels; ++l ) {
+		int size[2] = { widths[l], heights[l] };
+		fwrite( size, sizeof(int), 2, fp );
+		tiles += ((widths[l] + TILE_SIZE - 1) / TILE_SIZE) * ((heights[l] + TILE_SIZE - 1) / TILE_SIZE);
+	}
+
+	// tiles follow the table in order, so the offsets are known up front
+	long long start = 4 + 3 * sizeof(int) + 2 * sizeof(int) * numLevels + sizeof(long long) * tiles;
+	for( int t = 0; t < tiles; ++t ) {
+		long long offset = start + (long long)t * TILE_BYTES;
+		fwrite( &offset, sizeof(long long), 1, fp );
+	}
+
+	std::vector<unsigned char> tile( TILE_BYTES );
+	for( int l = 0; l < numLevels; ++l ) {
+		int w = widths[l], h = heights[l];
+		for( int ty = 0; ty < h; ty += TILE_SIZE ) {
+			for( int tx = 0; tx < w; tx += TILE_SIZE ) {
+				for( int y = 0; y < TILE_SIZE; ++y ) {
+					for( int x = 0; x < TILE_SIZE; ++x ) {
+						// pad with the nearest edge texel
+						int sx = tx + x < w ? tx + x : w - 1;
+						int sy = ty + y < h ? ty + y : h - 1;
+						const float *src = texels[l] + (sx + sy * w) * 3;
+						unsigned char *dst = &tile[(x + y * TILE_SIZE) * 3];
+						for( int c = 0; c < 3; ++c ) {
+							float v = src[c] * 255.0f + 0.5f;
+							dst[c] = v <= 0.0f ? 0 : (v >= 255.0f ? 255 : (unsigned char)v);
+						}
+					}
+				}
+				fwrite( &tile[0], TILE_BYTES, 1, fp );
+			}
+		}
+	}
+
+	bool ok = !ferror( fp );
+	if( fclose( fp ) != 0 )
+		ok = false;
+	return ok;
+}
+
+// The tiles each render thread used last, searched before taking the
+// cache lock.  Holding a reference keeps a tile alive even if the cache
+// evicts it meanwhile.
+struct TileHandles
+{
+	unsigned long long keys[TextureCache::HANDLES];
+	std::shared_ptr< std::vector<unsigned char> > tiles[TextureCache::HANDLES];
+	int next;
+	char pad[CACHE_LINE_SIZE];
+};
+
+static TileHandles s_handles[MAX_RENDER_THREADS];
+
+TextureCache::TextureCache()
+	: budget( (size_t)DEFAULT_BUDGET_MB << 20 ), usage( 0 )
+{
+}
+
+TextureCache& TextureCache::instance()
+{
+	static TextureCache cache;
+	return cache;
+}
+
+void TextureCache::setBudget( size_t bytes )
+{
+	std::lock_guard<std::mutex> guard( lock );
+	budget = bytes;
+	while( usage > budget && !lru.empty() ) {
+		index.erase( lru.back().key );
+		usage -= lru.back().data->size();
+		lru.pop_back();
+	}
+}
+
+const unsigned char *TextureCache::tile( const TiledTexture *tex, int t )
+{
+	Key key = ((Key)tex->id << 32) | (unsigned int)t;
+	TileHandles& h = s_handles[renderThreadIndex()];
+	RenderStats& stats = RenderStats::local();
+
+	for( int k = 0; k < HANDLES; ++k ) {
+		if( h.keys[k] == key && h.tiles[k] ) {
+			++stats.textureHandleHits;
+			return &(*h.tiles[k])[0];
+		}
+	}
+
+	TilePtr data;
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		std::map< Key, std::list<Entry>::iterator >::iterator i = index.find( key );
+		if( i != index.end() ) {
+			lru.splice( lru.begin(), lru, i->second );
+			data = i->second->data;
+			++stats.textureCacheHits;
+		}
+	}
+
+	if( !data ) {
+		// read without holding the lock; two threads may race to load
+		// the same tile, which costs a read but is otherwise harmless
+		data = load( tex, t, key );
+		++stats.textureCacheMisses;
+	}
+
+	h.keys[h.next] = key;
+	h.tiles[h.next] = data;
+	h.next = (h.next + 1) % HANDLES;
+	return &(*data)[0];
+}
+
+TextureCache::TilePtr TextureCache::load( const TiledTexture *tex, int t, Key key )
+{
+	TilePtr data( new std::vector<unsigned char>( TILE_BYTES ) );
+	if( !tex->readTile( t, &(*data)[0] ) ) {
+		// a bad read shows up as magenta rather than taking the render down
+		for( int k = 0; k < TILE_BYTES; k += 3 ) {
+			(*data)[k] = 255;
+			(*data)[k + 1] = 0;
+			(*data)[k + 2] = 255;
+		}
+	}
+
+	std::lock_guard<std::mutex> guard( lock );
+	std::map< Key, std::list<Entry>::iterator >::iterator i = index.find( key );
+	if( i != index.end() )
+		return i->second->data;
+
+	Entry e;
+	e.key = key;
+	e.data = data;
+	lru.push_front( e );
+	index[key] = lru.begin();
+	usage += data->size();
+
+	while( usage > budget && lru.size() > 1 ) {
+		index.erase( lru.back().key );
+		usage -= lru.back().data->size();
+		lru.pop_back();
+	}
+	return data;
+}
+
+void TextureCache::forget( const TiledTexture *tex )
+{
+	std::lock_guard<std::mutex> guard( lock );
+	Key id = (Key)tex->id << 32;
+
+	for( std::list<Entry>::iterator i = lru.begin(); i != lru.end(); ) {
+		if( (i->key & 0xffffffff00000000ull) == id ) {
+			index.erase( i->key );
+			usage -= i->data->size();
+			i = lru.erase( i );
+		} else
+			++i;
+	}
+
+	// only called between renders, so the handles are not in use
+	for( int k = 0; k < MAX_RENDER_THREADS; ++k ) {
+		for( int j = 0; j < HANDLES; ++j ) {
+			if( (s_handles[k].keys[j] & 0xffffffff00000000ull) == id ) {
+				s_handles[k].keys[j] = 0;
+				s_handles[k].tiles[j].reset();
+			}
+		}
+	}
+}
@@ -0,0 +1,114 @@
+#ifndef __TEXTURECACHE_H__
+#define __TEXTURECACHE_H__
+
+// Out-of-core texture maps.  A texture is converted once (ray -x) into a
+// tiled, mipmapped file; rendering then only reads the tiles that lookups
+// actually touch, and keeps them in one process-wide cache that evicts the
+// least recently used tiles to stay under a byte budget.
+//
+// File layout, little endian:
+//
+//     "RTTX"  int32 version, tile size, number of levels
+//     per level: int32 width, height
+//     per level, per tile (rows of tiles bottom first): int64 file offset
+//     tiles: tile size^2 RGB texels of 8 bits, edge tiles padded
+//
+// Each render thread keeps a few handles on the tiles it used last, so most
+// texel fetches take no lock at all.
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <mutex>
+#include <memory>
+
+using std::string;
+
+class TiledTexture
+{
+public:
+	TiledTexture();
+	~TiledTexture();
+
+	// Read the header and tile table; tiles are loaded on first use.
+	bool open( const string& filename );
+
+	int numLevels() const { return (int)levels.size(); }
+	int levelWidth( int l ) const { return levels[l].width; }
+	int levelHeight( int l ) const { return levels[l].height; }
+
+	// Texel (x,y) of level l as RGB in [0,1]; x and y must be in range.
+	void texel( int l, int x, int y, float *rgb ) const;
+
+	// Write a tiled file from RGB float levels, levels[0] the full image.
+	static bool write( const string& filename, int numLevels,
+		const int *widths, const int *heights, const float *const *texels );
+
+	enum { TILE_SIZE = 64 };
+
+private:
+	friend class TextureCache;
+
+	struct Level
+	{
+		int width, height;
+		int tilesAcross;
+		int firstTile;		// index of the level's first tile in offsets
+	};
+
+	// Load tile t from the file into data; false on I/O errors.
+	bool readTile( int t, unsigned char *data ) const;
+
+	std::vector<Level> levels;
+	std::vector<long long> offsets;
+	int id;					// distinguishes textures in the cache
+
+	int fd;					// read with pread(), no shared file position
+#ifdef _WIN32
+	mutable std::mutex fileLock;	// ...except on Windows: seek and read
+#endif
+};
+
+class TextureCache
+{
+public:
+	static TextureCache& instance();
+
+	// Bytes of tile data the cache may hold; tiles pinned by render
+	// threads' handles can add up to HANDLES tiles per thread on top.
+	void setBudget( size_t bytes );
+	size_t getBudget() const { return budget; }
+	size_t getUsage() const { return usage; }
+
+	// Tile data for tile t of tex, read from disk if needed.  The pointer
+	// stays valid until the calling thread asks for HANDLES other tiles.
+	const unsigned char *tile( const TiledTexture *tex, int t );
+
+	// Drop every tile of tex, when it goes away.
+	void forget( const TiledTexture *tex );
+
+	enum { HANDLES = 8, DEFAULT_BUDGET_MB = 256 };
+
+private:
+	TextureCache();
+
+	typedef std::shared_ptr< std::vector<unsigned char> > TilePtr;
+	typedef unsigned long long Key;
+
+	struct Entry
+	{
+		Key key;
+		TilePtr data;
+	};
+
+	TilePtr load( const TiledTexture *tex, int t, Key key );
+
+	std::mutex lock;
+	std::list<Entry> lru;					// most recently used first
+	std::map< Key, std::list<Entry>::iterator > index;
+	size_t budget;
+	size_t usage;
+};
+
+#endif // __TEXTURECACHE_H__
@@ -12,11 +12,17 @@ TraceGLWindow::TraceGLWindow(int x, int y, int w, int h, const char *l)
 {
 	m_nWindowWidth = w;
 	m_nWindowHeight = h;
+	m_focusX = m_focusY = 0.5;
 }
 
 int TraceGLWindow::handle(int event)
 {
-	// disable all mouse and keyboard events
+	// a click picks the focus for the next render; everything else is
+	// ignored
+	if (event == FL_PUSH && w() > 0 && h() > 0) {
+		m_focusX = (Fl::event_x() + 0.5) / w();
+		m_focusY = (Fl::event_y() + 0.5) / h();
+	}
 	return 1;
 }
 
@@ -66,14 +72,16 @@ void TraceGLWindow::resizeWindow(int width, int height)
 
 void TraceGLWindow::saveImage(char *iname)
 {
-	unsigned char* buf;
-
-	raytracer->getBuffer(buf, m_nDrawWidth, m_nDrawHeight);
-	if (buf)
-		writeBMP(iname, m_nDrawWidth, m_nDrawHeight, buf); 
+	raytracer->saveImage(iname);
 }
 
 void TraceGLWindow::setRayTracer(RayTracer *tracer)
 {
 	raytracer = tracer;
+}
+
+void TraceGLWindow::getFocus(double &x, double &y)
+{
+	x = m_focusX;
+	y = m_focusY;
 }
\ No newline at end of file
@@ -33,9 +33,14 @@ public:
 
 	void setRayTracer(RayTracer *tracer);
 
+	// where the image was last clicked, as a fraction of its width and
+	// height from the top left
+	void getFocus(double &x, double &y);
+
 private:
 	int m_nWindowWidth, m_nWindowHeight;
 	int m_nDrawWidth, m_nDrawHeight;
+	double m_focusX, m_focusY;
 };
 
 #endif // __TRACE_GL_WINDOW_H__
\ No newline at end of file
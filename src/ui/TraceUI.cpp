@@ -6,13 +6,25 @@
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include <FL/fl_ask.h>
 
 #include "TraceUI.h"
 #include "../RayTracer.h"
 
-static bool done;
+// the scene file last loaded, for reloading and watching
+static char s_sceneFile[1024];
+static time_t s_sceneTime;
+
+static time_t modificationTime(const char *fn)
+{
+	struct stat st;
+	if (stat(fn, &st) != 0)
+		return 0;
+	return st.st_mtime;
+}
 
 //------------------------------------- Help Functions --------------------------------------------
 TraceUI* TraceUI::whoami(Fl_Menu_* o)	// from menu item back to UI itself
@@ -32,31 +44,104 @@ void TraceUI::cb_load_scene(Fl_Menu_* o, void* v)
 
 		if (pUI->raytracer->loadScene(newfile)) {
 			sprintf(buf, "Ray <%s>", newfile);
-			done=true;	// terminate the previous rendering
+			strncpy(s_sceneFile, newfile, sizeof(s_sceneFile) - 1);
+			s_sceneTime = modificationTime(s_sceneFile);
+			pUI->raytracer->cancel();	// terminate the previous rendering
 		} else{
 			sprintf(buf, "Ray <Not Loaded>");
+			fl_alert("Couldn't load %s: %s", newfile, pUI->raytracer->getLoadError().c_str());
 		}
 
 		pUI->m_mainWindow->label(buf);
 	}
 }
 
+void TraceUI::cb_load_background(Fl_Menu_* o, void* v) 
+{
+	TraceUI* pUI=whoami(o);
+	
+	char* newfile = fl_file_chooser("Open Background Image?", "*.{bmp,pfm,hdr}", NULL );
+
+	if (newfile != NULL && !pUI->raytracer->loadBackground(newfile))
+		fl_alert("Couldn't read background image %s", newfile);
+}
+
+// Read the scene file again, keeping what didn't change, and render it
+// if there is an image up already.
+void TraceUI::reloadScene()
+{
+	if (!s_sceneFile[0])
+		return;
+
+	s_sceneTime = modificationTime(s_sceneFile);
+	if (!raytracer->reloadScene(s_sceneFile))
+		fprintf(stderr, "couldn't reload %s: %s\n", s_sceneFile, raytracer->getLoadError().c_str());
+	else if (m_traceGlWindow->shown())
+		m_renderButton->do_callback();
+}
+
+void TraceUI::cb_reload_scene(Fl_Menu_* o, void* v) 
+{
+	TraceUI* pUI=whoami(o);
+
+	pUI->raytracer->cancel();	// terminate the previous rendering
+	pUI->reloadScene();
+}
+
+void TraceUI::cb_watch_scene(Fl_Menu_* o, void* v) 
+{
+	TraceUI* pUI=whoami(o);
+
+	if (o->mvalue()->value())
+		Fl::add_timeout(0.5, cb_watch_timeout, pUI);
+	else
+		Fl::remove_timeout(cb_watch_timeout, pUI);
+}
+
+void TraceUI::cb_watch_timeout(void* v)
+{
+	TraceUI* pUI=(TraceUI*)v;
+
+	// the scene can't change under a render in progress; try again later
+	if (!pUI->m_bRendering && s_sceneFile[0]) {
+		time_t now = modificationTime(s_sceneFile);
+		if (now != 0 && now != s_sceneTime)
+			pUI->reloadScene();
+	}
+	Fl::repeat_timeout(0.5, cb_watch_timeout, v);
+}
+
+void TraceUI::cb_clear_background(Fl_Menu_* o, void* v) 
+{
+	TraceUI* pUI=whoami(o);
+
+	pUI->raytracer->loadBackground(NULL);
+}
+
 void TraceUI::cb_save_image(Fl_Menu_* o, void* v) 
 {
 	TraceUI* pUI=whoami(o);
 	
-	char* savefile = fl_file_chooser("Save Image?", "*.bmp", "save.bmp" );
+	char* savefile = fl_file_chooser("Save Image?", "*.{bmp,png,ppm,pfm,exr}", "save.bmp" );
 	if (savefile != NULL) {
 		pUI->m_traceGlWindow->saveImage(savefile);
 	}
 }
 
+void TraceUI::cb_tile_order(Fl_Menu_* o, void* v)
+{
+	TraceUI* pUI=whoami(o);
+
+	// takes effect from the next render
+	pUI->m_nTileOrder = (int)(size_t)v;
+}
+
 void TraceUI::cb_exit(Fl_Menu_* o, void* v)
 {
 	TraceUI* pUI=whoami(o);
 
 	// terminate the rendering
-	done=true;
+	pUI->raytracer->cancel();
 
 	pUI->m_traceGlWindow->hide();
 	pUI->m_mainWindow->hide();
@@ -67,7 +152,7 @@ void TraceUI::cb_exit2(Fl_Widget* o, void* v)
 	TraceUI* pUI=(TraceUI *)(o->user_data());
 	
 	// terminate the rendering
-	done=true;
+	pUI->raytracer->cancel();
 
 	pUI->m_traceGlWindow->hide();
 	pUI->m_mainWindow->hide();
@@ -125,6 +210,20 @@ void TraceUI::cb_subPixelSlides(Fl_Widget* o, void* v)
 	((TraceUI*)(o->user_data()))->m_nSubPixel = int(((Fl_Slider *)o)->value());
 }
 
+// Exposure only changes the tone map, so the image is re-quantized from the
+// float buffer instead of being rendered again.
+void TraceUI::cb_exposureSlides(Fl_Widget* o, void* v)
+{
+	TraceUI* pUI=(TraceUI*)(o->user_data());
+
+	pUI->m_nExposure = double(((Fl_Slider *)o)->value());
+
+	ToneMap tm = pUI->raytracer->getToneMap();
+	tm.exposure = pUI->m_nExposure;
+	pUI->raytracer->setToneMap(tm);
+	pUI->m_traceGlWindow->refresh();
+}
+
 void TraceUI::cb_render(Fl_Widget* o, void* v)
 {
 	char buffer[256];
@@ -138,14 +237,33 @@ void TraceUI::cb_render(Fl_Widget* o, void* v)
 
 		pUI->m_traceGlWindow->show();
 
-		pUI->raytracer->traceSetup(width, height);
 		pUI->raytracer->setAdaptiveThreshold(pUI->getAdaptiveThreshold());
+		pUI->raytracer->setDepth(pUI->getDepth());
+		pUI->raytracer->setSubPixel(pUI->getSubPixelVal());
+		pUI->raytracer->setRelight(pUI->m_relightButton->value() != 0);
+		pUI->raytracer->traceSetup(width, height);
+
+		ToneMap tm = pUI->raytracer->getToneMap();
+		tm.exposure = pUI->getExposure();
+		pUI->raytracer->setToneMap(tm);
 		
 		// Save the window label
 		const char *old_label = pUI->m_traceGlWindow->label();
 
-		// start to render here	
-		done=false;
+		// the tiles in the order picked from the Tiles menu
+		double fx = 0.5, fy = 0.5;
+		if (pUI->m_nTileOrder == TILES_CLICK)
+			pUI->m_traceGlWindow->getFocus(fx, fy);
+		pUI->raytracer->setTileFocus(fx, fy);
+		pUI->raytracer->setTileOrder(pUI->m_nTileOrder == TILES_ROWS ? RayTracer::TILES_ROWS :
+			pUI->m_nTileOrder == TILES_COST ? RayTracer::TILES_COST : RayTracer::TILES_SPIRAL);
+		std::vector<int> tiles;
+		pUI->raytracer->orderTiles(tiles);
+
+		// start to render here, taking back the cancel that stopped the
+		// last one
+		pUI->raytracer->getCancelToken().reset();
+		pUI->m_bRendering=true;
 		clock_t prev, now;
 		prev=clock();
 		
@@ -153,35 +271,41 @@ void TraceUI::cb_render(Fl_Widget* o, void* v)
 		Fl::check();
 		Fl::flush();
 
-		for (int y=0; y<height; y++) {
-			for (int x=0; x<width; x++) {
-				if (done) break;
-				
-				// current time
-				now = clock();
-
-				// check event every 1/2 second
-				if (((double)(now-prev)/CLOCKS_PER_SEC)>0.5) {
-					prev=now;
-
-					if (Fl::ready()) {
-						// refresh
-						pUI->m_traceGlWindow->refresh();
-						// check event
-						Fl::check();
-
-						if (Fl::damage()) {
-							Fl::flush();
+		for (size_t k=0; k<tiles.size(); k++) {
+			int x0, y0, x1, y1;
+			pUI->raytracer->getTileRect(tiles[k], x0, y0, x1, y1);
+
+			for (int y=y0; y<y1; y++) {
+				for (int x=x0; x<x1; x++) {
+					if (pUI->raytracer->isCancelled()) break;
+					
+					// current time
+					now = clock();
+
+					// check event every 1/2 second
+					if (((double)(now-prev)/CLOCKS_PER_SEC)>0.5) {
+						prev=now;
+
+						if (Fl::ready()) {
+							// refresh
+							pUI->m_traceGlWindow->refresh();
+							// check event
+							Fl::check();
+
+							if (Fl::damage()) {
+								Fl::flush();
+							}
 						}
 					}
-				}
 
-				pUI->raytracer->tracePixel( x, y );
-		
+					pUI->raytracer->tracePixel( x, y );
+			
+				}
+				if (pUI->raytracer->isCancelled()) break;
 			}
-			if (done) break;
+			if (pUI->raytracer->isCancelled()) break;
 
-			// flush when finish a row
+			// flush when finish a tile
 			if (Fl::ready()) {
 				// refresh
 				pUI->m_traceGlWindow->refresh();
@@ -191,11 +315,13 @@ void TraceUI::cb_render(Fl_Widget* o, void* v)
 				}
 			}
 			// update the window label
-			sprintf(buffer, "(%d%%) %s", (int)((double)y / (double)height * 100.0), old_label);
+			sprintf(buffer, "(%d%%) %s", (int)((double)(k + 1) / (double)tiles.size() * 100.0), old_label);
 			pUI->m_traceGlWindow->label(buffer);
 			
 		}
-		done=true;
+		// a render this one interrupted from Fl::check() stops as well
+		pUI->raytracer->cancel();
+		pUI->m_bRendering=false;
 		pUI->m_traceGlWindow->refresh();
 
 		// Restore the window label
@@ -205,7 +331,7 @@ void TraceUI::cb_render(Fl_Widget* o, void* v)
 
 void TraceUI::cb_stop(Fl_Widget* o, void* v)
 {
-	done=true;
+	((TraceUI*)(o->user_data()))->raytracer->cancel();
 }
 
 void TraceUI::show()
@@ -261,6 +387,10 @@ int TraceUI::getSubPixelVal() {
 	return m_nSubPixel;
 }
 
+double TraceUI::getExposure() {
+	return m_nExposure;
+}
+
 
 void TraceUI::setConstAttenuationVal(double value){
 	m_nConstAttenuation = value;
@@ -276,10 +406,21 @@ void TraceUI::setQuadAttenuationVal(double value) {
 Fl_Menu_Item TraceUI::menuitems[] = {
 	{ "&File",		0, 0, 0, FL_SUBMENU },
 		{ "&Load Scene...",	FL_ALT + 'l', (Fl_Callback *)TraceUI::cb_load_scene },
+		{ "Load &Background...",	FL_ALT + 'b', (Fl_Callback *)TraceUI::cb_load_background },
+		{ "&Clear Background",	0, (Fl_Callback *)TraceUI::cb_clear_background },
+		{ "&Reload Scene",	FL_CTRL + 'r', (Fl_Callback *)TraceUI::cb_reload_scene },
+		{ "&Watch Scene File",	0, (Fl_Callback *)TraceUI::cb_watch_scene, 0, FL_MENU_TOGGLE },
 		{ "&Save Image...",	FL_ALT + 's', (Fl_Callback *)TraceUI::cb_save_image },
 		{ "&Exit",			FL_ALT + 'e', (Fl_Callback *)TraceUI::cb_exit },
 		{ 0 },
 
+	{ "&Tiles",		0, 0, 0, FL_SUBMENU },
+		{ "&Top to Bottom",	0, (Fl_Callback *)TraceUI::cb_tile_order, (void *)TILES_ROWS, FL_MENU_RADIO | FL_MENU_VALUE },
+		{ "Spiral from &Center",	0, (Fl_Callback *)TraceUI::cb_tile_order, (void *)TILES_CENTER, FL_MENU_RADIO },
+		{ "Spiral from C&lick",	0, (Fl_Callback *)TraceUI::cb_tile_order, (void *)TILES_CLICK, FL_MENU_RADIO },
+		{ "&Slowest First",	0, (Fl_Callback *)TraceUI::cb_tile_order, (void *)TILES_COST, FL_MENU_RADIO },
+		{ 0 },
+
 	{ "&Help",		0, 0, 0, FL_SUBMENU },
 		{ "&About",	FL_ALT + 'a', (Fl_Callback *)TraceUI::cb_about },
 		{ 0 },
@@ -299,8 +440,11 @@ TraceUI::TraceUI() {
 	m_nDistance = 1.87;
 	m_nAdaptive = 0.0;
 	m_nSubPixel = 1;
+	m_nExposure = 0.0;
+	m_bRendering = false;
+	m_nTileOrder = TILES_ROWS;
 
-	m_mainWindow = new Fl_Window(100, 40, 400, 300, "Ray <Not Loaded>");
+	m_mainWindow = new Fl_Window(100, 40, 400, 310, "Ray <Not Loaded>");
 		m_mainWindow->user_data((void*)(this));	// record self to be used by static callback functions
 		// install menu bar
 		m_menubar = new Fl_Menu_Bar(0, 0, 320, 25);
@@ -436,6 +580,19 @@ TraceUI::TraceUI() {
 		m_subPixelSlider->align(FL_ALIGN_RIGHT);
 		m_subPixelSlider->callback(cb_subPixelSlides);
 
+		// install exposure slider
+		m_exposureSlider = new Fl_Value_Slider(10, 280, 180, 20, "Exposure (stops)");
+		m_exposureSlider->user_data((void*)(this));	// record self to be used by static callback functions
+		m_exposureSlider->type(FL_HOR_NICE_SLIDER);
+		m_exposureSlider->labelfont(FL_COURIER);
+		m_exposureSlider->labelsize(12);
+		m_exposureSlider->minimum(-5);
+		m_exposureSlider->maximum(5);
+		m_exposureSlider->step(0.1);
+		m_exposureSlider->value(m_nExposure);
+		m_exposureSlider->align(FL_ALIGN_RIGHT);
+		m_exposureSlider->callback(cb_exposureSlides);
+
 		m_renderButton = new Fl_Button(240, 27, 70, 25, "&Render");
 		m_renderButton->user_data((void*)(this));
 		m_renderButton->callback(cb_render);
@@ -444,6 +601,11 @@ TraceUI::TraceUI() {
 		m_stopButton->user_data((void*)(this));
 		m_stopButton->callback(cb_stop);
 
+		// keep the camera rays' hits between renders
+		m_relightButton = new Fl_Check_Button(240, 83, 80, 25, "Re&light");
+		m_relightButton->user_data((void*)(this));
+		m_relightButton->value(0);
+
 		m_mainWindow->callback(cb_exit2);
 		m_mainWindow->when(FL_HIDE);
     m_mainWindow->end();
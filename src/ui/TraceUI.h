@@ -36,9 +36,11 @@ public:
 	Fl_Slider*			m_distanceSlider;
 	Fl_Slider*			m_adaptiveTerminationSlider;
 	Fl_Slider*			m_subPixelSlider;
+	Fl_Slider*			m_exposureSlider;
 
 	Fl_Button*			m_renderButton;
 	Fl_Button*			m_stopButton;
+	Fl_Check_Button*	m_relightButton;
 
 	TraceGLWindow*		m_traceGlWindow;
 
@@ -57,12 +59,17 @@ public:
 	double		getDistanceScale();
 	double		getAdaptiveThreshold();
 	int			getSubPixelVal();
+	double		getExposure();
 
 	void		setConstAttenuationVal(double value);
 	void		setLinearAttenuationVal(double value);
 	void		setQuadAttenuationVal(double value);
 
 private:
+	// the Tiles menu; the spiral from the center and from the last click
+	// in the image are both RayTracer::TILES_SPIRAL
+	enum { TILES_ROWS, TILES_CENTER, TILES_CLICK, TILES_COST };
+
 	RayTracer*	raytracer;
 
 	int			m_nSize;
@@ -75,6 +82,11 @@ private:
 	double	    m_nDistance;
 	double		m_nAdaptive;
 	int			m_nSubPixel;
+	double		m_nExposure;
+	bool		m_bRendering;
+	int			m_nTileOrder;	// a TILES_ entry of the Tiles menu
+
+	void		reloadScene();
 
 // static class members
 	static Fl_Menu_Item menuitems[];
@@ -82,7 +94,13 @@ private:
 	static TraceUI* whoami(Fl_Menu_* o);
 
 	static void cb_load_scene(Fl_Menu_* o, void* v);
+	static void cb_load_background(Fl_Menu_* o, void* v);
+	static void cb_clear_background(Fl_Menu_* o, void* v);
+	static void cb_reload_scene(Fl_Menu_* o, void* v);
+	static void cb_watch_scene(Fl_Menu_* o, void* v);
+	static void cb_watch_timeout(void* v);
 	static void cb_save_image(Fl_Menu_* o, void* v);
+	static void cb_tile_order(Fl_Menu_* o, void* v);
 	static void cb_exit(Fl_Menu_* o, void* v);
 	static void cb_about(Fl_Menu_* o, void* v);
 
@@ -98,6 +116,7 @@ private:
 	static void cb_distanceSlides(Fl_Widget* o, void* v);
 	static void cb_adaptiveSlides(Fl_Widget* o, void* v);
 	static void cb_subPixelSlides(Fl_Widget* o, void* v);
+	static void cb_exposureSlides(Fl_Widget* o, void* v);
 
 	static void cb_render(Fl_Widget* o, void* v);
 	static void cb_stop(Fl_Widget* o, void* v);